@@ -25,6 +25,9 @@ void Cmd::destruct()
   flags.reset();
   // invalidating this callback is actually important
   cb_io = nullptr;
+  for (unsigned i = 0; i < num_merged; ++i)
+    merged[i].cb_io = nullptr;
+  num_merged = 0;
 }
 
 int Cmd::nr() const
@@ -82,6 +82,44 @@ public:
     l4_uint32_t _raw = 0;
 
   public:
+    /// Write interrupted by HPI: Waiting for the device to leave the
+    /// programming state, then reading the programmed sectors (CMD13, CMD8).
+    CXX_BITFIELD_MEMBER(28, 28, hpi_write, _raw);
+    /// Command sequence switching the bus speed mode (CMD6, CMD13, CMD21).
+    CXX_BITFIELD_MEMBER(27, 27, speed, _raw);
+    /// The command failed with a timeout in the command or data phase.
+    CXX_BITFIELD_MEMBER(26, 26, timeout, _raw);
+    /// Inout: Transfer was already repeated after re-tuning.
+    CXX_BITFIELD_MEMBER(25, 25, retuned, _raw);
+    /// The command failed with a CRC error in the command or data phase.
+    CXX_BITFIELD_MEMBER(24, 24, crc_error, _raw);
+    /// Re-tuning the sampling point (CMD19, CMD21).
+    CXX_BITFIELD_MEMBER(23, 23, retune, _raw);
+    /// Command sequence selecting a hardware partition (CMD6, CMD13).
+    CXX_BITFIELD_MEMBER(22, 22, hw_part, _raw);
+    /// Command sequence of background operations (CMD8, CMD6, CMD13).
+    CXX_BITFIELD_MEMBER(21, 21, bkops, _raw);
+    /// Sequence was interrupted by HPI before, don't interrupt it again.
+    CXX_BITFIELD_MEMBER(20, 20, no_hpi, _raw);
+    /// Sequence interrupted by HPI, waiting for the device to leave the
+    /// programming state.
+    CXX_BITFIELD_MEMBER(19, 19, hpi, _raw);
+    /// Flush: Only a cache barrier, completion reported to `cb_io`.
+    CXX_BITFIELD_MEMBER(18, 18, barrier, _raw);
+    /// Inout: Reliable write (CMD23), used for forced unit access.
+    CXX_BITFIELD_MEMBER(17, 17, reliable_write, _raw);
+    /// Packed: Reading the packed command status (CMD8) after an error.
+    CXX_BITFIELD_MEMBER(16, 16, packed_status, _raw);
+    /// Inout: Packed write command, `header` precedes the data.
+    CXX_BITFIELD_MEMBER(15, 15, packed, _raw);
+    /// Erase: Erased sectors must read as zeroes (write zeroes).
+    CXX_BITFIELD_MEMBER(14, 14, erase_zeroes, _raw);
+    /// Command sequence of an erase (CMD35, CMD36, CMD38, CMD13).
+    CXX_BITFIELD_MEMBER(13, 13, erase, _raw);
+    /// Command sequence of an asynchronous cache flush (CMD6, CMD13).
+    CXX_BITFIELD_MEMBER(12, 12, flush, _raw);
+    /// Driver: DMA descriptors for this command are set up.
+    CXX_BITFIELD_MEMBER(11, 11, descs_prepared, _raw);
     /// Bounce buffer used for this request.
     CXX_BITFIELD_MEMBER(10, 10, read_from_bounce_buffer, _raw);
     /// The previous command was CMD55 (APP_CMD). Only for logging.
@@ -169,6 +207,31 @@ public:
     sectors_done = 0;
     blocks = blocks_val;
     cb_io = cb_io_val;
+    num_merged = 0;
+  }
+
+  /**
+   * Command of an inout command sequence reading into a memory region (CMD8
+   * after a failed packed write). The inout blocks are retained but not used
+   * for the transfer.
+   */
+  void reinit_region(l4_uint32_t cmd_val, l4_uint32_t arg_val,
+                     l4_uint32_t blocksize_val, l4_uint64_t data_phys_val)
+  {
+    if (data_phys_val & 0xffffffff00000000ULL)
+      L4Re::throw_error(-L4_ENOMEM, "Physical address beyond 4G");
+    cmd = cmd_val;
+    arg = arg_val;
+    blockcnt = 1;
+    blocksize = blocksize_val;
+    data_phys = data_phys_val;
+    data_virt = 0;
+    flags.inout() = 0;
+    flags.has_data() = 1;
+    flags.auto_cmd23() = 0;
+    flags.inout_cmd12() = 0;
+    flags.descs_prepared() = 0;
+    status = Ready_for_submit;
   }
 
   /** Inout command without data (CMD23). */
@@ -194,6 +257,22 @@ public:
     status = Ready_for_submit;
   }
 
+  /**
+   * Call `f` for all blocks of an inout command including the blocks of merged
+   * requests. The header of a packed command is visited first.
+   */
+  template <typename F>
+  void for_each_block(F &&f) const
+  {
+    if (flags.packed())
+      f(&header);
+    for (Block const *b = blocks; b; b = b->next.get())
+      f(b);
+    for (unsigned i = 0; i < num_merged; ++i)
+      for (Block const *b = merged[i].blocks; b; b = b->next.get())
+        f(b);
+  }
+
   l4_uint32_t cmd_idx() const
   { return cmd & Mmc::Idx_mask; }
 
@@ -257,11 +336,28 @@ public:
   l4_uint32_t  sector;          ///< Current sector on medium.
   l4_uint32_t  sectors_done;    ///< Overall number of transferred sectors.
   Block        const *blocks;   ///< See inout(): Next block.
+  Block        const *sdma_block = nullptr; ///< SDMA: Segment in transfer.
 
   // internal
   Cmd_queue    *queue = nullptr;
 
   Callback_io  cb_io = nullptr; ///< Inout callback (inout()).
+
+  /// Inout request merged into this command.
+  struct Merged
+  {
+    l4_uint32_t sector;         ///< First sector of the merged request.
+    Block       const *blocks;  ///< Blocks of the merged request.
+    l4_uint32_t num_sectors;    ///< Overall number of sectors of the request.
+    Callback_io cb_io;          ///< Inout callback of the request.
+  };
+
+  enum { Max_merged = 7 };
+  /// Requests following `blocks` on medium or, for a packed command, the
+  /// further entries of the packed command.
+  Merged       merged[Max_merged];
+  unsigned     num_merged = 0;  ///< Number of valid entries in `merged`.
+  Block        header;          ///< Packed: header block (flags.packed).
 };
 
 /**
@@ -297,6 +393,33 @@ public:
   Cmd *working()
   { return _working == _create ? nullptr : &_cmds[_working]; }
 
+  /** Return the most recently created command if not yet done. */
+  Cmd *last_created()
+  {
+    if (_working == _create)
+      return nullptr;
+    return &_cmds[wrap_around(_create + Entries - 1)];
+  }
+
+  /** Return the command following the working command, if any. */
+  Cmd *next_working()
+  {
+    if (_working == _create)
+      return nullptr;
+    unsigned next = wrap_around(_working + 1);
+    return next == _create ? nullptr : &_cmds[next];
+  }
+
+  /** Return true if `f` holds for any created command not yet done. */
+  template <typename F>
+  bool any_work(F &&f) const
+  {
+    for (unsigned w = _working; w != _create; w = wrap_around(w + 1))
+      if (f(&_cmds[w]))
+        return true;
+    return false;
+  }
+
   unsigned num_work() const
   {
     unsigned cnt = 0;
@@ -48,8 +48,10 @@ Device<Driver>::Device(int nr, l4_uint64_t mmio_addr, l4_uint64_t mmio_size,
                        L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma,
                        L4Re::Util::Object_registry *registry,
                        l4_uint32_t host_clock, unsigned max_seg,
-                       Device_type_disable dt_disable)
+                       Device_type_disable dt_disable,
+                       Io_sched_config const &sched_cfg)
 : Block_device::Device_dma_map_all_impl<Device<Driver>>(dma),
+  _mmio_addr(mmio_addr),
   _drv(nr, iocap, mmio_space, mmio_addr, mmio_size, dma, max_seg,
        host_clock, [this](bool is_data) { receive_irq(is_data); }),
   _irq_num(irq_num),
@@ -62,11 +64,16 @@ Device<Driver>::Device(int nr, l4_uint64_t mmio_addr, l4_uint64_t mmio_size,
           L4Re::Dma_space::Direction::From_device,
           L4Re::Rm::F::Cache_uncached),
   _ecsd(*_io_buf.get<Mmc::Reg_ecsd const >()),
+  _ecsd_buf(nullptr, 512, _dma,
+            L4Re::Dma_space::Direction::From_device,
+            L4Re::Rm::F::Cache_uncached),
+  _ecsd_rt(*_ecsd_buf.get<Mmc::Reg_ecsd const >()),
   warn(Dbg::Warn, "device", nr),
   info(Dbg::Info, "device", nr),
   trace(Dbg::Trace, "device", nr),
   trace2(Dbg::Trace2, "device", nr),
-  _device_type_disable(dt_disable)
+  _device_type_disable(dt_disable),
+  _sched_cfg(sched_cfg)
 {
   _drv.mask_interrupts();
 
@@ -74,6 +81,11 @@ Device<Driver>::Device(int nr, l4_uint64_t mmio_addr, l4_uint64_t mmio_size,
     L4Re::throw_error_fmt(-L4_EINVAL,
                           "IO buffer at %08llx-%08llx not accessible by DMA",
                           _io_buf.pget(), _io_buf.pget() + _io_buf.size());
+  if (!_drv.dma_accessible(_ecsd_buf.pget(), _ecsd_buf.size()))
+    L4Re::throw_error_fmt(-L4_EINVAL,
+                          "EXT_CSD buffer at %08llx-%08llx not accessible by DMA",
+                          _ecsd_buf.pget(),
+                          _ecsd_buf.pget() + _ecsd_buf.size());
 
   L4Re::chkcap(_irq = L4Re::Util::cap_alloc.alloc<L4::Irq>(),
                "Allocate IRQ capability slot.");
@@ -98,6 +110,7 @@ Device<Driver>::Device(int nr, l4_uint64_t mmio_addr, l4_uint64_t mmio_size,
     _irq->unmask();
 
   claim_bounce_buffer("bbds");
+  _tuning_cache.attach("tuning_cache", info);
 
   const bool limited_by_bb =
     _drv.provided_bounce_buffer()
@@ -128,9 +141,34 @@ Device<Driver>::show_statistics()
 {
   l4_cpu_time_t time = l4_kip_clock(l4re_kip());
   if (_stat_ints)
-    info.printf("%llu ints/s\n", _stat_ints * 1000000 / (time - _stat_time));
+    {
+      l4_uint64_t delta = time - _stat_time;
+      if (_stat_ios)
+        {
+          l4_uint64_t ratio = _stat_ints * 100 / _stat_ios;
+          info.printf("%llu ints/s, %llu I/Os/s, %llu.%02llu ints/I/O\n",
+                      _stat_ints * 1000000 / delta, _stat_ios * 1000000 / delta,
+                      ratio / 100, ratio % 100);
+        }
+      else
+        info.printf("%llu ints/s\n", _stat_ints * 1000000 / delta);
+    }
+  if (_stat_polls)
+    info.printf("%llu polled command completions/s\n",
+                _stat_polls * 1000000 / (time - _stat_time));
+  l4_uint64_t mmio_ops = _drv.mmio_ops();
+  if (_stat_ios && mmio_ops != _stat_mmio_ops)
+    {
+      l4_uint64_t ratio = (mmio_ops - _stat_mmio_ops) * 100 / _stat_ios;
+      info.printf("%llu.%02llu MMIO accesses/I/O\n", ratio / 100, ratio % 100);
+    }
+  _stat_mmio_ops = mmio_ops;
+  if (_speed_report)
+    speed_statistics(time);
   _stat_time = time;
   _stat_ints = 0;
+  _stat_ios = 0;
+  _stat_polls = 0;
   auto cb = std::bind(&Device<Driver>::show_statistics, this);
   Block_device::Errand::schedule(cb, Stats_delay_us);
 }
@@ -280,6 +318,27 @@ Device<Driver>::dma_unmap(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
 }
 
 
+template <class Driver>
+void
+Device<Driver>::check_inout_blocks(Block_device::Inout_block const &blocks)
+{
+  unsigned segments = 0;
+  for (Block_device::Inout_block const *b = &blocks; b; b = b->next.get())
+    {
+      l4_size_t size = b->num_sectors * sector_size();
+      if (size > max_size())
+        {
+          warn.printf("num_sectors=%u, sector_size=%zu, size=%zx, max_size=%zx\n",
+                      b->num_sectors, sector_size(), size, max_size());
+          L4Re::throw_error(-L4_EINVAL, "Segment size in inout_data()");
+        }
+      ++segments;
+    }
+
+  // enforced in Block_device::Virtio_client::build_inout_blocks()
+  assert(segments <= max_segments());
+}
+
 template <class Driver>
 int
 Device<Driver>::inout_data(l4_uint64_t sector,
@@ -287,6 +346,100 @@ Device<Driver>::inout_data(l4_uint64_t sector,
                            Block_device::Inout_callback const &cb,
                            L4Re::Dma_space::Direction dir)
 {
+  return inout_data_part(0, sector, blocks, cb, dir, false);
+}
+
+/**
+ * Handle an inout request for a hardware partition. The request is held back
+ * if another hardware partition is currently selected, see hw_part_queue().
+ */
+template <class Driver>
+int
+Device<Driver>::inout_data_part(unsigned part, l4_uint64_t sector,
+                                Block_device::Inout_block const &blocks,
+                                Block_device::Inout_callback const &cb,
+                                L4Re::Dma_space::Direction dir, bool fua)
+{
+  bool inout_read = dir == L4Re::Dma_space::Direction::From_device;
+  _io_time = l4_kip_clock(l4re_kip());
+
+  // Forced unit access: Without device cache, every completed write is stored
+  // persistently. Otherwise use a reliable write or flush the cache after the
+  // write completed.
+  bool reliable = false;
+  Block_device::Inout_callback cb_io = cb;
+  if (!inout_read && (_fua || fua) && _has_cache)
+    {
+      if (_rel_write)
+        reliable = true;
+      else
+        cb_io = [this, cb](int error, l4_size_t size)
+          {
+            if (error)
+              cb(error, size);
+            else
+              flush_fua([cb, size](int err, l4_size_t)
+                          { cb(err, err ? 0 : size); });
+          };
+    }
+
+  if (!hw_part_ready(part))
+    return hw_part_queue(part, [this, sector, &blocks, cb_io, inout_read,
+                                reliable]
+      { return inout_data_cur(sector, blocks, cb_io, inout_read, reliable); },
+      cb_io);
+
+  return inout_data_cur(sector, blocks, cb_io, inout_read, reliable);
+}
+
+/**
+ * Pass an inout request for the currently selected hardware partition to the
+ * command queue engine, the software command queue, the I/O scheduler or the
+ * command queue.
+ */
+template <class Driver>
+int
+Device<Driver>::inout_data_cur(l4_uint64_t sector,
+                               Block_device::Inout_block const &blocks,
+                               Block_device::Inout_callback const &cb,
+                               bool inout_read, bool reliable)
+{
+  if (_cqe_active)
+    return inout_data_cqe(sector, blocks, cb, inout_read, reliable);
+  if (_swcq_active)
+    return inout_data_swcq(sector, blocks, cb, inout_read, reliable);
+
+  if (inout_read)
+    hpi_write_arm();
+
+  if (!_sched.active())
+    return inout_data_cmd(sector, blocks, cb, inout_read, reliable);
+
+  if (!_sched.enqueue({ sector, &blocks, cb, inout_read, reliable, 0 },
+                      l4_kip_clock(l4re_kip())))
+    return -L4_EBUSY;
+
+  sched_dispatch();
+  return L4_EOK;
+}
+
+/**
+ * Queue an inout request on the command queue.
+ */
+template <class Driver>
+int
+Device<Driver>::inout_data_cmd(l4_uint64_t sector,
+                               Block_device::Inout_block const &blocks,
+                               Block_device::Inout_callback const &cb,
+                               bool inout_read, bool reliable)
+{
+  if (_drv.dma_adma2()
+      && merge_inout(sector, blocks, cb, inout_read, reliable))
+    {
+      cmd_queue_kick();
+      return L4_EOK;
+    }
+
   Cmd *cmd = _drv.cmd_create();
   if (!cmd)
     return -L4_EBUSY;
@@ -295,25 +448,10 @@ Device<Driver>::inout_data(l4_uint64_t sector,
     {
       cmd->cb_io = cb;
 
-      bool inout_read = dir == L4Re::Dma_space::Direction::From_device;
-
-      unsigned segments = 0;
-      for (Block_device::Inout_block const *b = &blocks; b; b = b->next.get())
-        {
-          l4_size_t size = b->num_sectors * sector_size();
-          if (size > max_size())
-            {
-              warn.printf("num_sectors=%u, sector_size=%zu, size=%zx, max_size=%zx\n",
-                          b->num_sectors, sector_size(), size, max_size());
-              L4Re::throw_error(-L4_EINVAL, "Segment size in inout_data()");
-            }
-          ++segments;
-        }
-
-      // enforced in Block_device::Virtio_client::build_inout_blocks()
-      assert(segments <= max_segments());
+      check_inout_blocks(blocks);
 
       cmd->init_inout(sector, &blocks, cb, inout_read);
+      cmd->flags.reliable_write() = reliable;
 
       if (_drv.dma_adma2())
         {
@@ -323,7 +461,8 @@ Device<Driver>::inout_data(l4_uint64_t sector,
         }
       else
         {
-          /* For every block do CMD23 followed by CMD18/CMD25. */
+          /* For every block (or every run of blocks, see sdma_num_sectors())
+           * do CMD23 followed by CMD18/CMD25. */
           transfer_block_sdma(cmd);
         }
 
@@ -345,432 +484,3167 @@ Device<Driver>::inout_data(l4_uint64_t sector,
   return L4_EOK;
 }
 
-// Execute the SWITCH command to flush the device cache synchronously.
+/**
+ * Pass requests held back by the I/O scheduler to the command queue. Called
+ * for new requests and whenever the command queue is kicked, that is, after
+ * any command completed.
+ *
+ * Only few commands are queued so that the scheduler can still reorder the
+ * remaining requests. A request continuing the most recently queued command is
+ * merged into that command, see merge_inout().
+ */
 template <class Driver>
-int
-Device<Driver>::flush(Block_device::Inout_callback const &cb)
+void
+Device<Driver>::sched_dispatch()
 {
-  if (!_has_cache)
+  // inout_data_cmd() kicks the command queue which calls this function again.
+  if (_sched_dispatching)
+    return;
+
+  _sched_dispatching = true;
+  while (!_sched.empty() && _drv.cmd_num_queued() < Sched_depth)
     {
-      cb(L4_EOK, 0);
-      return L4_EOK;
+      Io_sched::Request r = _sched.dequeue(l4_kip_clock(l4re_kip()));
+      int ret = inout_data_cmd(r.sector, *r.blocks, r.cb, r.inout_read,
+                               r.reliable);
+      if (ret == -L4_EBUSY)
+        {
+          // No free command slot: Retry after the next command completed.
+          _sched.requeue(r);
+          break;
+        }
+      if (ret < 0)
+        r.cb(ret, 0);
     }
+  _sched_dispatching = false;
+}
 
-  info.printf("\033[32mflush\033[m\n");
+/**
+ * Try to merge an inout request into the most recently queued inout command.
+ *
+ * This is possible if that command was not submitted yet and transfers data in
+ * the same direction. If the command ends at `sector`, the merged requests are
+ * transferred using a single ADMA2 descriptor list. Otherwise a write request
+ * can become an entry of a packed command if the device supports packed
+ * writes. The merged requests are completed separately, see complete_inout().
+ *
+ * \retval true   The request was merged.
+ * \retval false  The request must be handled by a separate command.
+ */
+template <class Driver>
+bool
+Device<Driver>::merge_inout(l4_uint64_t sector,
+                            Block_device::Inout_block const &blocks,
+                            Block_device::Inout_callback const &cb,
+                            bool inout_read, bool reliable)
+{
+  Cmd *cmd = _drv.cmd_last_created();
+  if (   !cmd || cmd == _drv.cmd_current() || cmd == _swcq_cmd
+      || !cmd->flags.inout() || cmd->status != Cmd::Ready_for_submit
+      || cmd->flags.inout_read() != inout_read
+      || cmd->flags.reliable_write() != reliable
+      || cmd->num_merged >= Cmd::Max_merged)
+    return false;
 
-  Cmd *cmd = _drv.cmd_create();
-  if (!cmd)
-    return -L4_EBUSY;
+  bool packed = cmd->flags.packed()
+                || l4_uint64_t{cmd->sector} + cmd->blockcnt != sector;
+  if (packed && (inout_read || reliable
+                 || cmd->num_merged + 2 > _max_packed_wr))
+    return false;
 
-  try
-    {
-      Mmc::Reg_ecsd::Ec32_flush_cache fc(0);
-      fc.flush() = 1;
-      exec_mmc_switch(cmd, fc.index(), fc.raw);
-      cmd->check_error("CMD6: SWITCH/FLUSH_CACHE");
-      cmd->work_done();
-      cmd->destruct();
-    }
-  catch (L4::Runtime_error const &e)
+  // A command becoming a packed command requires an additional header block.
+  unsigned header = packed && !cmd->flags.packed();
+  l4_uint32_t num_sectors = 0;
+  unsigned segments = header;
+  for (auto const *b = &blocks; b; b = b->next.get())
     {
-      warn.printf("flush fails: %s: %s.\n", e.str(), e.extra_str());
-
-      cmd->work_done();
-      cmd->destruct();
-
-      return -L4_EINVAL;
+      if (b->num_sectors * sector_size() > max_size())
+        return false; // report the error with a separate command
+      num_sectors += b->num_sectors;
+      ++segments;
     }
+  cmd->for_each_block([&segments](Cmd::Block const *) { ++segments; });
 
-  cb(L4_EOK, 0); // What to pass for 'size'?
+  l4_uint64_t size = (l4_uint64_t{cmd->blockcnt} + num_sectors + header)
+                     * sector_size();
+  if (size > max_size() * max_segments() || segments > max_segments())
+    return false;
 
-  return L4_EOK;
+  if (packed)
+    trace.printf("Pack inout: sector=%llu num_sectors=%u as entry %u.\n",
+                 sector, num_sectors, cmd->num_merged + 2);
+  else
+    trace.printf("Merge inout: sector=%llu num_sectors=%u into %u+%u.\n",
+                 sector, num_sectors, cmd->sector, cmd->blockcnt);
+
+  cmd->merged[cmd->num_merged++] = { static_cast<l4_uint32_t>(sector),
+                                     &blocks, num_sectors, cb };
+  // Descriptors prepared in advance don't cover the merged request.
+  cmd->flags.descs_prepared() = 0;
+  if (packed)
+    set_packed_header(cmd);
+  set_block_count_adma2(cmd);
+  return true;
 }
 
+/**
+ * Set up the header block of a packed write command: The version, the
+ * direction, the number of entries and the arguments of CMD23 and CMD25 for
+ * every entry. The first entry is the original request of `cmd`, the further
+ * entries are the merged requests.
+ */
 template <class Driver>
-int
-Device<Driver>::discard(l4_uint64_t offset, Block_device::Inout_block const &block,
-                Block_device::Inout_callback const &cb, bool discard)
+void
+Device<Driver>::set_packed_header(Cmd *cmd)
 {
-  /*
-   * For all blocks:
-   *  - Cmd35_tag_erase_group_start first bytes/sector (_addr_mult)
-   *  - Cmd36_tag_erase_group_end last byte/sector (_addr_mult)
-   *  - Cmd38_erase: arg: 0=erase, 1=trim, 3=discard.
-   *  - Cmd13_send_status
-   *    - command error: return error
-   *    - status.ready_for_data = 0: return error card busy
-   *    - status.current_state != Transfer: return error
-   */
-  (void)offset;
-  (void)block;
-  (void)cb;
-  (void)discard;
-  warn.printf("\033[31;1mdiscard\033[m\n");
-  return -L4_EINVAL;
+  l4_size_t offs = cmd->nr() * Sector_size;
+  auto *hdr = _packed_hdrs->get<l4_uint8_t>() + offs;
+  memset(hdr, 0, Sector_size);
+  hdr[0] = 1;                           // version
+  hdr[1] = 2;                           // write
+  hdr[2] = cmd->num_merged + 1;         // number of entries
+
+  auto put_le32 = [](l4_uint8_t *p, l4_uint32_t v)
+    {
+      for (unsigned i = 0; i < 4; ++i)
+        p[i] = v >> (8 * i);
+    };
+  auto set_entry = [&](unsigned i, l4_uint32_t sector, l4_uint32_t num_sectors)
+    {
+      Mmc::Arg_cmd23_set_block_count a23;
+      a23.blocks() = num_sectors;
+      put_le32(hdr + 8 * i, a23.raw);
+      put_le32(hdr + 8 * i + 4, sector * _addr_mult);
+    };
+
+  l4_uint32_t num_sectors = 0;
+  for (auto const *b = cmd->blocks; b; b = b->next.get())
+    num_sectors += b->num_sectors;
+  set_entry(1, cmd->sector, num_sectors);
+  for (unsigned i = 0; i < cmd->num_merged; ++i)
+    set_entry(i + 2, cmd->merged[i].sector, cmd->merged[i].num_sectors);
+
+  cmd->header.dma_addr = _packed_hdrs->pget() + offs;
+  cmd->header.virt_addr = hdr;
+  cmd->header.num_sectors = 1;
+  cmd->flags.packed() = 1;
 }
 
+/**
+ * Report the completion of an inout command to the originator of the command
+ * and to the originators of all merged requests. The transferred sectors are
+ * attributed to the requests in the order of the transfer. Entries of a failed
+ * packed command which were written completely are reported as successful.
+ */
 template <class Driver>
 void
-Device<Driver>::start_device_scan(Errand::Callback const &cb)
+Device<Driver>::complete_inout(Cmd *cmd, int error)
 {
-  _init_time = Util::read_tsc();
-
-  _drv.init();
-
-  Cmd *cmd = _drv.cmd_create();
-  if (!cmd)
-    return;
+  if (!cmd->flags.inout_read())
+    _cache_dirty = true;
 
-  _drv.set_clock_and_timing(400 * KHz, Mmc::Legacy);
-
-  reset_sdio(cmd);
+  if (cmd == _hpi_resume)
+    _hpi_resume = nullptr;
 
-  _init_thread = std::thread([this, cmd, cb]
+  l4_uint64_t transferred = bytes_transferred(cmd);
+  if (!cmd->num_merged)
     {
-      struct Wakeup_handler : public L4::Irqep_t<Wakeup_handler>
-      {
-        long handle_irq()
-        { return 0; }
-      };
-      auto wakeup = std::make_shared<Wakeup_handler>();
-
-      bool failed = false;
-      try
-        {
-          auto me = Pthread::L4::cap(pthread_self());
-
-          // During initialization receive IRQ directly  (receive_irq())
-          L4Re::chksys(l4_error(_irq->bind_thread(me, 0)),
-                       "Bind IRQ to initialization thread.");
-
-          _drv.set_voltage(Mmc::Voltage_330);
-          // Delay required after changing voltage.
-          _drv.delay(Voltage_delay_ms);
-          _drv.set_bus_width(Mmc::Bus_width::Width_1bit);
-          _drv.set_clock_and_timing(400 * KHz, Mmc::Legacy);
-
-          for (unsigned i = 0; i < 2; ++i)
-            {
-              cmd->init(Mmc::Cmd0_go_idle_state);
-              cmd_exec(cmd);
-              cmd->check_error("CMD0: GO_IDLE");
-
-              Mmc::Arg_cmd8_send_if_cond a8;
-              a8.check_pattern() = 0xaa;
-              a8.voltage_suppl() = a8.Volt_27_36;
-              cmd->init_arg(Mmc::Cmd8_send_if_cond, a8.raw);
-              cmd->flags.expected_error() = true;
-              cmd_exec(cmd);
-
-              if (   cmd->status == Cmd::Success
-                  || cmd->status == Cmd::Cmd_timeout)
-                {
-                  info.printf("Initial SEND_IF_COND response: %08x (voltage %saccepted).\n",
-                              Mmc::Rsp_r7(cmd->resp[0]).raw,
-                              Mmc::Rsp_r7(cmd->resp[0]).voltage_accepted()
-                              ? "" : "NOT ");
-                  break;
-                }
-              else if (i > 0)
-                L4Re::throw_error(-L4_EIO, "Unusable card");
-            }
-
-          if (   !power_up_sd(cmd)
-              && !power_up_mmc(cmd))
-            L4Re::throw_error(-L4_EIO, "Neither SD nor eMMC.");
-
-          info.printf("DMA mode:%s, cmd23:%s, auto cmd23:%s.\n",
-                      _drv.dma_adma2() ? "adma2" : "sdma",
-                      yes_no(_has_cmd23), yes_no(_drv.auto_cmd23()));
-
-          cmd->work_done();
-          cmd->destruct();
-        }
-      catch (L4::Runtime_error const &e)
-        {
-          _drv.dump();
-          warn.printf("%s: %s. Skipping.\n", e.str(), e.extra_str());
-          cmd->work_done();
-          cmd->destruct();
-          failed = true;
-        }
-
-      // Initialization done: No longer use receive_irq().
-      _irq->detach();
-      L4Re::chksys(l4_error(_icu->unbind(_irq_num, _irq)),
-                   "Unbind IRQ after initialization.");
-
-      // Register wakeup object -- see below.
-      _registry->register_irq_obj(wakeup.get());
+      ++_stat_ios;
+      cmd->cb_io(error, transferred);
+      return;
+    }
 
-      // Schedule an immediate errand. But currently the server loop is most
-      // likely waiting for requests. Well, we could also move the following
-      // code to wakeup::handle_irq() but in that case, joining the init thread
-      // gets difficult as wakeup is stored in the context of the init thread.
-      Errand::schedule([this, cb, failed, wakeup]
-        {
-          _registry->unregister_obj(wakeup.get());
-          _init_thread.join();
+  if (cmd->flags.packed())
+    transferred -= cxx::min<l4_uint64_t>(transferred, sector_size());
 
-          if (!failed)
-            {
-              // From now on, the server loop handles the interrupt.
-              _irq = L4Re::chkcap(_registry->register_irq_obj(this),
-                                  "Register IRQ server object.");
+  l4_uint64_t size = 0;
+  for (auto const *b = cmd->blocks; b; b = b->next.get())
+    size += l4_uint64_t{b->num_sectors} * sector_size();
 
-              L4Re::chksys(_icu->set_mode(_irq_num, _irq_mode), "Set IRQ mode.");
+  for (unsigned i = 0; i <= cmd->num_merged; ++i)
+    {
+      l4_uint64_t done = cxx::min(transferred, size);
+      transferred -= done;
+      int err = cmd->flags.packed() && done == size ? L4_EOK : error;
+      ++_stat_ios;
+      if (i == 0)
+        cmd->cb_io(err, done);
+      else
+        cmd->merged[i - 1].cb_io(err, done);
+      if (i < cmd->num_merged)
+        size = l4_uint64_t{cmd->merged[i].num_sectors} * sector_size();
+    }
+}
 
-              int ret = L4Re::chksys(l4_error(_icu->bind(_irq_num, _irq)),
-                                     "Bind interrupt to ICU.");
-              _irq_unmask_at_icu = ret == 1;
+/**
+ * Initialize a command queue task for an inout request.
+ *
+ * Only `sector`, `blocks`, `cb_io` and the inout flags are used for the
+ * transfer. The transfer command is set for logging purposes.
+ */
+template <class Driver>
+void
+Device<Driver>::init_cmdq_task(Cmd *task, l4_uint64_t sector,
+                               Block_device::Inout_block const &blocks,
+                               Block_device::Inout_callback const &cb,
+                               bool inout_read, bool reliable)
+{
+  check_inout_blocks(blocks);
 
-              cb();
-            }
-        }, 0);
+  l4_uint32_t num_sectors = 0;
+  for (auto const *b = &blocks; b; b = b->next.get())
+    num_sectors += b->num_sectors;
 
-      // Wakeup the server loop.
-      wakeup->obj_cap()->trigger();
-    });
+  task->init_inout(sector, &blocks, cb, inout_read);
+  task->flags.reliable_write() = reliable;
+  task->reinit_inout_data(inout_read ? Mmc::Cmd18_read_multiple_block
+                                     : Mmc::Cmd25_write_multiple_block,
+                          sector * _addr_mult, num_sectors, 512,
+                          Cmd::Flag_auto_cmd23::No_auto_cmd23);
 }
 
 /**
- * Explicitly receive a single device IRQ.
+ * Release the slot of a finished command queue task and report the result.
  *
- * Actually this function is not used with the asynchronous handling.
+ * The task slot is released before invoking the callback because the callback
+ * might already queue the next request.
  */
 template <class Driver>
 void
-Device<Driver>::receive_irq(bool is_data) const
+Device<Driver>::cmdq_task_done(Cmd *task, int error)
 {
-  constexpr l4_timeout_t timeout =
-    l4_timeout(L4_IPC_TIMEOUT_NEVER, l4_timeout_from_us(Timeout_irq_us));
-  L4Re::chksys(l4_ipc_error(_irq->receive(timeout), l4_utcb()), "Receive IRQ.");
-
-  if (trace.is_active())
+  Cmd::Callback_io cb = task->cb_io;
+  if (!task->flags.inout_read())
+    _cache_dirty = true;
+  l4_uint64_t transferred = 0;
+  if (error)
+    info.printf("\033[31mInout error (task %u).\033[m\n",
+                _cmdq_tasks.tag(task));
+  else
     {
-      if (is_data)
-        _drv.show_interrupt_status("Receive IRQ (data): got ");
-      else
-        _drv.show_interrupt_status("Receive IRQ (cmd): got ");
+      task->sectors_done = task->blockcnt;
+      transferred = bytes_transferred(task);
     }
+  _cmdq_tasks.free(task);
+  ++_stat_ios;
+  if (cb)
+    cb(error, transferred);
+}
+
+/**
+ * Queue an inout request as task of the command queue engine.
+ *
+ * The task slot is released as soon as the CQE reports completion of the
+ * task, see handle_irq_cqe().
+ */
+template <class Driver>
+int
+Device<Driver>::inout_data_cqe(l4_uint64_t sector,
+                               Block_device::Inout_block const &blocks,
+                               Block_device::Inout_callback const &cb,
+                               bool inout_read, bool reliable)
+{
+  // The CQE is halted while executing legacy commands (flush, erase).
+  if (_drv.cmd_current())
+    return -L4_EBUSY;
+
+  Cmd *task = _cmdq_tasks.alloc();
+  if (!task)
+    return -L4_EBUSY;
+
+  try
+    {
+      init_cmdq_task(task, sector, blocks, cb, inout_read, reliable);
+      _drv.cqe_task_submit(_cmdq_tasks.tag(task), task);
+      cqe_adapt_coalescing();
+    }
+  catch (L4::Runtime_error const &e)
+    {
+      warn.printf("inout_data fails: %s: %s.\n", e.str(), e.extra_str());
+      _cmdq_tasks.free(task);
+      return -L4_EINVAL;
+    }
+
+  unmask_interrupt();
+  return L4_EOK;
+}
+
+/**
+ * Queue an inout request as task for software command queuing.
+ *
+ * All tasks are handled by a single command of the command queue (`_swcq_cmd`)
+ * which exists as long as there are tasks, see handle_irq_swcq().
+ */
+template <class Driver>
+int
+Device<Driver>::inout_data_swcq(l4_uint64_t sector,
+                                Block_device::Inout_block const &blocks,
+                                Block_device::Inout_callback const &cb,
+                                bool inout_read, bool reliable)
+{
+  Cmd *task = _cmdq_tasks.alloc();
+  if (!task)
+    return -L4_EBUSY;
+
+  if (!_swcq_cmd)
+    {
+      _swcq_cmd = _drv.cmd_create();
+      if (!_swcq_cmd)
+        {
+          _cmdq_tasks.free(task);
+          return -L4_EBUSY;
+        }
+    }
+
+  try
+    {
+      init_cmdq_task(task, sector, blocks, cb, inout_read, reliable);
+
+      // Otherwise the task is picked up after the current command finished.
+      if (_swcq_cmd->status == Cmd::Uninitialized)
+        {
+          swcq_next(_swcq_cmd);
+          cmd_queue_kick();
+        }
+    }
+  catch (L4::Runtime_error const &e)
+    {
+      warn.printf("inout_data fails: %s: %s.\n", e.str(), e.extra_str());
+
+      _cmdq_tasks.free(task);
+      if (_swcq_cmd->status == Cmd::Uninitialized)
+        {
+          _swcq_cmd->work_done();
+          _swcq_cmd->destruct();
+          _swcq_cmd = nullptr;
+          cmd_queue_kick();
+        }
+
+      return -L4_EINVAL;
+    }
+
+  return L4_EOK;
+}
+
+/**
+ * Flush the device cache.
+ *
+ * A flush is only required if data was written since the last flush was
+ * issued. Flush requests arriving while a flush is in flight are completed
+ * together with that flush unless further writes completed meanwhile. In the
+ * latter case, they are collected and completed by a single further flush.
+ *
+ * With `ordering`, the flush is only required for ordering the writes. It is
+ * not necessary if the device flushes its cache in FIFO order. Otherwise it is
+ * replaced by a cache barrier if supported by the device.
+ */
+template <class Driver>
+int
+Device<Driver>::flush_cache(Block_device::Inout_callback const &cb,
+                            bool ordering)
+{
+  if (!_has_cache)
+    {
+      cb(L4_EOK, 0);
+      return L4_EOK;
+    }
+
+  _io_time = l4_kip_clock(l4re_kip());
+  if (   ordering
+      && _flush_waiters.empty() && _flush_next.empty() && _cache_dirty)
+    {
+      if (_cache_fifo)
+        {
+          trace.printf("flush: ordered by FIFO cache flushing\n");
+          cb(L4_EOK, 0);
+          return L4_EOK;
+        }
+      if (_cache_barrier)
+        return flush_start(cb);
+    }
+
+  if (!_flush_next.empty() || (!_flush_waiters.empty() && _cache_dirty))
+    {
+      _flush_next.push_back(cb);
+      return L4_EOK;
+    }
+
+  if (!_flush_waiters.empty())
+    {
+      trace.printf("flush: join flush in flight\n");
+      _flush_waiters.push_back(cb);
+      return L4_EOK;
+    }
+
+  if (!_cache_dirty)
+    {
+      trace.printf("flush: nothing written\n");
+      cb(L4_EOK, 0);
+      return L4_EOK;
+    }
+
+  int ret = flush_start();
+  if (ret < 0)
+    return ret;
+
+  _flush_waiters.push_back(cb);
+  return L4_EOK;
+}
+
+/**
+ * Flush the device cache after a write with forced unit access completed. If
+ * the flush cannot be started now because commands are in flight, it is
+ * started later, see flush_next(). The write already reached the device, so
+ * the flush must not fail for that reason.
+ */
+template <class Driver>
+void
+Device<Driver>::flush_fua(Block_device::Inout_callback const &cb)
+{
+  int ret = flush_cache(cb, false);
+  if (ret == -L4_EBUSY)
+    {
+      _flush_next.push_back(cb);
+      flush_next();
+    }
+  else if (ret < 0)
+    cb(ret, 0);
+}
+
+/**
+ * Queue the command sequence for flushing the device cache.
+ *
+ * The SWITCH command and polling the device status until the device finished
+ * programming are driven by interrupts, see handle_irq_flush().
+ *
+ * With `barrier_cb`, only set a cache barrier and report its completion to
+ * `barrier_cb`.
+ */
+template <class Driver>
+int
+Device<Driver>::flush_start(Block_device::Inout_callback const &barrier_cb)
+{
+  bool barrier = !!barrier_cb;
+
+  // The CQE must be halted for sending CMD6 and the device accepts
+  // FLUSH_CACHE only with an empty queue.
+  if (_cmdq_tasks.num_busy() || _swcq_cmd)
+    return -L4_EBUSY;
+
+  Cmd *cmd = _drv.cmd_create();
+  if (!cmd)
+    return -L4_EBUSY;
+
+  trace.printf("\033[32m%s\033[m\n", barrier ? "barrier" : "flush");
+
+  try
+    {
+      cqe_suspend(cmd);
+      Mmc::Reg_ecsd::Ec32_flush_cache fc(0);
+      if (barrier)
+        fc.barrier() = 1;
+      else
+        fc.flush() = 1;
+      init_mmc_switch(cmd, fc.index(), fc.raw);
+      cmd->flags.flush() = 1;
+      cmd->flags.barrier() = barrier;
+      cmd->cb_io = barrier_cb;
+      cmd_queue_kick();
+    }
+  catch (L4::Runtime_error const &e)
+    {
+      warn.printf("flush fails: %s: %s.\n", e.str(), e.extra_str());
+
+      cmd->work_done();
+      cmd->destruct();
+      cqe_resume();
+
+      return -L4_EINVAL;
+    }
+
+  // Writes completing from now on are not covered by this flush.
+  if (!barrier)
+    _cache_dirty = false;
+  return L4_EOK;
+}
+
+/**
+ * Start the flush for the requests collected while the previous flush was in
+ * flight.
+ */
+template <class Driver>
+void
+Device<Driver>::flush_next()
+{
+  if (_flush_next.empty() || !_flush_waiters.empty())
+    return;
+
+  int ret = flush_start();
+  if (ret == -L4_EBUSY)
+    {
+      // Retry after the command queue drained.
+      Errand::schedule([this] { flush_next(); }, Prg_poll_us);
+      return;
+    }
+
+  std::vector<Block_device::Inout_callback> waiters;
+  waiters.swap(_flush_next);
+  if (ret == L4_EOK)
+    _flush_waiters.swap(waiters);
+  else
+    for (auto const &cb : waiters)
+      cb(ret, 0);
+}
+
+/**
+ * Complete all requests waiting for the flush in flight.
+ *
+ * The next flush is started before invoking the callbacks because the
+ * callbacks might already issue further flush requests.
+ */
+template <class Driver>
+void
+Device<Driver>::flush_done(int error)
+{
+  if (error)
+    _cache_dirty = true;
+
+  std::vector<Block_device::Inout_callback> waiters;
+  waiters.swap(_flush_waiters);
+  flush_next();
+
+  for (auto const &cb : waiters)
+    cb(error, 0);
+}
+
+/**
+ * Discard the sectors of all segments of a request (`discard` = true) or fill
+ * them with zeroes (`discard` = false).
+ */
+template <class Driver>
+int
+Device<Driver>::discard(l4_uint64_t offset, Block_device::Inout_block const &block,
+                Block_device::Inout_callback const &cb, bool discard)
+{
+  return discard_part(0, offset, block, cb, discard);
+}
+
+/**
+ * Handle a discard or write-zeroes request for a hardware partition. The
+ * request is held back if another hardware partition is currently selected.
+ */
+template <class Driver>
+int
+Device<Driver>::discard_part(unsigned part, l4_uint64_t offset,
+                             Block_device::Inout_block const &block,
+                             Block_device::Inout_callback const &cb,
+                             bool discard)
+{
+  if (!_erase_grp_sectors || (!discard && !_erase_zeroes))
+    {
+      warn.printf("\033[31;1m%s not supported\033[m\n",
+                  discard ? "discard" : "write zeroes");
+      return -L4_EINVAL;
+    }
+
+  _io_time = l4_kip_clock(l4re_kip());
+  unsigned segments = 0;
+  for (auto const *b = &block; b; b = b->next.get())
+    {
+      if (   b->num_sectors > _erase_grp_sectors * Max_erase_groups
+          || offset + b->sector + b->num_sectors
+             > (part ? _hw_part_sectors[part] : _num_sectors))
+        return -L4_EINVAL;
+      ++segments;
+    }
+  if (segments > Max_discard_seg)
+    return -L4_EINVAL;
+
+  auto run = [this, offset, &block, cb, discard]
+    {
+      if (discard)
+        return erase_start(offset, block, cb, false);
+      return write_zeroes(offset, block, cb);
+    };
+
+  if (!hw_part_ready(part))
+    return hw_part_queue(part, run, cb);
+
+  return run();
+}
+
+/**
+ * Erase the sectors of all segments of a request.
+ *
+ * For every segment, the erase range is tagged (CMD35, CMD36) and erased
+ * (CMD38). Afterwards the device status is polled until the device finished
+ * erasing, see handle_irq_erase().
+ *
+ * \param zeroes  The erased sectors must read as zeroes afterwards.
+ */
+template <class Driver>
+int
+Device<Driver>::erase_start(l4_uint64_t offset,
+                            Block_device::Inout_block const &block,
+                            Block_device::Inout_callback const &cb, bool zeroes)
+{
+  bool empty = true;
+  for (auto const *b = &block; b && empty; b = b->next.get())
+    {
+      l4_uint64_t start, end;
+      empty = !erase_range(offset, b, zeroes, &start, &end);
+    }
+  if (empty)
+    {
+      // Nothing to erase after aligning the segments to erase groups.
+      cb(L4_EOK, 0);
+      return L4_EOK;
+    }
+
+  // The CQE must be halted for sending legacy commands.
+  if (_cmdq_tasks.num_busy() || _swcq_cmd)
+    return -L4_EBUSY;
+
+  Cmd *cmd = _drv.cmd_create();
+  if (!cmd)
+    return -L4_EBUSY;
+
+  try
+    {
+      cqe_suspend(cmd);
+      cmd->sector = offset;
+      cmd->blocks = &block;
+      cmd->cb_io = cb;
+      cmd->flags.erase_zeroes() = zeroes;
+      erase_next(cmd);
+      cmd_queue_kick();
+    }
+  catch (L4::Runtime_error const &e)
+    {
+      warn.printf("erase fails: %s: %s.\n", e.str(), e.extra_str());
+
+      cmd->work_done();
+      cmd->destruct();
+      cqe_resume();
+
+      return -L4_EINVAL;
+    }
+
+  return L4_EOK;
+}
+
+/**
+ * Determine the sectors to erase for a segment of an erase request. With
+ * ERASE, only entire erase groups are erased.
+ *
+ * \retval false  Nothing to erase for this segment.
+ */
+template <class Driver>
+bool
+Device<Driver>::erase_range(l4_uint64_t offset,
+                            Block_device::Inout_block const *b, bool zeroes,
+                            l4_uint64_t *start, l4_uint64_t *end) const
+{
+  l4_uint64_t first = offset + b->sector;
+  l4_uint64_t last = first + b->num_sectors;
+  if (erase_type(zeroes) == Mmc::Arg_cmd38_erase::Erase)
+    {
+      first = (first + _erase_grp_sectors - 1) / _erase_grp_sectors
+              * _erase_grp_sectors;
+      last = last / _erase_grp_sectors * _erase_grp_sectors;
+    }
+  if (first >= last)
+    return false;
+
+  *start = first;
+  *end = last - 1;
+  return true;
+}
+
+/** Reinitialize an erase command preserving the erase flags. */
+template <class Driver>
+void
+Device<Driver>::erase_init(Cmd *cmd, l4_uint32_t cmd_val, l4_uint32_t arg)
+{
+  Cmd::Flags flags = cmd->flags;
+  cmd->init_arg(cmd_val, arg);
+  cmd->flags.erase() = 1;
+  cmd->flags.erase_zeroes() = flags.erase_zeroes();
+  cmd->flags.no_hpi() = flags.no_hpi();
+}
+
+/**
+ * Start erasing the next segment of an erase command which is not empty.
+ */
+template <class Driver>
+typename Device<Driver>::Work_status
+Device<Driver>::erase_next(Cmd *cmd)
+{
+  for (; cmd->blocks; cmd->blocks = cmd->blocks->next.get())
+    {
+      l4_uint64_t start, end;
+      if (erase_range(cmd->sector, cmd->blocks, cmd->flags.erase_zeroes(),
+                      &start, &end))
+        {
+          erase_init(cmd, Mmc::Cmd35_tag_erase_group_start, start * _addr_mult);
+          return More_work;
+        }
+    }
+  return Work_done;
+}
+
+/**
+ * Handle the completion of a command of the erase sequence.
+ */
+template <class Driver>
+void
+Device<Driver>::handle_irq_erase(Cmd *cmd)
+{
+  int error = L4_EOK;
+  bool zeroes = cmd->flags.erase_zeroes();
+  l4_uint64_t start = 0, end = 0;
+  erase_range(cmd->sector, cmd->blocks, zeroes, &start, &end);
+  if (   cmd->error()
+      || (cmd->flags.has_r1_response()
+          && cmd->mmc_status().erase_error_condition()))
+    {
+      warn.printf("\033[31mErase: %s failed (%s).\033[m\n",
+                  cmd->cmd_to_str().c_str(), cmd->str_status().c_str());
+      error = -L4_EIO;
+    }
+  else if (cmd->cmd == Mmc::Cmd35_tag_erase_group_start)
+    {
+      erase_init(cmd, Mmc::Cmd36_tag_erase_group_end, end * _addr_mult);
+      cmd_queue_kick();
+      return;
+    }
+  else if (cmd->cmd == Mmc::Cmd36_tag_erase_group_end)
+    {
+      Mmc::Arg_cmd38_erase a38;
+      a38.type() = erase_type(zeroes);
+      erase_init(cmd, Mmc::Cmd38_erase, a38.raw);
+      cmd_queue_kick();
+      return;
+    }
+  else if (cmd->cmd == Mmc::Cmd38_erase)
+    {
+      // The erase timeout applies to every affected erase group.
+      l4_uint64_t groups = end / _erase_grp_sectors
+                           - start / _erase_grp_sectors + 1;
+      l4_uint32_t ms = erase_type(zeroes) == Mmc::Arg_cmd38_erase::Erase
+                       ? _erase_timeout_ms : _trim_timeout_ms;
+      prg_start(cmd, groups * ms * 1000);
+      return;
+    }
+  else if (!prg_done(cmd))
+    {
+      if (prg_poll(cmd))
+        return;
+      warn.printf("\033[31mErase: timeout.\033[m\n");
+      error = -L4_EIO;
+    }
+  else
+    {
+      trace.printf("Erased sectors %llu-%llu.\n", start, end);
+      cmd->blocks = cmd->blocks->next.get();
+      if (erase_next(cmd) == More_work)
+        {
+          cmd_queue_kick();
+          return;
+        }
+    }
+
+  Cmd::Callback_io cb = cmd->cb_io;
+  cmd->work_done();
+  cmd->destruct();
+  cqe_resume();
+
+  cb(error, 0);
+  cmd_queue_kick();
+}
+
+/**
+ * Fill the sectors of all segments of a request with zeroes.
+ *
+ * The sectors are erased if erased memory reads as zeroes. If only entire
+ * erase groups can be erased, the unaligned head and tail of a segment are
+ * written from the zero buffer afterwards, see write_zeroes_next().
+ */
+template <class Driver>
+int
+Device<Driver>::write_zeroes(l4_uint64_t offset,
+                             Block_device::Inout_block const &block,
+                             Block_device::Inout_callback const &cb)
+{
+  auto z = std::make_shared<Zeroes_req>();
+  // The hardware partition must not be switched between the chunks.
+  ++_zeroes_active;
+  z->cb = [this, cb](int error, l4_size_t size)
+    {
+      --_zeroes_active;
+      cb(error, size);
+    };
+  for (auto const *b = &block; b; b = b->next.get())
+    {
+      l4_uint64_t first = offset + b->sector;
+      l4_uint64_t last = first + b->num_sectors;
+      l4_uint64_t start, end;
+      if (!b->num_sectors)
+        continue;
+      if (!erase_range(offset, b, true, &start, &end))
+        z->fragments.push_back({first, b->num_sectors});
+      else
+        {
+          if (first < start)
+            z->fragments.push_back({first, l4_uint32_t(start - first)});
+          if (end + 1 < last)
+            z->fragments.push_back({end + 1, l4_uint32_t(last - end - 1)});
+        }
+    }
+
+  int ret = erase_start(offset, block, [this, z](int error, l4_size_t)
+    {
+      z->error = error;
+      write_zeroes_next(z);
+    }, true);
+  if (ret < 0)
+    --_zeroes_active;
+  return ret;
+}
+
+/**
+ * Write the next chunk of zeroes of a write-zeroes request. Report completion
+ * after all chunks were written or on error.
+ */
+template <class Driver>
+void
+Device<Driver>::write_zeroes_next(std::shared_ptr<Zeroes_req> z)
+{
+  if (z->error || z->fragments.empty())
+    {
+      z->cb(z->error, 0);
+      return;
+    }
+
+  auto &f = z->fragments.back();
+  l4_uint32_t n = cxx::min<l4_uint32_t>(f.second, _zero_buf->size() / Sector_size);
+  n = cxx::min<l4_uint32_t>(n, max_size() / Sector_size);
+  z->block.dma_addr = _zero_buf->pget();
+  z->block.virt_addr = _zero_buf->get<void>();
+  z->block.num_sectors = n;
+
+  int ret = inout_data_cur(f.first, z->block,
+                           [this, z, n](int error, l4_size_t)
+    {
+      auto &f = z->fragments.back();
+      f.first += n;
+      f.second -= n;
+      if (!f.second)
+        z->fragments.pop_back();
+      z->error = error;
+      write_zeroes_next(z);
+    }, false, false);
+
+  if (ret == -L4_EBUSY)
+    Errand::schedule([this, z] { write_zeroes_next(z); }, Prg_poll_us);
+  else if (ret < 0)
+    z->cb(ret, 0);
+}
+
+/**
+ * Return true if no command is queued and no request is in progress.
+ */
+template <class Driver>
+bool
+Device<Driver>::queues_idle() const
+{
+  return !_drv.cmd_num_queued() && _sched.empty() && !_cmdq_tasks.num_busy()
+         && !_swcq_cmd && !_zeroes_active;
+}
+
+/**
+ * Hold back a request for a hardware partition which is not selected.
+ *
+ * Switching the hardware partition takes up to PARTITION_SWITCH_TIME, so the
+ * requests are batched: The switch is done after all commands for the current
+ * partition finished. Afterwards, all held back requests for the selected
+ * partition are executed together. Requests for the current partition arriving
+ * while other requests are held back are held back as well so that the other
+ * partitions don't starve.
+ */
+template <class Driver>
+int
+Device<Driver>::hw_part_queue(unsigned part, std::function<int()> const &run,
+                              Block_device::Inout_callback const &cb)
+{
+  _hw_part_pending.push_back({ part, run, cb });
+  hw_part_next();
+  return L4_EOK;
+}
+
+/**
+ * Execute the held back requests for the selected hardware partition. If
+ * requests for another partition remain, switch to the partition of the oldest
+ * request as soon as the queues are idle.
+ */
+template <class Driver>
+void
+Device<Driver>::hw_part_next()
+{
+  // Callbacks of failed requests might queue further requests.
+  if (_hw_part_switching || _hw_part_running || _hw_part_pending.empty())
+    return;
+
+  unsigned cur = _part_config.partition_access();
+  if (_hw_part_pending.front().part == cur)
+    {
+      _hw_part_running = true;
+      int ret = L4_EOK;
+      for (unsigned i = 0; i < _hw_part_pending.size();)
+        {
+          if (_hw_part_pending[i].part != cur)
+            {
+              ++i;
+              continue;
+            }
+
+          Hw_part_req req = std::move(_hw_part_pending[i]);
+          _hw_part_pending.erase(_hw_part_pending.begin() + i);
+          ret = req.run();
+          if (ret == -L4_EBUSY)
+            {
+              _hw_part_pending.insert(_hw_part_pending.begin() + i,
+                                      std::move(req));
+              break;
+            }
+          if (ret < 0)
+            req.cb(ret, 0);
+        }
+      _hw_part_running = false;
+
+      if (ret == -L4_EBUSY)
+        {
+          hw_part_retry();
+          return;
+        }
+      if (_hw_part_pending.empty())
+        return;
+    }
+
+  if (!queues_idle())
+    {
+      hw_part_retry();
+      return;
+    }
+
+  hw_part_switch(_hw_part_pending.front().part);
+}
+
+/** Call hw_part_next() again after some time. */
+template <class Driver>
+void
+Device<Driver>::hw_part_retry()
+{
+  if (_hw_part_retry)
+    return;
+
+  _hw_part_retry = true;
+  Errand::schedule([this]
+    {
+      _hw_part_retry = false;
+      hw_part_next();
+    }, Prg_poll_us);
+}
+
+/**
+ * Queue the command sequence for selecting another hardware partition: Set
+ * PARTITION_ACCESS (CMD6) and poll the device status until the device finished
+ * switching, see handle_irq_hw_part().
+ */
+template <class Driver>
+void
+Device<Driver>::hw_part_switch(unsigned part)
+{
+  Cmd *cmd = _drv.cmd_create();
+  if (!cmd)
+    {
+      hw_part_retry();
+      return;
+    }
+
+  trace.printf("Switch to %s partition.\n",
+               Mmc::Reg_ecsd::Ec179_partition_config(part).str_partition_access());
+
+  cqe_suspend(cmd);
+  Mmc::Reg_ecsd::Ec179_partition_config pc = _part_config;
+  pc.partition_access() = part;
+  init_mmc_switch(cmd, pc.index(), pc.raw);
+  cmd->flags.hw_part() = 1;
+  _hw_part_next = part;
+  _hw_part_switching = true;
+  cmd_queue_kick();
+}
+
+/**
+ * Handle the completion of a command of the partition switch sequence. If the
+ * switch failed, the requests held back for the partition are completed with
+ * an error.
+ */
+template <class Driver>
+void
+Device<Driver>::handle_irq_hw_part(Cmd *cmd)
+{
+  int error = L4_EOK;
+  if (cmd->error() || cmd->switch_error())
+    {
+      warn.printf("\033[31mPartition switch: %s failed (%s).\033[m\n",
+                  cmd->cmd_to_str().c_str(), cmd->str_status().c_str());
+      error = -L4_EIO;
+    }
+  else if (cmd->cmd == Mmc::Cmd6_switch)
+    {
+      prg_start(cmd, _part_switch_timeout_us);
+      return;
+    }
+  else if (!prg_done(cmd))
+    {
+      if (prg_poll(cmd))
+        return;
+      warn.printf("\033[31mPartition switch: timeout.\033[m\n");
+      error = -L4_EIO;
+    }
+
+  cmd->work_done();
+  cmd->destruct();
+  cqe_resume();
+  _hw_part_switching = false;
+
+  if (!error)
+    _part_config.partition_access() = _hw_part_next;
+  else
+    {
+      std::vector<Block_device::Inout_callback> failed;
+      for (auto it = _hw_part_pending.begin(); it != _hw_part_pending.end();)
+        if (it->part == _hw_part_next)
+          {
+            failed.push_back(it->cb);
+            it = _hw_part_pending.erase(it);
+          }
+        else
+          ++it;
+      for (auto const &cb : failed)
+        cb(error, 0);
+    }
+
+  hw_part_next();
+  cmd_queue_kick();
+}
+
+/**
+ * Create a device for each boot partition and each general purpose partition.
+ * The RPMB partition requires authenticated access and is not exported.
+ */
+template <class Driver>
+std::vector<cxx::Ref_ptr<Base_device>>
+Device<Driver>::hw_part_devices()
+{
+  static char const *const names[] =
+    { "user", "boot1", "boot2", "rpmb", "gp1", "gp2", "gp3", "gp4" };
+
+  std::vector<cxx::Ref_ptr<Base_device>> devs;
+  for (unsigned part = 1; part < 8; ++part)
+    {
+      if (!_hw_part_sectors[part])
+        continue;
+
+      // BOOT_WP_STATUS: 2 bits per boot partition.
+      bool read_only = part <= 2
+                       && ((_ecsd.ec174_boot_wp_status >> ((part - 1) * 2)) & 3);
+      std::string hid = std::string(_hid) + "-" + names[part];
+      info.printf("Exporting %s partition as '%s' (%s%s).\n",
+                  Mmc::Reg_ecsd::Ec179_partition_config(part).str_partition_access(),
+                  hid.c_str(),
+                  Util::readable_size(_hw_part_sectors[part] * Sector_size).c_str(),
+                  read_only ? ", write protected" : "");
+      devs.push_back(cxx::Ref_ptr<Base_device>(
+        new Hw_part_device(cxx::Ref_ptr<Base_parent_device>(this), part, hid,
+                           _hw_part_sectors[part], read_only)));
+    }
+  return devs;
+}
+
+template <class Driver>
+void
+Device<Driver>::start_device_scan(Errand::Callback const &cb)
+{
+  _init_time = Util::read_tsc();
+
+  _drv.init();
+
+  Cmd *cmd = _drv.cmd_create();
+  if (!cmd)
+    return;
+
+  _drv.set_clock_and_timing(400 * KHz, Mmc::Legacy);
+
+  reset_sdio(cmd);
+
+  _init_thread = std::thread([this, cmd, cb]
+    {
+      struct Wakeup_handler : public L4::Irqep_t<Wakeup_handler>
+      {
+        long handle_irq()
+        { return 0; }
+      };
+      auto wakeup = std::make_shared<Wakeup_handler>();
+
+      bool failed = false;
+      try
+        {
+          auto me = Pthread::L4::cap(pthread_self());
+
+          // During initialization receive IRQ directly  (receive_irq())
+          L4Re::chksys(l4_error(_irq->bind_thread(me, 0)),
+                       "Bind IRQ to initialization thread.");
+
+          _drv.set_voltage(Mmc::Voltage_330);
+          // Delay required after changing voltage.
+          _drv.delay(Voltage_delay_ms);
+          _drv.set_bus_width(Mmc::Bus_width::Width_1bit);
+          _drv.set_clock_and_timing(400 * KHz, Mmc::Legacy);
+
+          for (unsigned i = 0; i < 2; ++i)
+            {
+              cmd->init(Mmc::Cmd0_go_idle_state);
+              cmd_exec(cmd);
+              cmd->check_error("CMD0: GO_IDLE");
+
+              Mmc::Arg_cmd8_send_if_cond a8;
+              a8.check_pattern() = 0xaa;
+              a8.voltage_suppl() = a8.Volt_27_36;
+              cmd->init_arg(Mmc::Cmd8_send_if_cond, a8.raw);
+              cmd->flags.expected_error() = true;
+              cmd_exec(cmd);
+
+              if (   cmd->status == Cmd::Success
+                  || cmd->status == Cmd::Cmd_timeout)
+                {
+                  info.printf("Initial SEND_IF_COND response: %08x (voltage %saccepted).\n",
+                              Mmc::Rsp_r7(cmd->resp[0]).raw,
+                              Mmc::Rsp_r7(cmd->resp[0]).voltage_accepted()
+                              ? "" : "NOT ");
+                  break;
+                }
+              else if (i > 0)
+                L4Re::throw_error(-L4_EIO, "Unusable card");
+            }
+
+          if (   !power_up_sd(cmd)
+              && !power_up_mmc(cmd))
+            L4Re::throw_error(-L4_EIO, "Neither SD nor eMMC.");
+
+          // The device schedules the tasks if command queuing is used.
+          if (!_cqe_active && !_swcq_active)
+            _sched = Io_sched(_sched_cfg.policy(_hid));
+
+          info.printf("DMA mode:%s, cmd23:%s, auto cmd23:%s, cmdq:%s, sched:%s.\n",
+                      _drv.dma_adma2() ? "adma2" : "sdma",
+                      yes_no(_has_cmd23), yes_no(_drv.auto_cmd23()),
+                      _cqe_active ? "cqe" : _swcq_active ? "software" : "no",
+                      Io_sched::policy_str(_sched.policy()));
+
+          cmd->work_done();
+          cmd->destruct();
+        }
+      catch (L4::Runtime_error const &e)
+        {
+          _drv.dump();
+          warn.printf("%s: %s. Skipping.\n", e.str(), e.extra_str());
+          cmd->work_done();
+          cmd->destruct();
+          failed = true;
+        }
+
+      // Initialization done: No longer use receive_irq().
+      _irq->detach();
+      L4Re::chksys(l4_error(_icu->unbind(_irq_num, _irq)),
+                   "Unbind IRQ after initialization.");
+
+      // Register wakeup object -- see below.
+      _registry->register_irq_obj(wakeup.get());
+
+      // Schedule an immediate errand. But currently the server loop is most
+      // likely waiting for requests. Well, we could also move the following
+      // code to wakeup::handle_irq() but in that case, joining the init thread
+      // gets difficult as wakeup is stored in the context of the init thread.
+      Errand::schedule([this, cb, failed, wakeup]
+        {
+          _registry->unregister_obj(wakeup.get());
+          _init_thread.join();
+
+          if (!failed)
+            {
+              // From now on, the server loop handles the interrupt.
+              _irq = L4Re::chkcap(_registry->register_irq_obj(this),
+                                  "Register IRQ server object.");
+
+              L4Re::chksys(_icu->set_mode(_irq_num, _irq_mode), "Set IRQ mode.");
+
+              int ret = L4Re::chksys(l4_error(_icu->bind(_irq_num, _irq)),
+                                     "Bind interrupt to ICU.");
+              _irq_unmask_at_icu = ret == 1;
+
+              if (_bkops)
+                Errand::schedule([this] { bkops_idle(); }, Bkops_idle_us);
+
+              if (Util::tsc_available())
+                _poll_budget = Util::freq_tsc_hz() * Poll_cmd_us / 1000000;
+
+              if (_tuned_timing != Mmc::Legacy || _speed_modes.size() > 1)
+                {
+                  _retune_period_us = _drv.retuning_period_s() * 1000000ULL;
+                  _retune_time = l4_kip_clock(l4re_kip());
+                  Errand::schedule([this] { retune_timer(); }, Retune_check_us);
+                }
+
+              if (_speed_modes.size() > 1)
+                {
+                  _speed_quiet = l4_kip_clock(l4re_kip());
+                  Errand::schedule([this] { speed_timer(); }, Speed_check_us);
+                }
+
+              cb();
+            }
+        }, 0);
+
+      // Wakeup the server loop.
+      wakeup->obj_cap()->trigger();
+    });
+}
+
+/**
+ * Explicitly receive a single device IRQ.
+ *
+ * Actually this function is not used with the asynchronous handling.
+ */
+template <class Driver>
+void
+Device<Driver>::receive_irq(bool is_data) const
+{
+  constexpr l4_timeout_t timeout =
+    l4_timeout(L4_IPC_TIMEOUT_NEVER, l4_timeout_from_us(Timeout_irq_us));
+  L4Re::chksys(l4_ipc_error(_irq->receive(timeout), l4_utcb()), "Receive IRQ.");
+
+  if (trace.is_active())
+    {
+      if (is_data)
+        _drv.show_interrupt_status("Receive IRQ (data): got ");
+      else
+        _drv.show_interrupt_status("Receive IRQ (cmd): got ");
+    }
+}
+
+template <class Driver>
+void
+Device<Driver>::handle_irq()
+{
+  if (trace.is_active())
+    _drv.show_interrupt_status("HANDLE IRQ: ");
+  ++_stat_ints;
+  handle_completion();
+}
+
+/**
+ * Handle the controller status after an interrupt or after cmd_poll()
+ * detected the completion of a command.
+ */
+template <class Driver>
+void
+Device<Driver>::handle_completion()
+{
+  try
+    {
+      // Legacy commands are only queued while the CQE is halted.
+      if (_cqe_active && !_drv.cmd_current())
+        {
+          handle_irq_cqe();
+          return;
+        }
+
+      Cmd *cmd = _drv.handle_irq();
+      if (cmd)
+        {
+          if (cmd->progress())
+            {
+              // Command not yet finished -- get ready for further interrupts.
+              unmask_interrupt();
+              return;
+            }
+
+          // The device requests urgent background operations.
+          if (   _bkops && cmd->flags.has_r1_response() && !cmd->error()
+              && cmd->mmc_status().exception_event())
+            _bkops_urgent = true;
+
+          if (cmd == _swcq_cmd)
+            {
+              handle_irq_swcq(cmd);
+              return;
+            }
+
+          if (cmd->flags.packed_status())
+            {
+              handle_irq_packed_status(cmd);
+              return;
+            }
+
+          if (cmd->flags.hpi())
+            {
+              handle_irq_hpi(cmd);
+              return;
+            }
+
+          if (cmd->flags.bkops())
+            {
+              handle_irq_bkops(cmd);
+              return;
+            }
+
+          if (cmd->flags.hw_part())
+            {
+              handle_irq_hw_part(cmd);
+              return;
+            }
+
+          if (cmd->flags.retune())
+            {
+              handle_irq_retune(cmd);
+              return;
+            }
+
+          if (cmd->flags.speed())
+            {
+              handle_irq_speed(cmd);
+              return;
+            }
+
+          if (cmd->flags.flush())
+            {
+              handle_irq_flush(cmd);
+              return;
+            }
+
+          if (cmd->flags.erase())
+            {
+              handle_irq_erase(cmd);
+              return;
+            }
+
+          // Special handling for in/out commands.
+          if (cmd->flags.inout())
+            {
+              handle_irq_inout(cmd);
+              return;
+            }
+
+          cmd_queue_kick();
+        }
+    }
+  catch (L4::Runtime_error const &e)
+    {
+      warn.printf("Exception triggered: %s: %s\n", e.str(), e.extra_str());
+    }
+}
+
+/**
+ * Busy-poll for the completion of the command just submitted if it has no data
+ * phase (for example CMD23, CMD12, CMD13). Such a command finishes within a
+ * few microseconds, so the following command is submitted without a round
+ * trip through the interrupt and the server loop. After `_poll_budget` TSC
+ * ticks, polling gives up and the interrupt reports the completion.
+ *
+ * A command submitted while handling a polled completion is polled by the
+ * same invocation instead of a nested one, at most `Poll_cmd_max` commands in
+ * a row. Queue status polls (CMD13 with SQS) are not polled.
+ *
+ * \retval true   The command completed and was handled.
+ * \retval false  Wait for the interrupt.
+ */
+template <class Driver>
+bool
+Device<Driver>::cmd_poll()
+{
+  if (_cmd_polling)
+    {
+      // Called by handle_completion() below: Continue in the loop.
+      _cmd_poll_next = true;
+      return true;
+    }
+
+  _cmd_polling = true;
+  bool pending = true;
+  for (unsigned i = 0; pending && i < Poll_cmd_max; ++i)
+    {
+      Cmd *cmd = _drv.cmd_current();
+      if (   !_poll_budget || !cmd || cmd->status != Cmd::Progress_cmd
+          || cmd->flags.has_data()
+          || cmd->cmd == Mmc::Cmd19_send_tuning_block
+          || cmd->cmd == Mmc::Cmd21_send_tuning_block
+          || (   cmd->cmd == Mmc::Cmd13_send_status
+              && Mmc::Arg_cmd13_send_status(cmd->arg).sqs()))
+        break;
+
+      if (!_drv.cmd_poll_finished(_poll_budget))
+        break;
+
+      ++_stat_polls;
+      _cmd_poll_next = false;
+      handle_completion();
+      pending = _cmd_poll_next;
+    }
+  _cmd_polling = false;
+  return !pending;
+}
+
+template <class Driver>
+void
+Device<Driver>::handle_irq_inout(Cmd *cmd)
+{
+  if (!cmd->cb_io)
+    L4Re::throw_error(-L4_EINVAL, "No context for async command");
+
+  Work_status work;
+  if (cmd->flags.inout_cmd12() && !_drv.auto_cmd12())
+    {
+      // Send CMD12 if not done automatically by the controller.
+      cmd->flags.inout_cmd12() = 0;
+      cmd->status_cmd12 = cmd->status; // remember the transfer status
+      cmd->reinit_inout_nodata(cmd->flags.inout_read()
+                                 ? Mmc::Cmd12_stop_transmission_rd
+                                 : Mmc::Cmd12_stop_transmission_wr, 0);
+      work = More_work;
+    }
+  else
+    {
+      if (   cmd->cmd == Mmc::Cmd12_stop_transmission_rd
+          || cmd->cmd == Mmc::Cmd12_stop_transmission_wr)
+        cmd->status = cmd->status_cmd12; // restore the transfer status
+      if (cmd->error())
+        {
+          l4_uint64_t transferred = bytes_transferred(cmd);
+          info.printf("\033[31mInout error (%s): %lld bytes transferred.\033[m\n",
+                      cmd->str_error(), transferred);
+          if (cmd->flags.crc_error() || cmd->flags.timeout())
+            speed_error(cmd->flags);
+          if (cmd->flags.packed())
+            {
+              // Determine the failed entry of the packed command.
+              cmd->reinit_region(Mmc::Cmd8_send_ext_csd, 0, 512,
+                                 _ecsd_buf.pget());
+              cmd->flags.packed_status() = 1;
+              work = More_work;
+            }
+          else if (   cmd->flags.crc_error() && !cmd->flags.retuned()
+                   && _tuned_timing != Mmc::Legacy)
+            {
+              // The sampling point drifted: Re-tune and repeat the transfer.
+              retune_start(cmd);
+              work = More_work;
+            }
+          else
+            {
+              complete_inout(cmd, -L4_EIO);
+              work = Work_done;
+            }
+        }
+      else
+        {
+          if (_drv.dma_adma2())
+            work = handle_irq_inout_adma2(cmd);
+          else
+            work = handle_irq_inout_sdma(cmd);
+        }
+    }
+
+  if (work == Work_done)
+    {
+      cmd->work_done();
+      cmd->destruct();
+    }
+
+  cmd_queue_kick();
+}
+
+/**
+ * Handle the completion of reading EXT_CSD after a packed write failed.
+ *
+ * If the device reported the index of the failed entry, the preceding entries
+ * were written and are completed successfully. Otherwise all entries fail.
+ */
+template <class Driver>
+void
+Device<Driver>::handle_irq_packed_status(Cmd *cmd)
+{
+  cmd->sectors_done = 0;
+  if (cmd->error())
+    warn.printf("Cannot read packed command status (%s).\n",
+                cmd->str_error());
+  else
+    {
+      auto const &st = _ecsd_rt.ec36_packed_command_status;
+      unsigned idx = _ecsd_rt.ec35_packed_failure_index;
+      info.printf("\033[31mPacked write error (status %02x, entry %u/%u).\033[m\n",
+                  st.raw, idx, cmd->num_merged + 1);
+      if (st.error() && st.indexed_error()
+          && idx >= 1 && idx <= cmd->num_merged + 1)
+        {
+          // Header and entries before the failed entry.
+          cmd->sectors_done = 1;
+          if (idx > 1)
+            for (auto const *b = cmd->blocks; b; b = b->next.get())
+              cmd->sectors_done += b->num_sectors;
+          for (unsigned i = 0; i + 2 < idx; ++i)
+            cmd->sectors_done += cmd->merged[i].num_sectors;
+        }
+    }
+
+  complete_inout(cmd, -L4_EIO);
+  cmd->work_done();
+  cmd->destruct();
+  cmd_queue_kick();
+}
+
+/**
+ * Handle the completion of a command of the cache flush sequence.
+ *
+ * After CMD6 (SWITCH/FLUSH_CACHE) was accepted, the device status is polled
+ * with CMD13 until the device left the programming state, see prg_poll().
+ */
+template <class Driver>
+void
+Device<Driver>::handle_irq_flush(Cmd *cmd)
+{
+  int error = L4_EOK;
+  if (cmd->error() || cmd->switch_error())
+    {
+      warn.printf("\033[31mFlush: %s failed (%s).\033[m\n",
+                  cmd->cmd_to_str().c_str(), cmd->str_status().c_str());
+      error = -L4_EIO;
+    }
+  else if (cmd->cmd == Mmc::Cmd6_switch)
+    {
+      prg_start(cmd, Flush_timeout_us);
+      return;
+    }
+  else if (!prg_done(cmd))
+    {
+      if (prg_poll(cmd))
+        return;
+      warn.printf("\033[31mFlush: timeout.\033[m\n");
+      error = -L4_EIO;
+    }
+
+  bool barrier = cmd->flags.barrier();
+  Cmd::Callback_io cb = cmd->cb_io;
+  cmd->work_done();
+  cmd->destruct();
+  cqe_resume();
+
+  if (barrier)
+    cb(error, 0);
+  else
+    flush_done(error);
+  cmd_queue_kick();
+}
+
+/**
+ * Start polling the device status after a command which made the device enter
+ * the programming state. Give up after `timeout_us`.
+ */
+template <class Driver>
+void
+Device<Driver>::prg_start(Cmd *cmd, l4_uint64_t timeout_us)
+{
+  _prg_started = l4_kip_clock(l4re_kip());
+  _prg_timeout = _prg_started + timeout_us;
+  prg_send_status(cmd);
+  cmd_queue_kick();
+}
+
+/**
+ * Send CMD13 as part of an asynchronous command sequence (flush, erase,
+ * BKOPS, partition switch, bus speed switch). The sequence flags are
+ * preserved.
+ */
+template <class Driver>
+void
+Device<Driver>::prg_send_status(Cmd *cmd)
+{
+  Cmd::Flags flags = cmd->flags;
+  cmd->init_arg(Mmc::Cmd13_send_status, _rca << 16);
+  cmd->flags.flush() = flags.flush();
+  cmd->flags.barrier() = flags.barrier();
+  cmd->flags.erase() = flags.erase();
+  cmd->flags.erase_zeroes() = flags.erase_zeroes();
+  cmd->flags.hpi() = flags.hpi();
+  cmd->flags.hpi_write() = flags.hpi_write();
+  cmd->flags.no_hpi() = flags.no_hpi();
+  cmd->flags.bkops() = flags.bkops();
+  cmd->flags.hw_part() = flags.hw_part();
+  cmd->flags.speed() = flags.speed();
+}
+
+/**
+ * Return true if the CMD13 response reports that the device finished
+ * programming.
+ */
+template <class Driver>
+bool
+Device<Driver>::prg_done(Cmd *cmd)
+{
+  Mmc::Device_status s = cmd->mmc_status();
+  return s.ready_for_data() && s.current_state() != s.Programming;
+}
+
+/**
+ * The device is still programming: Poll the device status again later. The
+ * server loop is not blocked between two polls.
+ *
+ * \retval true   Polling continues.
+ * \retval false  Timeout.
+ */
+template <class Driver>
+bool
+Device<Driver>::prg_poll(Cmd *cmd)
+{
+  if (l4_kip_clock(l4re_kip()) >= _prg_timeout)
+    return false;
+
+  if (hpi_preempt(cmd))
+    return true;
+
+  Errand::schedule([this, cmd]
+    {
+      prg_send_status(cmd);
+      cmd_queue_kick();
+    }, Prg_poll_us);
+  return true;
+}
+
+/**
+ * Interrupt a flush or erase sequence using HPI if a read request is waiting
+ * for the device which is programming for a while. The interrupted sequence is
+ * restarted by a new command queued behind the pending requests. A restarted
+ * sequence is not interrupted again so that it makes progress.
+ *
+ * Background operations are interrupted as soon as any request arrives. They
+ * are not restarted but resumed in the next idle period, see bkops_idle().
+ *
+ * \retval true   HPI was sent.
+ * \retval false  Continue polling the programming state.
+ */
+template <class Driver>
+bool
+Device<Driver>::hpi_preempt(Cmd *cmd)
+{
+  if (   !_hpi || cmd->flags.hpi() || cmd->flags.no_hpi()
+      || !(cmd->flags.flush() || cmd->flags.erase() || cmd->flags.bkops()))
+    return false;
+
+  if (cmd->flags.bkops())
+    {
+      if (_io_time == _bkops_io_time)
+        return false;
+    }
+  else
+    {
+      if (l4_kip_clock(l4re_kip()) < _prg_started + Hpi_after_us)
+        return false;
+
+      // Held back reads are only passed to the command queue if there is
+      // room.
+      if (_sched.reads_pending())
+        sched_dispatch();
+
+      if (!_drv.cmd_any_queued([](Cmd const *c)
+                                 { return c->flags.inout()
+                                          && c->flags.inout_read(); }))
+        return false;
+
+      Cmd *restart = _drv.cmd_create();
+      if (!restart)
+        return false;
+
+      hpi_restart(restart, cmd);
+    }
+
+  Cmd::Flags flags = cmd->flags;
+  if (_hpi_cmd12)
+    {
+      Mmc::Arg_cmd12_stop_transmission a12;
+      a12.rca() = _rca;
+      a12.hpi() = 1;
+      cmd->init_arg(Mmc::Cmd12_stop_transmission_wr, a12.raw);
+    }
+  else
+    {
+      Mmc::Arg_cmd13_send_status a13;
+      a13.rca() = _rca;
+      a13.hpi() = 1;
+      cmd->init_arg(Mmc::Cmd13_send_status, a13.raw);
+    }
+  cmd->flags.flush() = flags.flush();
+  cmd->flags.barrier() = flags.barrier();
+  cmd->flags.erase() = flags.erase();
+  cmd->flags.bkops() = flags.bkops();
+  cmd->flags.hpi() = 1;
+
+  trace.printf("HPI: interrupt %s for pending %s.\n",
+               flags.flush() ? "flush" : flags.erase() ? "erase" : "BKOPS",
+               flags.bkops() ? "request" : "read");
+  _prg_timeout = l4_kip_clock(l4re_kip()) + _hpi_timeout_us;
+  cmd_queue_kick();
+  return true;
+}
+
+/**
+ * Initialize `restart` to repeat the flush or erase sequence of `cmd` from the
+ * beginning. For an erase, the current segment is erased again.
+ */
+template <class Driver>
+void
+Device<Driver>::hpi_restart(Cmd *restart, Cmd const *cmd)
+{
+  restart->sector = cmd->sector;
+  restart->blocks = cmd->blocks;
+  restart->cb_io = cmd->cb_io;
+  if (cmd->flags.flush())
+    {
+      Mmc::Reg_ecsd::Ec32_flush_cache fc(0);
+      if (cmd->flags.barrier())
+        fc.barrier() = 1;
+      else
+        fc.flush() = 1;
+      init_mmc_switch(restart, fc.index(), fc.raw);
+      restart->flags.flush() = 1;
+      restart->flags.barrier() = cmd->flags.barrier();
+    }
+  else
+    {
+      restart->flags.erase_zeroes() = cmd->flags.erase_zeroes();
+      erase_next(restart);
+    }
+  restart->flags.no_hpi() = 1;
+}
+
+/**
+ * A read request arrived: Check after `Hpi_after_us` if it waits for a write
+ * in progress, see hpi_write_check().
+ */
+template <class Driver>
+void
+Device<Driver>::hpi_write_arm()
+{
+  if (!_hpi || _hpi_write_armed)
+    return;
+
+  _hpi_write_armed = true;
+  Errand::schedule([this] { hpi_write_check(); }, Hpi_after_us);
+}
+
+/**
+ * Interrupt the current write using HPI if it transfers data for a while and
+ * read requests are waiting behind it. Only reads may be queued behind the
+ * write because the remaining sectors are written after them. The check is
+ * repeated as long as reads are pending.
+ */
+template <class Driver>
+void
+Device<Driver>::hpi_write_check()
+{
+  _hpi_write_armed = false;
+  if (_cqe_active || _swcq_active)
+    return;
+
+  // Held back reads are only passed to the command queue if there is room.
+  if (_sched.reads_pending())
+    sched_dispatch();
+
+  Cmd *cmd = _drv.cmd_current();
+  bool reads = _sched.reads_pending();
+  bool others = false;
+  _drv.cmd_any_queued([cmd, &reads, &others](Cmd const *c)
+    {
+      if (c != cmd)
+        {
+          if (c->flags.inout() && c->flags.inout_read())
+            reads = true;
+          else
+            others = true;
+        }
+      return false;
+    });
+  if (!reads)
+    return;
+
+  if (   cmd && cmd != _swcq_cmd && !others && !_hpi_resume
+      && cmd->flags.inout() && !cmd->flags.inout_read()
+      && !cmd->flags.packed() && !cmd->flags.reliable_write()
+      && !cmd->flags.no_hpi()
+      && cmd->cmd == Mmc::Cmd25_write_multiple_block
+      && l4_kip_clock(l4re_kip()) >= _cmd_submitted + Hpi_after_us
+      && hpi_write(cmd))
+    return;
+
+  hpi_write_arm();
+}
+
+/**
+ * Interrupt the write `cmd` in its data phase: The transfer is aborted by CMD12
+ * and the device stops programming due to HPI. After the device left the
+ * programming state, the number of correctly programmed sectors is read from
+ * EXT_CSD. A new command queued behind the pending reads writes the remaining
+ * sectors, see hpi_write_resume().
+ *
+ * \retval true   HPI was sent.
+ * \retval false  The transfer continues.
+ */
+template <class Driver>
+bool
+Device<Driver>::hpi_write(Cmd *cmd)
+{
+  // The command writing the remaining sectors is created after the abort.
+  if (_drv.cmd_queue_full())
+    return false;
+
+  Mmc::Arg_cmd12_stop_transmission a12;
+  a12.rca() = _rca;
+  a12.hpi() = _hpi_cmd12;
+  try
+    {
+      if (!_drv.cmd_abort(cmd, a12.raw))
+        return false;
+    }
+  catch (L4::Runtime_error const &e)
+    {
+      // The device state is determined by CMD13 anyway.
+      warn.printf("HPI: abort write: %s: %s.\n", e.str(), e.extra_str());
+    }
+
+  _hpi_resume = _drv.cmd_create();
+
+  // The inout fields are retained for hpi_write_resume().
+  Mmc::Arg_cmd13_send_status a13;
+  a13.rca() = _rca;
+  a13.hpi() = !_hpi_cmd12;
+  cmd->init_arg(Mmc::Cmd13_send_status, a13.raw);
+  cmd->flags.hpi() = 1;
+  cmd->flags.hpi_write() = 1;
+
+  trace.printf("HPI: interrupt write at sector %u for pending read.\n",
+               cmd->sector);
+  _prg_timeout = l4_kip_clock(l4re_kip()) + _hpi_timeout_us;
+  cmd_queue_kick();
+  return true;
+}
+
+/**
+ * Complete the requests of the write interrupted by HPI which were programmed
+ * entirely according to CORRECTLY_PRG_SECTORS_NUM and set up `_hpi_resume` to
+ * write the remaining sectors. If EXT_CSD could not be read, the interrupted
+ * transfer is repeated from the beginning.
+ */
+template <class Driver>
+void
+Device<Driver>::hpi_write_resume(Cmd *cmd)
+{
+  l4_uint32_t skip = 0;
+  if (cmd->error())
+    warn.printf("\033[31mHPI: cannot read programmed sectors (%s).\033[m\n",
+                cmd->str_error());
+  else
+    {
+      auto const *n = _ecsd_rt.ec242_correctly_prg_sectors_num;
+      skip = n[0] | n[1] << 8 | n[2] << 16 | l4_uint32_t{n[3]} << 24;
+    }
+
+  trace.printf("HPI: %u sectors programmed before HPI.\n", skip);
+
+  Cmd *restart = _hpi_resume;
+  l4_uint64_t sector = cmd->sector;
+  Cmd::Block const *blocks = cmd->blocks;
+  Block_device::Inout_callback cb = cmd->cb_io;
+  l4_uint64_t done = bytes_transferred(cmd);
+  unsigned next = 0;
+  for (;;)
+    {
+      l4_uint32_t num_sectors = 0;
+      for (auto const *b = blocks; b; b = b->next.get())
+        num_sectors += b->num_sectors;
+      if (skip < num_sectors)
+        break;
+
+      // This request was programmed entirely.
+      skip -= num_sectors;
+      _cache_dirty = true;
+      ++_stat_ios;
+      cb(L4_EOK, done + l4_uint64_t{num_sectors} * sector_size());
+
+      if (next == cmd->num_merged)
+        {
+          // Nothing left to write, the command only reads the device status.
+          restart->init_arg(Mmc::Cmd13_send_status, _rca << 16);
+          restart->flags.hpi() = 1;
+          _hpi_resume = nullptr;
+          return;
+        }
+
+      sector = cmd->merged[next].sector;
+      blocks = cmd->merged[next].blocks;
+      cb = cmd->merged[next].cb_io;
+      done = 0;
+      ++next;
+    }
+
+  done += l4_uint64_t{skip} * sector_size();
+  sector += skip;
+
+  // Copy the blocks not yet programmed.
+  _hpi_resume_blocks.reset();
+  std::unique_ptr<Block_device::Inout_block> *tail = &_hpi_resume_blocks;
+  for (auto const *b = blocks; b; b = b->next.get())
+    {
+      if (skip >= b->num_sectors)
+        {
+          skip -= b->num_sectors;
+          continue;
+        }
+
+      l4_uint64_t offs = l4_uint64_t{skip} * sector_size();
+      *tail = std::make_unique<Block_device::Inout_block>();
+      (*tail)->dma_addr = b->dma_addr + offs;
+      (*tail)->virt_addr = static_cast<char *>(b->virt_addr) + offs;
+      (*tail)->num_sectors = b->num_sectors - skip;
+      tail = &(*tail)->next;
+      skip = 0;
+    }
+
+  restart->init_inout(sector, _hpi_resume_blocks.get(),
+                      [cb, done](int error, l4_size_t size)
+                        { cb(error, done + size); },
+                      false);
+  for (; next < cmd->num_merged; ++next)
+    restart->merged[restart->num_merged++] = cmd->merged[next];
+  restart->flags.no_hpi() = 1;
+  inout_restart(restart);
+}
+
+/**
+ * Handle the completion of HPI or of polling the programming state after HPI.
+ * Afterwards, the pending requests are executed before the restarted sequence.
+ * After HPI interrupted a write, EXT_CSD is read to determine the programmed
+ * sectors before completing the HPI sequence.
+ */
+template <class Driver>
+void
+Device<Driver>::handle_irq_hpi(Cmd *cmd)
+{
+  if (cmd->flags.hpi_write() && cmd->cmd == Mmc::Cmd8_send_ext_csd)
+    hpi_write_resume(cmd);
+  else if (cmd->error())
+    warn.printf("\033[31mHPI: %s failed (%s).\033[m\n",
+                cmd->cmd_to_str().c_str(), cmd->str_status().c_str());
+  else if (!prg_done(cmd))
+    {
+      if (prg_poll(cmd))
+        return;
+      warn.printf("\033[31mHPI: timeout.\033[m\n");
+    }
+
+  if (cmd->flags.hpi_write() && cmd->cmd != Mmc::Cmd8_send_ext_csd)
+    {
+      cmd->reinit_region(Mmc::Cmd8_send_ext_csd, 0, 512, _ecsd_buf.pget());
+      cmd_queue_kick();
+      return;
+    }
+
+  cmd->work_done();
+  cmd->destruct();
+  cqe_resume();
+  cmd_queue_kick();
+}
+
+/**
+ * Check periodically if the device is idle for `Bkops_idle_us`. In that case,
+ * start background operations if required by the device. The status is only
+ * read again after further requests or if the device signaled an exception
+ * event.
+ */
+template <class Driver>
+void
+Device<Driver>::bkops_idle()
+{
+  if (   (_io_time != _bkops_io_time || _bkops_urgent)
+      && l4_kip_clock(l4re_kip()) >= _io_time + Bkops_idle_us
+      && queues_idle() && _hw_part_pending.empty())
+    bkops_start();
+
+  Errand::schedule([this] { bkops_idle(); }, Bkops_idle_us);
+}
+
+/**
+ * Queue the command sequence for background operations: Read BKOPS_STATUS
+ * (CMD8), start BKOPS (CMD6) and poll the device status until the device
+ * finished, see handle_irq_bkops().
+ */
+template <class Driver>
+void
+Device<Driver>::bkops_start()
+{
+  Cmd *cmd = _drv.cmd_create();
+  if (!cmd)
+    return;
+
+  try
+    {
+      cqe_suspend(cmd);
+      cmd->init_data(Mmc::Cmd8_send_ext_csd, 0, 512, _ecsd_buf.pget(), 0);
+      cmd->flags.bkops() = 1;
+      _bkops_io_time = _io_time;
+      _bkops_urgent = false;
+      cmd_queue_kick();
+    }
+  catch (L4::Runtime_error const &e)
+    {
+      warn.printf("BKOPS fails: %s: %s.\n", e.str(), e.extra_str());
+
+      cmd->work_done();
+      cmd->destruct();
+      cqe_resume();
+    }
+}
+
+/**
+ * Handle the completion of a command of the background operations sequence.
+ *
+ * BKOPS is not started if a request arrived meanwhile. While the device
+ * performs background operations, arriving requests interrupt BKOPS using
+ * HPI, see hpi_preempt().
+ */
+template <class Driver>
+void
+Device<Driver>::handle_irq_bkops(Cmd *cmd)
+{
+  if (cmd->error() || cmd->switch_error())
+    warn.printf("\033[31mBKOPS: %s failed (%s).\033[m\n",
+                cmd->cmd_to_str().c_str(), cmd->str_status().c_str());
+  else if (cmd->cmd == Mmc::Cmd8_send_ext_csd)
+    {
+      Mmc::Reg_ecsd::Ec246_bkops_status bs = _ecsd_rt.ec246_bkops_status;
+      Mmc::Reg_ecsd::Ec54_exception_events_status es(
+        _ecsd_rt.ec54_exception_events_status[0]);
+      if (   _io_time == _bkops_io_time
+          && (bs.level() != bs.Not_required || es.urgent_bkops()))
+        {
+          trace.printf("BKOPS: start (level %u%s).\n", (unsigned)bs.level(),
+                       es.urgent_bkops() ? ", urgent" : "");
+          Mmc::Reg_ecsd::Ec164_bkops_start bst(0);
+          bst.start() = 1;
+          init_mmc_switch(cmd, bst.index(), bst.raw);
+          cmd->flags.bkops() = 1;
+          cmd_queue_kick();
+          return;
+        }
+    }
+  else if (cmd->cmd == Mmc::Cmd6_switch)
+    {
+      prg_start(cmd, Bkops_timeout_us);
+      return;
+    }
+  else if (!prg_done(cmd))
+    {
+      if (prg_poll(cmd))
+        return;
+      warn.printf("\033[31mBKOPS: timeout.\033[m\n");
+    }
+  else
+    trace.printf("BKOPS: done.\n");
+
+  cmd->work_done();
+  cmd->destruct();
+  cqe_resume();
+  cmd_queue_kick();
+}
+
+/**
+ * Halt the CQE for executing `cmd` unless it is already halted for a previous
+ * command.
+ */
+template <class Driver>
+void
+Device<Driver>::cqe_suspend(Cmd *cmd)
+{
+  if (_cqe_active && cmd == _drv.cmd_current())
+    _drv.cqe_halt(true);
+}
+
+/**
+ * Resume the CQE after all commands executed while halted are done. Tasks
+ * which failed with a CRC error are submitted again, see handle_irq_cqe().
+ */
+template <class Driver>
+void
+Device<Driver>::cqe_resume()
+{
+  if (!_cqe_active || _drv.cmd_current())
+    return;
+
+  _drv.cqe_halt(false);
+  while (_cqe_retry)
+    {
+      unsigned tag = __builtin_ctz(_cqe_retry);
+      _cqe_retry &= ~(1U << tag);
+      Cmd *task = _cmdq_tasks.task(tag);
+      try
+        {
+          _drv.cqe_task_submit(tag, task);
+        }
+      catch (L4::Runtime_error const &e)
+        {
+          warn.printf("inout_data fails: %s: %s.\n", e.str(), e.extra_str());
+          cmdq_task_done(task, -L4_EIO);
+        }
+    }
+}
+
+/**
+ * Complete all tasks reported finished by the command queue engine.
+ *
+ * After a CRC error, the sampling point drifted: The CQE is halted for
+ * re-tuning and the failed tasks are submitted again afterwards. A task is
+ * only repeated once.
+ */
+template <class Driver>
+void
+Device<Driver>::handle_irq_cqe()
+{
+  l4_uint32_t done = 0;
+  l4_uint32_t failed = 0;
+  Cmd::Flags errors;
+  _drv.cqe_handle_irq(&done, &failed, &errors);
+  if (errors.crc_error() || errors.timeout())
+    speed_error(errors);
+
+  bool retune = errors.crc_error() && _tuned_timing != Mmc::Legacy;
+  l4_uint32_t finished = (done | failed) & _cmdq_tasks.busy();
+  while (finished)
+    {
+      unsigned tag = __builtin_ctz(finished);
+      finished &= ~(1U << tag);
+
+      Cmd *task = _cmdq_tasks.task(tag);
+      if (!(failed & (1U << tag)))
+        cmdq_task_done(task, L4_EOK);
+      else if (retune && !task->flags.retuned())
+        {
+          task->flags.retuned() = 1;
+          _cqe_retry |= 1U << tag;
+        }
+      else
+        cmdq_task_done(task, -L4_EIO);
+    }
+
+  if (_cqe_retry && !_retuning)
+    {
+      if (Cmd *cmd = _drv.cmd_create())
+        {
+          cqe_suspend(cmd);
+          retune_start(cmd);
+          cmd_queue_kick();
+          return;
+        }
+      cqe_resume();
+    }
+
+  cqe_adapt_coalescing();
+
+  if (_cmdq_tasks.num_busy())
+    unmask_interrupt();
+}
+
+/**
+ * Adapt CQE interrupt coalescing to the number of tasks in flight.
+ *
+ * With a shallow queue, raise an interrupt for every completed task to keep
+ * the latency low. With a deep queue, batch completions but limit the delay
+ * of the first completion in a batch to `Cqe_coalesce_us` per batched task.
+ */
+template <class Driver>
+void
+Device<Driver>::cqe_adapt_coalescing()
+{
+  unsigned busy = _cmdq_tasks.num_busy();
+  unsigned count = busy >= 16 ? 8 : busy >= 8 ? 4 : busy >= 4 ? 2 : 1;
+  if (count == _cqe_coalesce)
+    return;
+
+  _cqe_coalesce = count;
+  _drv.cqe_set_coalescing(count, count * Cqe_coalesce_us);
+}
+
+/**
+ * Software command queuing: Handle the completion of the command which drives
+ * the queue.
+ *
+ * The tasks are queued on the device using CMD44/CMD45. CMD13 with the SQS bit
+ * set returns the queue status register (QSR) containing the tasks which are
+ * ready for execution. Ready tasks are executed with CMD46/CMD47 in the order
+ * chosen by the device. On any error, the entire queue is discarded (CMD48)
+ * and all tasks are completed with error.
+ */
+template <class Driver>
+void
+Device<Driver>::handle_irq_swcq(Cmd *cmd)
+{
+  if (cmd->flags.retune())
+    {
+      handle_irq_retune(cmd);
+      return;
+    }
+
+  Work_status work;
+  if (cmd->error() && cmd->cmd != Mmc::Cmd48_cmdq_task_mgmt)
+    {
+      warn.printf("Command queue: %s failed (%s).\n",
+                  cmd->cmd_to_str().c_str(), cmd->str_error());
+      if (cmd->flags.crc_error() || cmd->flags.timeout())
+        speed_error(cmd->flags);
+      _swcq_retune = cmd->flags.crc_error() && _tuned_timing != Mmc::Legacy;
+      Mmc::Arg_cmd48_cmdq_task_mgmt a48;
+      a48.tm_op_code() = Mmc::Arg_cmd48_cmdq_task_mgmt::Discard_queue;
+      cmd->init_arg(Mmc::Cmd48_cmdq_task_mgmt, a48.raw);
+      work = More_work;
+    }
+  else if (cmd->cmd == Mmc::Cmd44_queued_task_params)
+    {
+      cmd->init_arg(Mmc::Cmd45_queued_task_address,
+                    _cmdq_tasks.task(_swcq_tag)->arg);
+      work = More_work;
+    }
+  else
+    {
+      switch (cmd->cmd)
+        {
+        case Mmc::Cmd45_queued_task_address:
+          _swcq_queued |= 1U << _swcq_tag;
+          break;
+        case Mmc::Cmd13_send_status:
+          _swcq_ready = cmd->resp[0];
+          if (   !(_swcq_ready & _swcq_queued)
+              && !(_cmdq_tasks.busy() & ~_swcq_queued))
+            {
+              // The device still prepares the queued tasks.
+              Errand::schedule([this, cmd] { swcq_poll(cmd); }, _swcq_poll_us);
+              _swcq_poll_us = cxx::min<l4_uint32_t>(_swcq_poll_us * 2,
+                                                    Swcq_poll_max_us);
+              return;
+            }
+          _swcq_poll_us = Swcq_poll_us;
+          break;
+        case Mmc::Cmd46_execute_read_task:
+        case Mmc::Cmd47_execute_write_task:
+          _swcq_queued &= ~(1U << _swcq_tag);
+          _swcq_ready &= ~(1U << _swcq_tag);
+          cmdq_task_done(_cmdq_tasks.task(_swcq_tag), L4_EOK);
+          break;
+        case Mmc::Cmd48_cmdq_task_mgmt:
+          if (cmd->error())
+            warn.printf("Command queue: Discard failed (%s).\n",
+                        cmd->str_error());
+          _swcq_queued = 0;
+          _swcq_ready = 0;
+          for (l4_uint32_t busy = _cmdq_tasks.busy(); busy; busy &= busy - 1)
+            {
+              // After re-tuning, the tasks are queued again once.
+              Cmd *task = _cmdq_tasks.task(__builtin_ctz(busy));
+              if (_swcq_retune && !cmd->error() && !task->flags.retuned())
+                task->flags.retuned() = 1;
+              else
+                cmdq_task_done(task, -L4_EIO);
+            }
+          if (_swcq_retune && !cmd->error() && _cmdq_tasks.busy())
+            {
+              _swcq_retune = false;
+              retune_start(cmd);
+              cmd_queue_kick();
+              return;
+            }
+          _swcq_retune = false;
+          break;
+        default:
+          L4Re::throw_error(-L4_EINVAL, "Unexpected command queue command");
+        }
+      work = swcq_next(cmd);
+    }
+
+  if (work == Work_done)
+    {
+      cmd->work_done();
+      cmd->destruct();
+      _swcq_cmd = nullptr;
+    }
+
+  cmd_queue_kick();
+}
+
+/**
+ * Software command queuing: Continue after the queue status reported no ready
+ * task. The delay between two polls doubles up to `Swcq_poll_max_us` until a
+ * task becomes ready.
+ */
+template <class Driver>
+void
+Device<Driver>::swcq_poll(Cmd *cmd)
+{
+  if (swcq_next(cmd) == Work_done)
+    {
+      cmd->work_done();
+      cmd->destruct();
+      _swcq_cmd = nullptr;
+    }
+
+  cmd_queue_kick();
+}
+
+/**
+ * Software command queuing: Determine the next command.
+ *
+ * Tasks not yet known to the device are queued first to give the device the
+ * chance to reorder and prefetch. Then ready tasks are executed. Otherwise the
+ * queue status is polled, after an empty status with a delay, see swcq_poll().
+ */
+template <class Driver>
+typename Device<Driver>::Work_status
+Device<Driver>::swcq_next(Cmd *cmd)
+{
+  l4_uint32_t busy = _cmdq_tasks.busy();
+  if (l4_uint32_t unqueued = busy & ~_swcq_queued)
+    {
+      _swcq_tag = __builtin_ctz(unqueued);
+      Cmd const *task = _cmdq_tasks.task(_swcq_tag);
+      Mmc::Arg_cmd44_queued_task_params a44;
+      a44.blocks() = task->blockcnt;
+      a44.task_id() = _swcq_tag;
+      a44.data_dir() = task->flags.inout_read();
+      a44.reliable_write() = task->flags.reliable_write();
+      cmd->init_arg(Mmc::Cmd44_queued_task_params, a44.raw);
+      return More_work;
+    }
+
+  if (l4_uint32_t ready = _swcq_ready & _swcq_queued)
+    {
+      _swcq_tag = __builtin_ctz(ready);
+      Cmd const *task = _cmdq_tasks.task(_swcq_tag);
+      bool inout_read = task->flags.inout_read();
+      Mmc::Arg_cmd46_execute_task a46;
+      a46.task_id() = _swcq_tag;
+      cmd->init_inout(task->sector, task->blocks, nullptr, inout_read);
+      cmd->reinit_inout_data(inout_read ? Mmc::Cmd46_execute_read_task
+                                        : Mmc::Cmd47_execute_write_task,
+                             a46.raw, task->blockcnt, 512,
+                             Cmd::Flag_auto_cmd23::No_auto_cmd23);
+      return More_work;
+    }
+
+  if (_swcq_queued)
+    {
+      Mmc::Arg_cmd13_send_status a13;
+      a13.rca() = _rca;
+      a13.sqs() = 1;
+      cmd->init_arg(Mmc::Cmd13_send_status, a13.raw);
+      return More_work;
+    }
+
+  return Work_done;
+}
+
+template <class Driver>
+typename Device<Driver>::Work_status
+Device<Driver>::handle_irq_inout_sdma(Cmd *cmd)
+{
+  if (cmd->status == Cmd::Success)
+    {
+      // Read/Write command finished successfully, go to next block.
+      if (cmd->cmd != Mmc::Cmd23_set_block_count)
+        {
+          auto const *b = cmd->blocks;
+          l4_uint32_t num_sectors = sdma_num_sectors(cmd);
+          cmd->sector += num_sectors;
+          cmd->sectors_done += num_sectors;
+          do
+            {
+              num_sectors -= b->num_sectors;
+              b = b->next.get();
+            }
+          while (b && (num_sectors || b->num_sectors == 0));
+          cmd->blocks = b;
+        }
+    }
+
+  return transfer_block_sdma(cmd);
+}
+
+template <class Driver>
+typename Device<Driver>::Work_status
+Device<Driver>::transfer_block_sdma(Cmd *cmd)
+{
+  if (!cmd->blocks)
+    {
+      complete_inout(cmd, L4_EOK);
+      return Work_done;
+    }
+
+  l4_uint32_t num_sectors = sdma_num_sectors(cmd);
+
+  // A reliable write requires CMD23, even for a single sector.
+  if (num_sectors == 1 && !cmd->flags.reliable_write())
+    {
+      cmd->reinit_inout_data(cmd->flags.inout_read()
+                               ? Mmc::Cmd17_read_single_block
+                               : Mmc::Cmd24_write_block,
+                             cmd->sector * _addr_mult, 1, 512,
+                             Cmd::Flag_auto_cmd23::No_auto_cmd23);
+    }
+  else if (_has_cmd23 && cmd->cmd != Mmc::Cmd23_set_block_count)
+    {
+      // Previous command was either transfer command or CMD12.
+      Mmc::Arg_cmd23_set_block_count a23;
+      a23.blocks() = num_sectors;
+      a23.reliable_write() = cmd->flags.reliable_write();
+      cmd->reinit_inout_nodata(Mmc::Cmd23_set_block_count, a23.raw);
+    }
+  else
+    {
+      cmd->reinit_inout_data(cmd->flags.inout_read()
+                               ? Mmc::Cmd18_read_multiple_block
+                               : Mmc::Cmd25_write_multiple_block,
+                             cmd->sector * _addr_mult, num_sectors, 512,
+                             Cmd::Flag_auto_cmd23::No_auto_cmd23);
+      if (!_has_cmd23)
+        cmd->flags.inout_cmd12() = 1;
+    }
+
+  return More_work;
+}
+
+/**
+ * Return the number of sectors of the next SDMA transfer starting at
+ * `cmd->blocks`. Following blocks are included as long as the driver can
+ * continue the transfer at the next block, i.e. the previous block ends at the
+ * alignment required by the driver. The request is split at other blocks and
+ * at blocks which require the bounce buffer.
+ */
+template <class Driver>
+l4_uint32_t
+Device<Driver>::sdma_num_sectors(Cmd const *cmd)
+{
+  auto const *b = cmd->blocks;
+  l4_uint32_t num_sectors = b->num_sectors;
+  l4_size_t align = _drv.sdma_seg_align();
+  if (!align)
+    return num_sectors;
+
+  l4_uint32_t max_sectors = _drv.max_inout_req_size() / Sector_size;
+  for (;;)
+    {
+      l4_uint64_t size = l4_uint64_t{b->num_sectors} * Sector_size;
+      if (   !_drv.dma_accessible(b->dma_addr, size)
+          || ((b->dma_addr + size) & (align - 1)))
+        break;
+
+      auto const *next = b->next.get();
+      while (next && next->num_sectors == 0)
+        next = next->next.get();
+      if (   !next || num_sectors + next->num_sectors > max_sectors
+          || !_drv.dma_accessible(next->dma_addr,
+                                  l4_uint64_t{next->num_sectors} * Sector_size))
+        break;
+
+      num_sectors += next->num_sectors;
+      b = next;
+    }
+
+  return num_sectors;
 }
 
 template <class Driver>
 void
-Device<Driver>::handle_irq()
+Device<Driver>::set_block_count_adma2(Cmd *cmd)
 {
-  if (trace.is_active())
-    _drv.show_interrupt_status("HANDLE IRQ: ");
-  ++_stat_ints;
-  try
+  l4_uint32_t num_sectors = 0;
+  cmd->for_each_block([&num_sectors](Cmd::Block const *b)
+                        { num_sectors += b->num_sectors; });
+
+  trace2.printf("set_block_count_adma2: sector=%u num_sectors=%u\n",
+                cmd->sector, num_sectors);
+
+  // Auto CMD23 cannot mark the transfer as packed command or reliable write.
+  if (   !cmd->flags.packed() && !cmd->flags.reliable_write()
+      && (!_has_cmd23 || _drv.auto_cmd23()))
     {
-      Cmd *cmd = _drv.handle_irq();
-      if (cmd)
+      cmd->reinit_inout_data(cmd->flags.inout_read()
+                               ? Mmc::Cmd18_read_multiple_block
+                               : Mmc::Cmd25_write_multiple_block,
+                             cmd->sector * _addr_mult, num_sectors, 512,
+                             _has_cmd23 && _drv.auto_cmd23()
+                               ? Cmd::Flag_auto_cmd23::Do_auto_cmd23
+                               : Cmd::Flag_auto_cmd23::No_auto_cmd23);
+      if (!_has_cmd23)
+        cmd->flags.inout_cmd12() = 1;
+    }
+  else
+    {
+      Mmc::Arg_cmd23_set_block_count a23;
+      a23.blocks() = num_sectors;
+      a23.packed() = cmd->flags.packed();
+      a23.reliable_write() = cmd->flags.reliable_write();
+      cmd->blockcnt = num_sectors;
+      cmd->reinit_inout_nodata(Mmc::Cmd23_set_block_count, a23.raw);
+    }
+}
+
+template <class Driver>
+typename Device<Driver>::Work_status
+Device<Driver>::handle_irq_inout_adma2(Cmd *cmd)
+{
+  // This function is only called once or twice:
+  //  1. With Auto CMD23, this function is called once to finish the transfer.
+  //  2. Without Auto CMD23, the previous command didn't transfer data (hence
+  //     was CMD23), so now send the actual transfer command.
+  // In the latter case, mark inout_cmd12 in case CMD23 isn't available.
+  if (cmd->cmd != Mmc::Cmd23_set_block_count)
+    {
+      // Previous command was either transfer command or CMD12.
+      cmd->sectors_done = cmd->blockcnt;
+      complete_inout(cmd, L4_EOK);
+      return Work_done;
+    }
+  else
+    {
+      cmd->reinit_inout_data(cmd->flags.inout_read()
+                             ? Mmc::Cmd18_read_multiple_block
+                             : Mmc::Cmd25_write_multiple_block,
+                             cmd->sector * _addr_mult, cmd->blockcnt, 512,
+                             Cmd::Flag_auto_cmd23::No_auto_cmd23);
+      if (!_has_cmd23)
+        cmd->flags.inout_cmd12() = 1;
+      return More_work;
+    }
+}
+
+template <class Driver>
+void
+Device<Driver>::unmask_interrupt() const
+{
+  if (_irq_unmask_at_icu)
+    _icu->unmask(_irq_num);
+  else
+    L4::Irqep_t<Device<Driver>>::obj_cap()->unmask();
+}
+
+template <class Driver>
+Tuning_cache::Key
+Device<Driver>::tuning_key(Mmc::Timing timing) const
+{
+  Tuning_cache::Key key;
+  memcpy(key.cid, _cid, sizeof(key.cid));
+  key.controller = _mmio_addr;
+  key.timing = timing;
+  return key;
+}
+
+/**
+ * Tune the sampling point for `timing` by sending tuning blocks.
+ *
+ * The tuning cache is consulted first: A mode which failed tuning before is
+ * skipped and a cached sampling point is applied and verified by a single
+ * data block. Only if this fails, full tuning is performed and its result is
+ * stored in the cache.
+ *
+ * \retval true  The sampling point for `timing` is set up.
+ */
+template <class Driver>
+bool
+Device<Driver>::tune(Cmd *cmd, Mmc::Timing timing)
+{
+  Tuning_cache::Key key = tuning_key(timing);
+  bool verify_failed = false;
+  if (auto *e = _tuning_cache.find(key))
+    {
+      if (!e->tuned)
         {
-          if (cmd->progress())
+          if (_tuning_cache.skip_failed(e))
             {
-              // Command not yet finished -- get ready for further interrupts.
-              unmask_interrupt();
-              return;
+              info.printf("Skipping mode '%s': Tuning failed before.\n",
+                          Mmc::str_timing(timing));
+              return false;
             }
-
-          // Special handling for in/out commands.
-          if (cmd->flags.inout())
+        }
+      else if (e->has_point && _drv.set_tuning_point(e->point))
+        {
+          if (tuning_verify(cmd, timing))
             {
-              handle_irq_inout(cmd);
-              return;
+              info.printf("Using cached sampling point %u.\n", e->point);
+              return true;
             }
 
-          cmd_queue_kick();
-        }
-    }
-  catch (L4::Runtime_error const &e)
+          info.printf("Cached sampling point %u failed.\n", e->point);
+          _tuning_cache.remove(e);
+          _drv.reset_tuning();
+          verify_failed = true;
+        }
+    }
+
+  bool mmc = timing == Mmc::Mmc_hs200;
+  unsigned max_loops = mmc ? Mmc::Arg_cmd21_send_tuning_block::Max_loops
+                           : Mmc::Arg_cmd19_send_tuning_block::Max_loops;
+  bool success = false;
+  for (unsigned i = 0; i < max_loops; ++i)
+    {
+      cmd->init(mmc ? Mmc::Cmd21_send_tuning_block
+                    : Mmc::Cmd19_send_tuning_block);
+      cmd_exec(cmd);
+      if (cmd->status == Cmd::Success)
+        {
+          if (_drv.tuning_finished(&success))
+            break;
+        }
+      else if (cmd->status == Cmd::Cmd_timeout)
+        break;
+    }
+
+  l4_uint32_t point = 0;
+  bool has_point = success && _drv.tuning_point(&point);
+  _tuning_cache.store(key, success, has_point, point);
+
+  // The failed verification might have corrupted the EXT_CSD in `_io_buf`.
+  if (success && mmc && verify_failed)
+    {
+      cmd->init_data(Mmc::Cmd8_send_ext_csd, 0, 512, _io_buf.pget(), 0);
+      cmd_exec(cmd);
+      success = !cmd->error();
+    }
+
+  return success;
+}
+
+/**
+ * Check periodically if re-tuning is due, either because the re-tuning period
+ * of the controller expired or because the controller requests re-tuning.
+ * Re-tuning is postponed until no requests are in flight. With many requests,
+ * a drifting sampling point is handled after a CRC error, see
+ * handle_irq_inout().
+ */
+template <class Driver>
+void
+Device<Driver>::retune_timer()
+{
+  l4_cpu_time_t now = l4_kip_clock(l4re_kip());
+  if (   _tuned_timing != Mmc::Legacy && !_retuning && !_speed_switching
+      && queues_idle()
+      && (   (_retune_period_us && now >= _retune_time + _retune_period_us)
+          || _drv.retuning_requested()))
+    {
+      if (Cmd *cmd = _drv.cmd_create())
+        {
+          cqe_suspend(cmd);
+          retune_start(cmd);
+          cmd_queue_kick();
+        }
+    }
+
+  Errand::schedule([this] { retune_timer(); }, Retune_check_us);
+}
+
+/**
+ * Turn `cmd` into the first tuning block of a re-tuning sequence, see
+ * handle_irq_retune(). For an inout command, the transfer state is retained
+ * for repeating the transfer afterwards.
+ */
+template <class Driver>
+void
+Device<Driver>::retune_start(Cmd *cmd)
+{
+  trace.printf("Re-tuning '%s'%s.\n", Mmc::str_timing(_tuned_timing),
+               cmd->flags.inout() ? " after CRC error" : "");
+  _drv.reset_tuning();
+  _retuning = true;
+  _retune_loops = 0;
+  if (cmd->flags.inout())
+    {
+      cmd->flags.crc_error() = 0;
+      cmd->flags.timeout() = 0;
+      cmd->flags.auto_cmd23() = 0;
+      cmd->flags.inout_cmd12() = 0;
+      cmd->flags.retuned() = 1;
+      cmd->reinit_inout_nodata(_tuned_timing == Mmc::Mmc_hs200
+                                 ? Mmc::Cmd21_send_tuning_block
+                                 : Mmc::Cmd19_send_tuning_block, 0);
+    }
+  else
+    cmd->init(_tuned_timing == Mmc::Mmc_hs200
+                ? Mmc::Cmd21_send_tuning_block
+                : Mmc::Cmd19_send_tuning_block);
+  cmd->flags.retune() = 1;
+}
+
+/**
+ * Handle the completion of a tuning block during re-tuning. Tuning blocks are
+ * sent until the controller finished tuning. Afterwards, an inout command
+ * interrupted by a CRC error is repeated or a bus speed switch continues.
+ */
+template <class Driver>
+void
+Device<Driver>::handle_irq_retune(Cmd *cmd)
+{
+  bool success = false;
+  bool finished = true;
+  if (cmd->status == Cmd::Success)
+    finished = _drv.tuning_finished(&success);
+  else if (cmd->status != Cmd::Cmd_timeout)
+    finished = false;
+
+  if (!finished && ++_retune_loops < Mmc::Arg_cmd21_send_tuning_block::Max_loops)
+    {
+      cmd->reinit_inout_nodata(cmd->cmd, 0);
+      cmd_queue_kick();
+      return;
+    }
+
+  _retuning = false;
+  _retune_time = l4_kip_clock(l4re_kip());
+  if (success)
+    {
+      if (_tuned_timing != Mmc::Mmc_hs200)
+        _drv.enable_auto_tuning();
+      l4_uint32_t point = 0;
+      bool has_point = _drv.tuning_point(&point);
+      _tuning_cache.store(tuning_key(_tuned_timing), true, has_point, point);
+      trace.printf("Re-tuning done.\n");
+    }
+  else
+    warn.printf("\033[31mRe-tuning '%s' failed.\033[m\n",
+                Mmc::str_timing(_tuned_timing));
+
+  cmd->flags.retune() = 0;
+  if (cmd->flags.inout())
+    {
+      if (success)
+        {
+          inout_restart(cmd);
+          cmd_queue_kick();
+          return;
+        }
+
+      complete_inout(cmd, -L4_EIO);
+      cmd->work_done();
+      cmd->destruct();
+      cmd_queue_kick();
+      return;
+    }
+
+  if (cmd->flags.speed())
+    {
+      if (success && speed_next(cmd))
+        cmd_queue_kick();
+      else
+        speed_done(cmd, success);
+      return;
+    }
+
+  if (cmd == _swcq_cmd)
+    {
+      // Queue the tasks discarded before re-tuning again.
+      if (swcq_next(cmd) == More_work)
+        {
+          cmd_queue_kick();
+          return;
+        }
+      _swcq_cmd = nullptr;
+    }
+
+  cmd->work_done();
+  cmd->destruct();
+  cqe_resume();
+  cmd_queue_kick();
+}
+
+/**
+ * Repeat the transfer of an inout command. With ADMA2, the whole command is
+ * repeated. With SDMA, the transfer continues with the failed block.
+ */
+template <class Driver>
+void
+Device<Driver>::inout_restart(Cmd *cmd)
+{
+  if (_drv.dma_adma2())
+    set_block_count_adma2(cmd);
+  else
+    transfer_block_sdma(cmd);
+}
+
+/**
+ * Collect the eMMC bus speed modes usable at runtime: The mode selected during
+ * initialization and the slower modes supported by device and host. Modes
+ * which failed during initialization are excluded.
+ */
+template <class Driver>
+void
+Device<Driver>::speed_modes()
+{
+  _speed_modes.clear();
+  if (   _device_type_restricted.hs400_ddr_18()
+      && _device_type_restricted.hs200_sdr_18())
+    _speed_modes.push_back({ Mmc::Mmc_hs400, 0, 0 });
+  if (_device_type_restricted.hs200_sdr_18())
+    _speed_modes.push_back({ Mmc::Mmc_hs200, 0, 0 });
+  if (_device_type_restricted.hs52_ddr_18())
+    _speed_modes.push_back({ Mmc::Mmc_ddr52, 0, 0 });
+  if (_device_type_restricted.hs52())
+    _speed_modes.push_back({ Mmc::Hs, 0, 0 });
+  _speed_idx = 0;
+}
+
+/**
+ * Account a transfer which failed with a CRC error or a timeout (`errors`) to
+ * the current bus speed mode. This includes command queue tasks. Too many
+ * errors within `Speed_window_us` make speed_timer() switch to the next slower
+ * mode.
+ */
+template <class Driver>
+void
+Device<Driver>::speed_error(Cmd::Flags errors)
+{
+  if (_speed_modes.empty())
+    return;
+
+  Speed_mode &m = _speed_modes[_speed_idx];
+  if (errors.crc_error())
+    ++m.crc_errors;
+  else
+    ++m.timeouts;
+  _speed_report = true;
+
+  l4_cpu_time_t now = l4_kip_clock(l4re_kip());
+  _speed_quiet = now;
+  if (now >= _speed_window + Speed_window_us)
     {
-      warn.printf("Exception triggered: %s: %s\n", e.str(), e.extra_str());
+      _speed_window = now;
+      _speed_errors = 0;
     }
+  if (++_speed_errors >= Speed_errors && _speed_idx + 1 < _speed_modes.size())
+    _speed_down = true;
 }
 
+/**
+ * Check periodically if the bus speed mode should change: After too many
+ * transfer errors, switch to the next slower mode. After `_speed_quiet_us`
+ * without errors, probe the next faster mode. If the probed mode fails again,
+ * the quiet time doubles.
+ *
+ * The switch sequence is queued behind pending commands. With command queuing,
+ * the switch waits until the queues are idle.
+ */
 template <class Driver>
 void
-Device<Driver>::handle_irq_inout(Cmd *cmd)
+Device<Driver>::speed_timer()
 {
-  if (!cmd->cb_io)
-    L4Re::throw_error(-L4_EINVAL, "No context for async command");
-
-  Work_status work;
-  if (cmd->flags.inout_cmd12() && !_drv.auto_cmd12())
+  l4_cpu_time_t now = l4_kip_clock(l4re_kip());
+  if (_speed_probed && now >= _speed_quiet + _speed_quiet_us)
     {
-      // Send CMD12 if not done automatically by the controller.
-      cmd->flags.inout_cmd12() = 0;
-      cmd->status_cmd12 = cmd->status; // remember the transfer status
-      cmd->reinit_inout_nodata(cmd->flags.inout_read()
-                                 ? Mmc::Cmd12_stop_transmission_rd
-                                 : Mmc::Cmd12_stop_transmission_wr, 0);
-      work = More_work;
+      // The probed mode proved stable.
+      _speed_probed = false;
+      _speed_quiet_us = Speed_quiet_us;
     }
-  else
+
+  if (   !_speed_switching && !_retuning && !_hw_part_switching
+      && _hw_part_pending.empty()
+      && (!(_cqe_active || _swcq_active) || queues_idle()))
     {
-      if (   cmd->cmd == Mmc::Cmd12_stop_transmission_rd
-          || cmd->cmd == Mmc::Cmd12_stop_transmission_wr)
-        cmd->status = cmd->status_cmd12; // restore the transfer status
-      if (cmd->error())
-        {
-          l4_uint64_t transferred = bytes_transferred(cmd);
-          info.printf("\033[31mInout error (%s): %lld bytes transferred.\033[m\n",
-                      cmd->str_error(), transferred);
-          cmd->cb_io(-L4_EIO, transferred);
-          work = Work_done;
-        }
-      else
+      if (_speed_down)
         {
-          if (_drv.dma_adma2())
-            work = handle_irq_inout_adma2(cmd);
-          else
-            work = handle_irq_inout_sdma(cmd);
+          if (_speed_probed)
+            _speed_quiet_us = cxx::min<l4_uint64_t>(_speed_quiet_us * 2,
+                                                    Speed_quiet_max_us);
+          speed_switch(_speed_idx + 1);
         }
+      else if (_speed_idx && now >= _speed_quiet + _speed_quiet_us)
+        speed_switch(_speed_idx - 1);
     }
 
-  if (work == Work_done)
-    {
-      cmd->work_done();
-      cmd->destruct();
-    }
-
-  cmd_queue_kick();
+  Errand::schedule([this] { speed_timer(); }, Speed_check_us);
 }
 
+/**
+ * Return the steps for switching to `timing` from any other mode. HS200 and
+ * HS400 are left via High Speed timing, see eMMC spec 6.6.2.3. The steps for
+ * entering a mode are the same as in power_up_mmc().
+ */
 template <class Driver>
-typename Device<Driver>::Work_status
-Device<Driver>::handle_irq_inout_sdma(Cmd *cmd)
+std::vector<typename Device<Driver>::Speed_step>
+Device<Driver>::speed_steps(Mmc::Timing timing) const
 {
-  if (cmd->status == Cmd::Success)
+  using Ht = Mmc::Reg_ecsd::Ec185_hs_timing;
+  using Bw = Mmc::Reg_ecsd::Ec183_bus_width;
+
+  std::vector<Speed_step> steps;
+  auto hs_timing = [&steps](Ht::Timing t)
     {
-      // Read/Write command finished successfully, go to next block.
-      if (cmd->cmd != Mmc::Cmd23_set_block_count)
+      Ht ht(0);
+      ht.timing_interface() = t;
+      steps.push_back({ Speed_step::Switch, Mmc::Reg_ecsd::Reg185_hs_timing,
+                        ht.raw, 0, Mmc::Legacy, false });
+    };
+  auto bus_width = [&steps](Bw::Width w, bool strobe)
+    {
+      Bw bw(0);
+      bw.bus_mode_select() = w;
+      bw.enhanced_strobe() = strobe;
+      steps.push_back({ Speed_step::Switch, Mmc::Reg_ecsd::Reg183_bus_width,
+                        bw.raw, 0, Mmc::Legacy, false });
+    };
+  auto clock = [&steps](l4_uint32_t freq, Mmc::Timing t, bool strobe)
+    { steps.push_back({ Speed_step::Clock, 0, 0, freq, t, strobe }); };
+  auto tune = [&steps]()
+    { steps.push_back({ Speed_step::Tune, 0, 0, 0, Mmc::Mmc_hs200, false }); };
+
+  hs_timing(Ht::Hs);
+  clock(52 * MHz, Mmc::Hs, false);
+  switch (timing)
+    {
+    case Mmc::Mmc_hs400:
+      if (!_enh_strobe)
         {
-          auto const *b = cmd->blocks;
-          cmd->sector += b->num_sectors;
-          cmd->sectors_done += b->num_sectors;
-          do
-            {
-              b = b->next.get();
-            }
-          while (b && b->num_sectors == 0);
-          cmd->blocks = b;
+          bus_width(Bw::W_8bit_sdr, false);
+          hs_timing(Ht::Hs200);
+          clock(200 * MHz, Mmc::Mmc_hs200, false);
+          tune();
+          hs_timing(Ht::Hs);
+          clock(52 * MHz, Mmc::Hs, false);
         }
+      bus_width(Bw::W_8bit_ddr, _enh_strobe);
+      hs_timing(Ht::Hs400);
+      clock(200 * MHz, Mmc::Mmc_hs400, _enh_strobe);
+      break;
+    case Mmc::Mmc_hs200:
+      bus_width(Bw::W_8bit_sdr, false);
+      hs_timing(Ht::Hs200);
+      clock(200 * MHz, Mmc::Mmc_hs200, false);
+      tune();
+      break;
+    case Mmc::Mmc_ddr52:
+      bus_width(Bw::W_8bit_ddr, false);
+      clock(52 * MHz, Mmc::Mmc_ddr52, false);
+      break;
+    default:
+      bus_width(Bw::W_8bit_sdr, false);
+      break;
     }
+  return steps;
+}
 
-  return transfer_block_sdma(cmd);
+/**
+ * Queue the command sequence for switching to the bus speed mode `target`, see
+ * handle_irq_speed().
+ */
+template <class Driver>
+void
+Device<Driver>::speed_switch(unsigned target)
+{
+  Cmd *cmd = _drv.cmd_create();
+  if (!cmd)
+    return;
+
+  info.printf("Switch bus speed '%s' -> '%s'.\n",
+              Mmc::str_timing(_speed_modes[_speed_idx].timing),
+              Mmc::str_timing(_speed_modes[target].timing));
+
+  cqe_suspend(cmd);
+  _speed_target = target;
+  _speed_steps = speed_steps(_speed_modes[target].timing);
+  _speed_step = 0;
+  _speed_switching = true;
+  _speed_down = false;
+  speed_next(cmd);
+  cmd_queue_kick();
 }
 
+/**
+ * Turn `cmd` into the next step of the bus speed switch.
+ *
+ * \retval false  No steps left.
+ */
 template <class Driver>
-typename Device<Driver>::Work_status
-Device<Driver>::transfer_block_sdma(Cmd *cmd)
+bool
+Device<Driver>::speed_next(Cmd *cmd)
 {
-  auto const *b = cmd->blocks;
-  if (!b)
+  if (_speed_step == _speed_steps.size())
+    return false;
+
+  Speed_step const &s = _speed_steps[_speed_step++];
+  switch (s.op)
     {
-      cmd->cb_io(L4_EOK, bytes_transferred(cmd));
-      return Work_done;
+    case Speed_step::Switch:
+      init_mmc_switch(cmd, s.idx, s.val);
+      cmd->flags.speed() = 1;
+      break;
+    case Speed_step::Clock:
+      // Any tuning result is invalid with the new clock.
+      _tuned_timing = Mmc::Legacy;
+      _drv.set_clock_and_timing(s.freq, s.timing, s.strobe);
+      cmd->flags.speed() = 1;
+      prg_start(cmd, _switch_timeout_us);
+      break;
+    case Speed_step::Tune:
+      _tuned_timing = s.timing;
+      retune_start(cmd);
+      cmd->flags.speed() = 1;
+      break;
     }
+  return true;
+}
 
-  if (b->num_sectors == 1)
+/**
+ * Handle the completion of a command of the bus speed switch. After switching
+ * HS_TIMING, the host changes the timing before reading the device status
+ * (eMMC spec 6.6.2.2). After other switches, the device status is polled until
+ * the device finished programming.
+ */
+template <class Driver>
+void
+Device<Driver>::handle_irq_speed(Cmd *cmd)
+{
+  if (cmd->error() || cmd->switch_error())
     {
-      cmd->reinit_inout_data(cmd->flags.inout_read()
-                               ? Mmc::Cmd17_read_single_block
-                               : Mmc::Cmd24_write_block,
-                             cmd->sector * _addr_mult, 1, 512,
-                             Cmd::Flag_auto_cmd23::No_auto_cmd23);
+      warn.printf("\033[31mBus speed switch: %s failed (%s).\033[m\n",
+                  cmd->cmd_to_str().c_str(), cmd->str_status().c_str());
+      speed_done(cmd, false);
+      return;
     }
-  else if (_has_cmd23 && cmd->cmd != Mmc::Cmd23_set_block_count)
+
+  if (cmd->cmd == Mmc::Cmd6_switch)
     {
-      // Previous command was either transfer command or CMD12.
-      Mmc::Arg_cmd23_set_block_count a23;
-      a23.blocks() = b->num_sectors;
-      cmd->reinit_inout_nodata(Mmc::Cmd23_set_block_count, a23.raw);
+      if (_speed_steps[_speed_step - 1].idx != Mmc::Reg_ecsd::Reg185_hs_timing)
+        {
+          prg_start(cmd, _switch_timeout_us);
+          return;
+        }
     }
-  else
+  else if (!prg_done(cmd))
     {
-      cmd->reinit_inout_data(cmd->flags.inout_read()
-                               ? Mmc::Cmd18_read_multiple_block
-                               : Mmc::Cmd25_write_multiple_block,
-                             cmd->sector * _addr_mult, b->num_sectors, 512,
-                             Cmd::Flag_auto_cmd23::No_auto_cmd23);
-      if (!_has_cmd23)
-        cmd->flags.inout_cmd12() = 1;
+      if (prg_poll(cmd))
+        return;
+      warn.printf("\033[31mBus speed switch: timeout.\033[m\n");
+      speed_done(cmd, false);
+      return;
     }
 
-  return More_work;
+  if (speed_next(cmd))
+    cmd_queue_kick();
+  else
+    speed_done(cmd, true);
 }
 
+/**
+ * Finish the bus speed switch. If the switch failed, the bus is in an unknown
+ * state: Switch back after a failed upgrade, otherwise try the next slower
+ * mode.
+ */
 template <class Driver>
 void
-Device<Driver>::set_block_count_adma2(Cmd *cmd)
+Device<Driver>::speed_done(Cmd *cmd, bool success)
 {
-  l4_uint32_t num_sectors = 0;
-  for (auto const *b = cmd->blocks; b; b = b->next.get())
-    num_sectors += b->num_sectors;
-
-  trace2.printf("set_block_count_adma2: sector=%u num_sectors=%u\n",
-                cmd->sector, num_sectors);
-
-  if (!_has_cmd23 || _drv.auto_cmd23())
+  cmd->work_done();
+  cmd->destruct();
+  _speed_switching = false;
+
+  l4_cpu_time_t now = l4_kip_clock(l4re_kip());
+  unsigned from = _speed_idx;
+  _speed_history.push_back({ now, _speed_modes[from].timing,
+                             _speed_modes[_speed_target].timing,
+                             _speed_errors, success });
+  if (_speed_history.size() > Speed_history)
+    _speed_history.pop_front();
+  _speed_report = true;
+  _speed_quiet = now;
+  _speed_window = now;
+  _speed_errors = 0;
+
+  if (success)
     {
-      cmd->reinit_inout_data(cmd->flags.inout_read()
-                               ? Mmc::Cmd18_read_multiple_block
-                               : Mmc::Cmd25_write_multiple_block,
-                             cmd->sector * _addr_mult, num_sectors, 512,
-                             _has_cmd23 && _drv.auto_cmd23()
-                               ? Cmd::Flag_auto_cmd23::Do_auto_cmd23
-                               : Cmd::Flag_auto_cmd23::No_auto_cmd23);
-      if (!_has_cmd23)
-        cmd->flags.inout_cmd12() = 1;
+      _speed_idx = _speed_target;
+      _speed_probed = _speed_target < from;
+      info.printf("Bus speed '%s'.\n",
+                  Mmc::str_timing(_speed_modes[_speed_idx].timing));
     }
   else
     {
-      Mmc::Arg_cmd23_set_block_count a23;
-      a23.blocks() = num_sectors;
-      cmd->blockcnt = num_sectors;
-      cmd->reinit_inout_nodata(Mmc::Cmd23_set_block_count, a23.raw);
+      _tuned_timing = Mmc::Legacy;
+      // The bus state is unknown, continue from the failed mode.
+      unsigned next = _speed_target < from ? from : _speed_target + 1;
+      if (next < _speed_modes.size())
+        {
+          if (_speed_target < from)
+            _speed_quiet_us = cxx::min<l4_uint64_t>(_speed_quiet_us * 2,
+                                                    Speed_quiet_max_us);
+          _speed_idx = _speed_target;
+          speed_switch(next);
+        }
+      else
+        warn.printf("\033[31;1mNo usable bus speed mode left.\033[m\n");
     }
+
+  cqe_resume();
+  cmd_queue_kick();
 }
 
+/** Show errors per bus speed mode and the recent bus speed changes. */
 template <class Driver>
-typename Device<Driver>::Work_status
-Device<Driver>::handle_irq_inout_adma2(Cmd *cmd)
+void
+Device<Driver>::speed_statistics(l4_cpu_time_t now)
 {
-  // This function is only called once or twice:
-  //  1. With Auto CMD23, this function is called once to finish the transfer.
-  //  2. Without Auto CMD23, the previous command didn't transfer data (hence
-  //     was CMD23), so now send the actual transfer command.
-  // In the latter case, mark inout_cmd12 in case CMD23 isn't available.
-  if (cmd->cmd != Mmc::Cmd23_set_block_count)
-    {
-      // Previous command was either transfer command or CMD12.
-      cmd->cb_io(L4_EOK, bytes_transferred(cmd));
-      return Work_done;
-    }
-  else
-    {
-      cmd->reinit_inout_data(cmd->flags.inout_read()
-                             ? Mmc::Cmd18_read_multiple_block
-                             : Mmc::Cmd25_write_multiple_block,
-                             cmd->sector * _addr_mult, cmd->blockcnt, 512,
-                             Cmd::Flag_auto_cmd23::No_auto_cmd23);
-      if (!_has_cmd23)
-        cmd->flags.inout_cmd12() = 1;
-      return More_work;
-    }
+  _speed_report = false;
+  for (unsigned i = 0; i < _speed_modes.size(); ++i)
+    info.printf("Bus speed '%s'%s: %u CRC errors, %u timeouts\n",
+                Mmc::str_timing(_speed_modes[i].timing),
+                i == _speed_idx ? " (current)" : "",
+                _speed_modes[i].crc_errors, _speed_modes[i].timeouts);
+  for (auto const &c : _speed_history)
+    info.printf("  %llus ago: '%s' -> '%s' after %u errors%s\n",
+                (now - c.time) / 1000000, Mmc::str_timing(c.from),
+                Mmc::str_timing(c.to), c.errors, c.success ? "" : " (failed)");
 }
 
+/**
+ * Verify the sampling point by reading a single data block: EXT_CSD for eMMC,
+ * the switch function status for SD. A tuning block cannot be used because
+ * sending it starts tuning on the controller. For SD, the status is read
+ * behind the switch function status still used by power_up_sd().
+ */
 template <class Driver>
-void
-Device<Driver>::unmask_interrupt() const
+bool
+Device<Driver>::tuning_verify(Cmd *cmd, Mmc::Timing timing)
 {
-  if (_irq_unmask_at_icu)
-    _icu->unmask(_irq_num);
+  if (timing == Mmc::Mmc_hs200)
+    cmd->init_data(Mmc::Cmd8_send_ext_csd, 0, 512, _io_buf.pget(), 0);
   else
-    L4::Irqep_t<Device<Driver>>::obj_cap()->unmask();
+    {
+      Mmc::Arg_cmd6_switch_func a6;
+      cmd->init_data(Mmc::Cmd6_switch_func, a6.raw, 64, _io_buf.pget(256),
+                     reinterpret_cast<l4_addr_t>(_io_buf.get<void>(256)));
+    }
+  cmd_exec(cmd);
+  return !cmd->error();
 }
 
 template <class Driver>
@@ -1037,6 +3911,7 @@ Device<Driver>::power_up_sd(Cmd *cmd)
   cmd->check_error("CMD2: ALL_SEND_CID");
 
   Mmc::Reg_cid cid(cmd->resp);
+  memcpy(_cid, cid.raw, sizeof(_cid));
   // Also with NDEBUG: The PSN is important because it can be used to address
   //                   the device.
   printf("product: '%s', manufactured %d/%d, mid=%02x, psn=%08x\n",
@@ -1252,21 +4127,7 @@ Device<Driver>::power_up_sd(Cmd *cmd)
         {
           info.printf("Mode '%s' needs tuning...\n", Mmc::str_timing(mmc_timing));
           _drv.reset_tuning();
-          bool success = false;
-          unsigned i;
-          for (i = 0; i < Mmc::Arg_cmd19_send_tuning_block::Max_loops; ++i)
-            {
-              cmd->init(Mmc::Cmd19_send_tuning_block);
-              cmd_exec(cmd);
-              if (cmd->status == Cmd::Success)
-                {
-                  if (_drv.tuning_finished(&success))
-                    break;
-                }
-              else if (cmd->status == Cmd::Cmd_timeout)
-                break;
-            }
-          if (!success)
+          if (!tune(cmd, mmc_timing))
             {
               _device_type_disable.sd |= mmc_timing;
               info.printf("\033[31mTuning for mode '%s' failed!\033[m\n",
@@ -1277,6 +4138,7 @@ Device<Driver>::power_up_sd(Cmd *cmd)
             }
 
           _drv.enable_auto_tuning();
+          _tuned_timing = mmc_timing;
           info.printf("Tuning success.\n");
         }
 
@@ -1358,6 +4220,7 @@ Device<Driver>::power_up_mmc(Cmd *cmd)
   cmd->check_error("CMD2: ALL_SEND_CID");
 
   Mmc::Reg_cid cid(cmd->resp);
+  memcpy(_cid, cid.raw, sizeof(_cid));
   // Also with NDEBUG: The PSN is important because it can be used to address
   //                   the device.
   printf("product: '%s', manufactured %d/%d, mid = %02x, psn = %08x\n",
@@ -1434,6 +4297,29 @@ Device<Driver>::power_up_mmc(Cmd *cmd)
               Util::readable_size(_size_rpmb).c_str(),
               _ecsd.ec179_partition_config.str_partition_access());
 
+  // A boot loader might have left another hardware partition selected.
+  _part_config = _ecsd.ec179_partition_config;
+  if (_part_config.partition_access())
+    {
+      _part_config.partition_access() = 0;
+      exec_mmc_switch(cmd, _part_config.index(), _part_config.raw);
+      cmd->check_error("CMD6: SWITCH/PARTITION_CONFIG");
+    }
+  // PARTITION_SWITCH_TIME in units of 10ms.
+  _part_switch_timeout_us
+    = cxx::max<l4_uint32_t>(_ecsd.ec199_partition_switch_time, 1) * 10000;
+  _hw_part_sectors[1] = _hw_part_sectors[2] = _size_boot12 >> 9;
+  if (   (_ecsd.ec160_partition_support & 1)
+      && (_ecsd.ec155_partition_setting_completed & 1))
+    for (unsigned i = 0; i < 4; ++i)
+      {
+        l4_uint8_t const *m = &_ecsd.ec143_gp_size_mult[i * 3];
+        l4_uint64_t mult = m[0] | (m[1] << 8) | (l4_uint32_t{m[2]} << 16);
+        // GP_SIZE_MULT * HC_WP_GRP_SIZE * HC_ERASE_GRP_SIZE * 512 KiB.
+        _hw_part_sectors[4 + i] = mult * _ecsd.ec221_hc_wp_grp_size
+                                  * _ecsd.ec224_hc_erase_grp_size * 1024;
+      }
+
   _device_type_restricted = _ecsd.ec196_device_type;
   _enh_strobe = _ecsd.ec184_strobe_support;
 
@@ -1462,6 +4348,66 @@ Device<Driver>::power_up_mmc(Cmd *cmd)
   exec_mmc_switch(cmd, eg.index(), eg.raw);
   cmd->check_error("CMD6: SWITCH/ERASE_GROUP_DEF");
 
+  // With ERASE_GROUP_DEF enabled, the erase group size and the erase timeout
+  // are defined by EXT_CSD.
+  if (_ecsd.ec224_hc_erase_grp_size)
+    {
+      _erase_grp_sectors = l4_uint32_t{_ecsd.ec224_hc_erase_grp_size} << 10;
+      _erase_timeout_ms
+        = 300 * cxx::max<l4_uint32_t>(_ecsd.ec223_erase_timeout_mult, 1);
+      _trim_timeout_ms
+        = 300 * cxx::max<l4_uint32_t>(_ecsd.ec232_trim_mult, 1);
+      _discard_unit_sectors = _erase_grp_sectors;
+      if (_mmc_rev >= 451)
+        _discard_type = Mmc::Arg_cmd38_erase::Discard;
+      else if (_ecsd.ec231_sec_feature_support.sec_gb_cl_en())
+        _discard_type = Mmc::Arg_cmd38_erase::Trim;
+      if (_discard_type != Mmc::Arg_cmd38_erase::Erase)
+        {
+          // Unit in multiples of 4 KiB.
+          if (unsigned u = _ecsd.ec264_optimal_trim_unit_size)
+            _discard_unit_sectors = 8U << cxx::min(u - 1, 16U);
+          else
+            _discard_unit_sectors = 1;
+        }
+      // Use TRIM or ERASE for write zeroes if erased memory reads as zero.
+      if (_ecsd.ec181_erased_mem_cont == 0)
+        {
+          _erase_zeroes = true;
+          if (_ecsd.ec231_sec_feature_support.sec_gb_cl_en())
+            _zeroes_type = Mmc::Arg_cmd38_erase::Trim;
+          else
+            {
+              _zero_buf = cxx::make_ref_obj<Inout_buffer>(
+                            nullptr, Zero_sectors * Sector_size, _dma,
+                            L4Re::Dma_space::Direction::To_device);
+              if (!_drv.dma_accessible(_zero_buf->pget(), _zero_buf->size()))
+                _erase_zeroes = false;
+              memset(_zero_buf->get<void>(), 0, _zero_buf->size());
+            }
+        }
+      info.printf("Erase group %s, discard using %s, alignment %s.\n",
+                  Util::readable_size(l4_uint64_t{_erase_grp_sectors} << 9).c_str(),
+                  _discard_type == Mmc::Arg_cmd38_erase::Discard ? "DISCARD"
+                  : _discard_type == Mmc::Arg_cmd38_erase::Trim ? "TRIM" : "ERASE",
+                  Util::readable_size(l4_uint64_t{_discard_unit_sectors} << 9).c_str());
+    }
+
+  // Packed reads require a separate header transfer, only pack writes.
+  if (_mmc_rev >= 451 && _has_cmd23 && _drv.dma_adma2()
+      && _ecsd.ec500_max_packed_writes)
+    {
+      _packed_hdrs = cxx::make_ref_obj<Inout_buffer>(
+                       nullptr, Cmd_queue::Entries * Sector_size, _dma,
+                       L4Re::Dma_space::Direction::To_device);
+      if (_drv.dma_accessible(_packed_hdrs->pget(), _packed_hdrs->size()))
+        _max_packed_wr = cxx::min<unsigned>(_ecsd.ec500_max_packed_writes,
+                                            Cmd::Max_merged + 1);
+      info.printf("Packed commands: writes %u (using %u), reads %u.\n",
+                  _ecsd.ec500_max_packed_writes, _max_packed_wr,
+                  _ecsd.ec501_max_packet_reads);
+    }
+
   cmd->init_arg(Mmc::Cmd16_set_blocklen, sector_size());
   cmd_exec(cmd);
   cmd->check_error("CMD16: SET_BLOCK_LENGTH");
@@ -1471,10 +4417,21 @@ Device<Driver>::power_up_mmc(Cmd *cmd)
   exec_mmc_switch(cmd, pon.index(), pon.raw);
   cmd->check_error("CMD6: SWITCH/POWER_OFF_NOTIFICATION");
 
+  // HPI allows interrupting long-running operations for pending reads.
   Mmc::Reg_ecsd::Ec161_hpi_mgmt hm(0);
-  hm.hpi_en() = 0;
+  hm.hpi_en() = _ecsd.ec503_hpi_features.hpi_supported();
   exec_mmc_switch(cmd, hm.index(), hm.raw);
   cmd->check_error("CMD6: SWITCH/HPI_MGMT");
+  _hpi = hm.hpi_en();
+  if (_hpi)
+    {
+      _hpi_cmd12 = _ecsd.ec503_hpi_features.hpi_implementation();
+      // OUT_OF_INTERRUPT_TIME in units of 10ms.
+      _hpi_timeout_us
+        = cxx::max<l4_uint32_t>(_ecsd.ec198_out_of_interrupt_time, 1) * 10000;
+      info.printf("HPI using %s, timeout %ums.\n",
+                  _hpi_cmd12 ? "CMD12" : "CMD13", _hpi_timeout_us / 1000);
+    }
 
   // Prevent gcc from generating an unaligned 32-bit access to uncached memory!
   l4_uint64_t cache_size_kb
@@ -1491,12 +4448,40 @@ Device<Driver>::power_up_mmc(Cmd *cmd)
       cc.cache_en() = 1;
       exec_mmc_switch(cmd, cc.index(), cc.raw);
       cmd->check_error("CMD6: SWITCH/ENABLE_CACHE");
+
+      // Enhanced reliable writes are not limited to REL_WR_SEC_C sectors.
+      _rel_write = _has_cmd23 && _ecsd.ec166_wr_rel_param.en_rel_wr();
+      info.printf("Forced unit access using %s.\n",
+                  _rel_write ? "reliable write" : "cache flush");
+
+      _cache_fifo = _ecsd.ec240_cache_flush_policy.fifo();
+      if (!_cache_fifo && _ecsd.ec486_barrier_support.barrier())
+        {
+          Mmc::Reg_ecsd::Ec31_barrier_ctrl bc(0);
+          bc.barrier_en() = 1;
+          exec_mmc_switch(cmd, bc.index(), bc.raw);
+          _cache_barrier = !cmd->error() && !cmd->switch_error();
+        }
+      info.printf("Ordering flushes: %s.\n",
+                  _cache_fifo ? "not required (FIFO cache flushing)"
+                  : _cache_barrier ? "cache barrier" : "cache flush");
     }
 
-  Mmc::Reg_ecsd::Ec163_bkops_en bko(0);
-  bko.auto_en() = 1;
-  exec_mmc_switch(cmd, bko.index(), bko.raw);
-  cmd->check_error("CMD6: SWITCH/BKOPS");
+  // Background operations are started by the host in idle periods if
+  // MANUAL_EN is set. This requires HPI to interrupt BKOPS on new requests.
+  // MANUAL_EN is one-time programmable and therefore never set by the driver.
+  // Otherwise the device decides when to start BKOPS (AUTO_EN).
+  _bkops = _ecsd.ec502_bkops_support.supported() && _hpi
+           && _ecsd.ec163_bkops_en.manual_en();
+  if (!_bkops)
+    {
+      Mmc::Reg_ecsd::Ec163_bkops_en bko(0);
+      bko.auto_en() = 1;
+      exec_mmc_switch(cmd, bko.index(), bko.raw);
+      cmd->check_error("CMD6: SWITCH/BKOPS");
+    }
+  info.printf("Background operations: %s.\n",
+              _bkops ? "host-scheduled in idle periods" : "automatic");
 
   // We don't try to set any 1.2V mode, see below
   _device_type_restricted.disable_12();
@@ -1566,25 +4551,8 @@ Device<Driver>::power_up_mmc(Cmd *cmd)
           if (cmd->error())
             continue;
 
-          if (device_type_test.hs200_sdr_18())
-            {
-              bool success = false;
-              unsigned i;
-              for (i = 0; i < Mmc::Arg_cmd21_send_tuning_block::Max_loops; ++i)
-                {
-                  cmd->init(Mmc::Cmd21_send_tuning_block);
-                  cmd_exec(cmd);
-                  if (cmd->status == Cmd::Success)
-                    {
-                      if (_drv.tuning_finished(&success))
-                        break;
-                    }
-                  else if (cmd->status == Cmd::Cmd_timeout)
-                    break;
-                }
-              if (!success)
-                continue;
-            }
+          if (device_type_test.hs200_sdr_18() && !tune(cmd, mmc_timing))
+            continue;
         }
 
       if (_device_type_restricted.hs400_ddr_18())
@@ -1609,9 +4577,18 @@ Device<Driver>::power_up_mmc(Cmd *cmd)
         }
 
       _device_type_selected = device_type_test;
+      if (_device_type_selected.hs200_sdr_18())
+        _tuned_timing = Mmc::Mmc_hs200;
       break;
     }
 
+  // GENERIC_CMD6_TIME in units of 10ms.
+  _switch_timeout_us
+    = cxx::max<l4_uint32_t>(_ecsd.ec248_generic_cmd6_time, 1) * 10000;
+  speed_modes();
+
+  enable_cmdq(cmd);
+
   warn.printf("Device initialization took %llu ms (%llu ms busy wait, %llu ms sleep).\n",
               Util::tsc_to_ms(Util::read_tsc() - _init_time),
               Util::tsc_to_ms(_drv.time_busy()),
@@ -1630,10 +4607,57 @@ Device<Driver>::power_up_mmc(Cmd *cmd)
   return true;
 }
 
+/**
+ * Enable command queuing if supported by the device.
+ *
+ * The command queue engine (CQE) of the controller fetches tasks from a task
+ * descriptor list, queues them on the device (CMD44/CMD45) and executes them
+ * in the order chosen by the device (CMD46/CMD47). Without CQE, the driver
+ * issues these commands itself (software command queuing).
+ */
+template <class Driver>
+void
+Device<Driver>::enable_cmdq(Cmd *cmd)
+{
+  if (!_ecsd.ec308_cmdq_support.cmdq_support())
+    return;
+
+  // The CQE has many transfers in flight but there is only one bounce buffer.
+  // Software command queuing performs one transfer at a time.
+  bool use_cqe = _drv.cqe_available() && !_drv.provided_bounce_buffer();
+  if (!use_cqe && !_drv.dma_adma2())
+    {
+      // A task is transferred using a single CMD46/CMD47.
+      info.printf("Command queuing requires ADMA2.\n");
+      return;
+    }
+
+  unsigned depth = (_ecsd.ec307_cmdq_depth & 0x1f) + 1;
+
+  Mmc::Reg_ecsd::Ec15_cmdq_mode_en qm(0);
+  qm.enable() = 1;
+  exec_mmc_switch(cmd, qm.index(), qm.raw);
+  if (cmd->error() || cmd->switch_error())
+    {
+      warn.printf("Enable command queuing failed (%s).\n",
+                  cmd->str_status().c_str());
+      return;
+    }
+
+  _cmdq_tasks.set_depth(depth);
+  if (use_cqe)
+    {
+      _drv.cqe_enable(_cmdq_tasks.depth(), _rca);
+      _cqe_active = true;
+      cqe_adapt_coalescing();
+    }
+  else
+    _swcq_active = true;
+}
+
 template <class Driver>
 void
-Device<Driver>::exec_mmc_switch(Cmd *cmd, l4_uint8_t idx, l4_uint8_t val,
-                                bool with_status)
+Device<Driver>::init_mmc_switch(Cmd *cmd, l4_uint8_t idx, l4_uint8_t val)
 {
   Mmc::Arg_cmd6_switch a6;
   a6.access() = Mmc::Arg_cmd6_switch::Write_byte;
@@ -1641,6 +4665,14 @@ Device<Driver>::exec_mmc_switch(Cmd *cmd, l4_uint8_t idx, l4_uint8_t val,
   a6.value() = val;
   a6.cmdset() = 0;
   cmd->init_arg(Mmc::Cmd6_switch, a6.raw);
+}
+
+template <class Driver>
+void
+Device<Driver>::exec_mmc_switch(Cmd *cmd, l4_uint8_t idx, l4_uint8_t val,
+                                bool with_status)
+{
+  init_mmc_switch(cmd, idx, val);
   if (with_status)
     cmd->flags.status_after_switch() = 1;
   cmd_exec(cmd);
@@ -17,8 +17,11 @@
 
 #pragma once
 
+#include <deque>
 #include <string>
 #include <map>
+#include <memory>
+#include <vector>
 #include <thread-l4>
 
 #include <l4/cxx/string>
@@ -31,6 +34,9 @@
 #include "drv_sdhi.h"
 #include "iomem.h"
 #include "inout_buffer.h"
+#include "queue.h"
+#include "sched.h"
+#include "tuning_cache.h"
 
 namespace Errand = Block_device::Errand;
 
@@ -50,7 +56,17 @@ public:
   void set_dma_map_all(bool enable)
   { _dma_map_all = enable; }
 
+  /** Complete writes only after the data is stored persistently. */
+  void set_fua(bool enable)
+  { _fua = enable; }
+
+  /** Flush requests only order writes, data need not be stored persistently. */
+  void set_flush_ordering(bool enable)
+  { _flush_ordering = enable; }
+
   bool _dma_map_all = false;
+  bool _fua = false;
+  bool _flush_ordering = false;
 };
 
 class Base_parent_device: public Base_device
@@ -69,6 +85,43 @@ public:
 
   virtual int dma_unmap_single(L4Re::Dma_space::Dma_addr, l4_size_t,
                                L4Re::Dma_space::Direction) = 0;
+
+  /**
+   * Inout request for a hardware partition (PARTITION_ACCESS value). With
+   * `fua`, a write completes only after the data is stored persistently.
+   */
+  virtual int inout_data_part(unsigned, l4_uint64_t,
+                              Block_device::Inout_block const &,
+                              Block_device::Inout_callback const &,
+                              L4Re::Dma_space::Direction, bool)
+  { return -L4_ENODEV; }
+
+  /**
+   * Inout request passed on by a partition. With `fua`, a write completes
+   * only after the data is stored persistently.
+   */
+  virtual int part_inout_data(l4_uint64_t sector,
+                              Block_device::Inout_block const &blocks,
+                              Block_device::Inout_callback const &cb,
+                              L4Re::Dma_space::Direction dir, bool fua) = 0;
+
+  /**
+   * Flush request passed on by a partition. With `ordering`, the flush is only
+   * required for ordering the writes.
+   */
+  virtual int part_flush(Block_device::Inout_callback const &cb,
+                         bool ordering) = 0;
+
+  /** Discard request for a hardware partition (PARTITION_ACCESS value). */
+  virtual int discard_part(unsigned, l4_uint64_t,
+                           Block_device::Inout_block const &,
+                           Block_device::Inout_callback const &,
+                           bool)
+  { return -L4_ENODEV; }
+
+  /** Create the devices for the boot and general purpose partitions. */
+  virtual std::vector<cxx::Ref_ptr<Base_device>> hw_part_devices()
+  { return {}; }
 };
 
 using Base_part_device = Block_device::Partitioned_device<Emmc::Base_device>;
@@ -76,7 +129,79 @@ using Base_part_device = Block_device::Partitioned_device<Emmc::Base_device>;
 class Part_device : public Base_part_device
 {
 public:
-  using Base_part_device::Base_part_device;
+  template <typename DEV, typename PART_INFO>
+  Part_device(DEV const &dev, unsigned partition_id, PART_INFO const &pi)
+  : Base_part_device(dev, partition_id, pi), _start(pi.first)
+  {}
+
+  /**
+   * Writes are passed to the parent device directly to forward the forced
+   * unit access setting of this partition. Writes with forced unit access are
+   * stored persistently when they complete and don't require a flush.
+   */
+  int inout_data(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+                 Block_device::Inout_callback const &cb,
+                 L4Re::Dma_space::Direction dir) override
+  {
+    if (dir == L4Re::Dma_space::Direction::From_device)
+      return Base_part_device::inout_data(sector, blocks, cb, dir);
+
+    l4_uint64_t num_sectors = 0;
+    for (auto const *b = &blocks; b; b = b->next.get())
+      num_sectors += b->num_sectors;
+    if (sector + num_sectors > capacity() / sector_size())
+      return -L4_EINVAL;
+
+    bool fua = _fua;
+    auto *p = static_cast<Base_parent_device *>(parent());
+    return p->part_inout_data(_start + sector, blocks,
+      [this, cb, fua](int error, l4_size_t size)
+        {
+          if (!fua)
+            _cache_dirty = true;
+          cb(error, size);
+        }, dir, fua);
+  }
+
+  int discard(l4_uint64_t offset, Block_device::Inout_block const &block,
+              Block_device::Inout_callback const &cb, bool discard) override
+  {
+    if (discard)
+      return Base_part_device::discard(offset, block, cb, discard);
+
+    // Write zeroes might write unaligned fragments.
+    return Base_part_device::discard(offset, block,
+      [this, cb](int error, l4_size_t size)
+        {
+          _cache_dirty = true;
+          cb(error, size);
+        }, discard);
+  }
+
+  /**
+   * Flush the device cache only if this partition was written since the last
+   * flush of this partition was issued.
+   */
+  int flush(Block_device::Inout_callback const &cb) override
+  {
+    if (!_cache_dirty)
+      {
+        cb(L4_EOK, 0);
+        return L4_EOK;
+      }
+
+    _cache_dirty = false;
+    auto *p = static_cast<Base_parent_device *>(parent());
+    int ret = p->part_flush([this, cb](int error, l4_size_t size)
+      {
+        if (error)
+          _cache_dirty = true;
+        cb(error, size);
+      }, _flush_ordering);
+    if (ret < 0)
+      _cache_dirty = true;
+    return ret;
+  }
 
 private:
   int dma_map(Block_device::Mem_region *region, l4_addr_t offset,
@@ -101,6 +226,128 @@ private:
       return static_cast<Base_parent_device *>(parent())->dma_unmap_single(
         phys, num_sectors, dir);
   }
+
+  l4_uint64_t _start;        ///< first sector on the parent device
+  bool _cache_dirty = false; ///< writes completed since last flush
+};
+
+/**
+ * Boot or general purpose hardware partition of an eMMC device.
+ *
+ * Requests are passed to the parent device which selects the hardware
+ * partition before executing them.
+ */
+class Hw_part_device : public Base_parent_device
+{
+public:
+  Hw_part_device(cxx::Ref_ptr<Base_parent_device> const &parent, unsigned part,
+                 std::string const &hid, l4_uint64_t num_sectors,
+                 bool read_only)
+  : _parent(parent), _part(part), _hid(hid), _num_sectors(num_sectors),
+    _read_only(read_only)
+  {}
+
+  Block_device::Notification_domain const *notification_domain() const override
+  { return _parent->notification_domain(); }
+
+  bool is_read_only() const override
+  { return _read_only; }
+
+  bool supports_flush() const override
+  { return _parent->supports_flush(); }
+
+  bool match_hid(cxx::String const &hid) const override
+  { return hid == cxx::String(_hid.c_str()); }
+
+  l4_uint64_t capacity() const override
+  { return _num_sectors * sector_size(); }
+
+  l4_size_t sector_size() const override
+  { return _parent->sector_size(); }
+
+  l4_size_t max_size() const override
+  { return _parent->max_size(); }
+
+  unsigned max_segments() const override
+  { return _parent->max_segments(); }
+
+  Discard_info discard_info() const override
+  { return _parent->discard_info(); }
+
+  void reset() override
+  { _parent->reset(); }
+
+  void start_device_scan(Block_device::Errand::Callback const &cb) override
+  { cb(); }
+
+  int inout_data(l4_uint64_t sector, Block_device::Inout_block const &blocks,
+                 Block_device::Inout_callback const &cb,
+                 L4Re::Dma_space::Direction dir) override
+  { return _parent->inout_data_part(_part, sector, blocks, cb, dir, _fua); }
+
+  int part_inout_data(l4_uint64_t sector,
+                      Block_device::Inout_block const &blocks,
+                      Block_device::Inout_callback const &cb,
+                      L4Re::Dma_space::Direction dir, bool fua) override
+  {
+    return _parent->inout_data_part(_part, sector, blocks, cb, dir,
+                                    _fua || fua);
+  }
+
+  int discard(l4_uint64_t offset, Block_device::Inout_block const &block,
+              Block_device::Inout_callback const &cb, bool discard) override
+  { return _parent->discard_part(_part, offset, block, cb, discard); }
+
+  int flush(Block_device::Inout_callback const &cb) override
+  { return _parent->part_flush(cb, _flush_ordering); }
+
+  int part_flush(Block_device::Inout_callback const &cb,
+                 bool ordering) override
+  { return _parent->part_flush(cb, _flush_ordering || ordering); }
+
+  int dma_map_all(Block_device::Mem_region *region, l4_addr_t offset,
+                  l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+                  L4Re::Dma_space::Dma_addr *phys) override
+  { return _parent->dma_map_all(region, offset, num_sectors, dir, phys); }
+
+  int dma_map_single(Block_device::Mem_region *region, l4_addr_t offset,
+                     l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+                     L4Re::Dma_space::Dma_addr *phys) override
+  { return _parent->dma_map_single(region, offset, num_sectors, dir, phys); }
+
+  int dma_unmap_all(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+                    L4Re::Dma_space::Direction dir) override
+  { return _parent->dma_unmap_all(phys, num_sectors, dir); }
+
+  int dma_unmap_single(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+                       L4Re::Dma_space::Direction dir) override
+  { return _parent->dma_unmap_single(phys, num_sectors, dir); }
+
+private:
+  int dma_map(Block_device::Mem_region *region, l4_addr_t offset,
+              l4_size_t num_sectors, L4Re::Dma_space::Direction dir,
+              L4Re::Dma_space::Dma_addr *phys) override
+  {
+    if (_dma_map_all)
+      return dma_map_all(region, offset, num_sectors, dir, phys);
+    else
+      return dma_map_single(region, offset, num_sectors, dir, phys);
+  }
+
+  int dma_unmap(L4Re::Dma_space::Dma_addr phys, l4_size_t num_sectors,
+                L4Re::Dma_space::Direction dir) override
+  {
+    if (_dma_map_all)
+      return dma_unmap_all(phys, num_sectors, dir);
+    else
+      return dma_unmap_single(phys, num_sectors, dir);
+  }
+
+  cxx::Ref_ptr<Base_parent_device> _parent;
+  unsigned _part;               ///< PARTITION_ACCESS value
+  std::string _hid;             ///< `<PSN>-<partition>`
+  l4_uint64_t _num_sectors;
+  bool _read_only;
 };
 
 template <class Driver>
@@ -118,6 +365,27 @@ public:
     Voltage_delay_ms = 10,      ///< Delay after changing voltage [us]
     Stats_delay_us = 1000000,   ///< Delay between showing stats (info+) [us]
     Timeout_irq_us = 100000,    ///< timeout for receiving IRQs [us]
+    Cqe_coalesce_us = 25,       ///< CQE coalescing timeout per task [us]
+    Swcq_poll_us = 50,          ///< First delay of queue status polls [us]
+    Swcq_poll_max_us = 1000,    ///< Maximum delay of queue status polls [us]
+    Sched_depth = 2,            ///< Queued commands if requests held back
+    Prg_poll_us = 1000,         ///< Poll interval for programming state [us]
+    Flush_timeout_us = 30000000, ///< Maximum time for a cache flush [us]
+    Max_erase_groups = 256,     ///< Maximum erase groups per discard segment
+    Max_discard_seg = 16,       ///< Maximum segments per discard request
+    Zero_sectors = 128,         ///< Size of the zero buffer in sectors
+    Hpi_after_us = 10000,       ///< Programming time before HPI is used [us]
+    Bkops_idle_us = 1000000,    ///< Idle time before starting BKOPS [us]
+    Bkops_timeout_us = 60000000, ///< Maximum time for BKOPS [us]
+    Retune_check_us = 1000000,  ///< Interval for checking re-tuning [us]
+    Poll_cmd_us = 20,           ///< Busy-polling commands without data [us]
+    Poll_cmd_max = 8,           ///< Commands completed by polling per kick
+    Speed_check_us = 1000000,   ///< Interval for checking the bus speed [us]
+    Speed_errors = 3,           ///< Errors within the window for a downgrade
+    Speed_window_us = 10000000, ///< Window for counting transfer errors [us]
+    Speed_quiet_us = 300000000, ///< Error-free time before an upgrade [us]
+    Speed_quiet_max_us = 1800000000, ///< Limit after failed upgrades [us]
+    Speed_history = 8,          ///< Bus speed changes kept for statistics
     Max_size = 4 << 20,
   };
 
@@ -135,7 +403,7 @@ public:
          L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma,
          L4Re::Util::Object_registry *registry,
          l4_uint32_t host_clock, unsigned max_seg,
-         Device_type_disable dt_disable);
+         Device_type_disable dt_disable, Io_sched_config const &sched_cfg);
 
   void handle_irq();
 
@@ -174,18 +442,55 @@ public:
   unsigned max_segments() const override
   { return _max_seg; }
 
+  int inout_data_part(unsigned part, l4_uint64_t sector,
+                      Block_device::Inout_block const &blocks,
+                      Block_device::Inout_callback const &cb,
+                      L4Re::Dma_space::Direction dir, bool fua) override;
+
+  int part_inout_data(l4_uint64_t sector,
+                      Block_device::Inout_block const &blocks,
+                      Block_device::Inout_callback const &cb,
+                      L4Re::Dma_space::Direction dir, bool fua) override
+  { return inout_data_part(0, sector, blocks, cb, dir, fua); }
+
+  int part_flush(Block_device::Inout_callback const &cb,
+                 bool ordering) override
+  { return flush_cache(cb, _flush_ordering || ordering); }
+
+  int discard_part(unsigned part, l4_uint64_t offset,
+                   Block_device::Inout_block const &block,
+                   Block_device::Inout_callback const &cb,
+                   bool discard) override;
+
+  std::vector<cxx::Ref_ptr<Base_device>> hw_part_devices() override;
+
   Discard_info discard_info() const override
   {
     Discard_info di;
 
-    // discard() currently returns -L4_EINVAL
-    di.max_discard_sectors = 0;
-    di.max_discard_seg = 0;
-    di.discard_sector_alignment = 0;
-
-    // discard() currently returns -L4_EINVAL
-    di.max_write_zeroes_sectors = 0;
-    di.max_write_zeroes_seg = 0;
+    if (_erase_grp_sectors)
+      {
+        di.max_discard_sectors = _erase_grp_sectors * Max_erase_groups;
+        di.max_discard_seg = Max_discard_seg;
+        di.discard_sector_alignment = _discard_unit_sectors;
+      }
+    else
+      {
+        di.max_discard_sectors = 0;
+        di.max_discard_seg = 0;
+        di.discard_sector_alignment = 0;
+      }
+
+    if (_erase_zeroes)
+      {
+        di.max_write_zeroes_sectors = _erase_grp_sectors * Max_erase_groups;
+        di.max_write_zeroes_seg = Max_discard_seg;
+      }
+    else
+      {
+        di.max_write_zeroes_sectors = 0;
+        di.max_write_zeroes_seg = 0;
+      }
 
     return di;
   }
@@ -224,11 +529,95 @@ private:
                  Block_device::Inout_callback const &cb,
                  L4Re::Dma_space::Direction dir) override;
 
-  int flush(Block_device::Inout_callback const &cb) override;
+  int inout_data_cur(l4_uint64_t sector,
+                     Block_device::Inout_block const &blocks,
+                     Block_device::Inout_callback const &cb,
+                     bool inout_read, bool reliable);
+
+  int inout_data_cmd(l4_uint64_t sector,
+                     Block_device::Inout_block const &blocks,
+                     Block_device::Inout_callback const &cb,
+                     bool inout_read, bool reliable);
+
+  void sched_dispatch();
+
+  int inout_data_cqe(l4_uint64_t sector,
+                     Block_device::Inout_block const &blocks,
+                     Block_device::Inout_callback const &cb,
+                     bool inout_read, bool reliable);
+
+  int inout_data_swcq(l4_uint64_t sector,
+                      Block_device::Inout_block const &blocks,
+                      Block_device::Inout_callback const &cb,
+                      bool inout_read, bool reliable);
+
+  void init_cmdq_task(Cmd *task, l4_uint64_t sector,
+                      Block_device::Inout_block const &blocks,
+                      Block_device::Inout_callback const &cb,
+                      bool inout_read, bool reliable);
+
+  void cmdq_task_done(Cmd *task, int error);
+
+  void check_inout_blocks(Block_device::Inout_block const &blocks);
+
+  bool merge_inout(l4_uint64_t sector,
+                   Block_device::Inout_block const &blocks,
+                   Block_device::Inout_callback const &cb,
+                   bool inout_read, bool reliable);
+  void set_packed_header(Cmd *cmd);
+
+  void complete_inout(Cmd *cmd, int error);
+
+  int flush(Block_device::Inout_callback const &cb) override
+  { return flush_cache(cb, _flush_ordering); }
+  int flush_cache(Block_device::Inout_callback const &cb, bool ordering);
+  void flush_fua(Block_device::Inout_callback const &cb);
+  int flush_start(Block_device::Inout_callback const &barrier_cb = nullptr);
+  void flush_next();
+  void flush_done(int error);
 
   int discard(l4_uint64_t offset, Block_device::Inout_block const &block,
               Block_device::Inout_callback const &cb, bool discard) override;
 
+  int erase_start(l4_uint64_t offset, Block_device::Inout_block const &block,
+                  Block_device::Inout_callback const &cb, bool zeroes);
+
+  /// State of a write-zeroes request.
+  struct Zeroes_req
+  {
+    Block_device::Inout_callback cb;
+    /// Sector ranges to be written with zeroes: first sector, sector count.
+    std::vector<std::pair<l4_uint64_t, l4_uint32_t>> fragments;
+    Block_device::Inout_block block; ///< Currently written chunk.
+    int error = L4_EOK;
+  };
+
+  int write_zeroes(l4_uint64_t offset, Block_device::Inout_block const &block,
+                   Block_device::Inout_callback const &cb);
+  void write_zeroes_next(std::shared_ptr<Zeroes_req> z);
+
+  /// Request waiting for the selection of its hardware partition.
+  struct Hw_part_req
+  {
+    unsigned part;
+    std::function<int()> run;   ///< Execute the request.
+    Block_device::Inout_callback cb;
+  };
+
+  bool hw_part_ready(unsigned part) const
+  {
+    return part == _part_config.partition_access() && !_hw_part_switching
+           && _hw_part_pending.empty();
+  }
+
+  int hw_part_queue(unsigned part, std::function<int()> const &run,
+                    Block_device::Inout_callback const &cb);
+  void hw_part_next();
+  void hw_part_retry();
+  void hw_part_switch(unsigned part);
+  void handle_irq_hw_part(Cmd *cmd);
+  bool queues_idle() const;
+
   void start_device_scan(Errand::Callback const &cb) override;
 
   void unmask_interrupt() const;
@@ -241,16 +630,59 @@ private:
 
   void cmd_queue_kick()
   {
+    // A completed command makes room for requests held back by the scheduler.
+    if (!_sched.empty())
+      sched_dispatch();
     if (_drv.cmd_queue_kick())
-      unmask_interrupt();
+      {
+        if (_hpi)
+          _cmd_submitted = l4_kip_clock(l4re_kip());
+        if (!cmd_poll())
+          unmask_interrupt();
+      }
   }
 
+  bool cmd_poll();
+  void handle_completion();
+
   l4_uint64_t bytes_transferred(Cmd const *cmd) const
   { return l4_uint64_t{cmd->sectors_done} * sector_size(); }
 
   void handle_irq_inout(Cmd *cmd);
+  void handle_irq_flush(Cmd *cmd);
+  void handle_irq_erase(Cmd *cmd);
+  void handle_irq_packed_status(Cmd *cmd);
+  bool erase_range(l4_uint64_t offset, Block_device::Inout_block const *b,
+                   bool zeroes, l4_uint64_t *start, l4_uint64_t *end) const;
+  void erase_init(Cmd *cmd, l4_uint32_t cmd_val, l4_uint32_t arg);
+  Work_status erase_next(Cmd *cmd);
+
+  l4_uint32_t erase_type(bool zeroes) const
+  { return zeroes ? _zeroes_type : _discard_type; }
+  void prg_start(Cmd *cmd, l4_uint64_t timeout_us);
+  void prg_send_status(Cmd *cmd);
+  bool prg_done(Cmd *cmd);
+  bool prg_poll(Cmd *cmd);
+  bool hpi_preempt(Cmd *cmd);
+  void hpi_restart(Cmd *restart, Cmd const *cmd);
+  void hpi_write_arm();
+  void hpi_write_check();
+  bool hpi_write(Cmd *cmd);
+  void hpi_write_resume(Cmd *cmd);
+  void handle_irq_hpi(Cmd *cmd);
+  void bkops_idle();
+  void bkops_start();
+  void handle_irq_bkops(Cmd *cmd);
+  void cqe_suspend(Cmd *cmd);
+  void cqe_resume();
+  void handle_irq_cqe();
+  void cqe_adapt_coalescing();
+  void handle_irq_swcq(Cmd *cmd);
+  Work_status swcq_next(Cmd *cmd);
+  void swcq_poll(Cmd *cmd);
   Work_status handle_irq_inout_sdma(Cmd *cmd);
   Work_status transfer_block_sdma(Cmd *cmd);
+  l4_uint32_t sdma_num_sectors(Cmd const *cmd);
   void set_block_count_adma2(Cmd *cmd);
   Work_status handle_irq_inout_adma2(Cmd *cmd);
 
@@ -260,6 +692,7 @@ private:
   void reset_sdio(Cmd *cmd);
   bool power_up_sd(Cmd *cmd);
   bool power_up_mmc(Cmd *cmd);
+  void enable_cmdq(Cmd *cmd);
 
   void mmc_set_timing(Cmd *cmd, Mmc::Reg_ecsd::Ec185_hs_timing::Timing timing,
                       Mmc::Timing mmc_timing, l4_uint32_t freq,
@@ -268,8 +701,57 @@ private:
   void mmc_set_bus_width(Cmd *cmd, Mmc::Reg_ecsd::Ec183_bus_width::Width width,
                          bool strobe = false);
 
+  Tuning_cache::Key tuning_key(Mmc::Timing timing) const;
+  bool tune(Cmd *cmd, Mmc::Timing timing);
+  bool tuning_verify(Cmd *cmd, Mmc::Timing timing);
+  void retune_timer();
+  void retune_start(Cmd *cmd);
+  void handle_irq_retune(Cmd *cmd);
+  void inout_restart(Cmd *cmd);
+
+  /// Bus speed mode usable at runtime.
+  struct Speed_mode
+  {
+    Mmc::Timing timing;
+    unsigned crc_errors;
+    unsigned timeouts;
+  };
+
+  /// Bus speed change for statistics.
+  struct Speed_change
+  {
+    l4_cpu_time_t time;
+    Mmc::Timing from;
+    Mmc::Timing to;
+    unsigned errors;            ///< Errors in the window before the change.
+    bool success;
+  };
+
+  /// Step of a bus speed switch, see speed_next().
+  struct Speed_step
+  {
+    enum Op { Switch, Clock, Tune } op;
+    l4_uint8_t idx;             ///< Switch: EXT_CSD index.
+    l4_uint8_t val;             ///< Switch: EXT_CSD value.
+    l4_uint32_t freq;           ///< Clock: bus frequency.
+    Mmc::Timing timing;         ///< Clock: host timing.
+    bool strobe;                ///< Clock: enhanced strobe.
+  };
+
+  void speed_modes();
+  void speed_error(Cmd::Flags errors);
+  void speed_timer();
+  std::vector<Speed_step> speed_steps(Mmc::Timing timing) const;
+  void speed_switch(unsigned target);
+  bool speed_next(Cmd *cmd);
+  void handle_irq_speed(Cmd *cmd);
+  void speed_done(Cmd *cmd, bool success);
+  void speed_statistics(l4_cpu_time_t now);
+
   void adapt_ocr(Mmc::Reg_ocr ocr_dev, Mmc::Arg_acmd41_sd_send_op *a41);
 
+  void init_mmc_switch(Cmd *cmd, l4_uint8_t idx, l4_uint8_t val);
+
   void exec_mmc_switch(Cmd *cmd, l4_uint8_t idx, l4_uint8_t val,
                        bool with_status = true);
 
@@ -286,6 +768,29 @@ private:
 
   /// Device type (must be null-terminated)
   char _hid[Hid_max_length];
+  l4_uint32_t _cid[4];          ///< Card identification
+  l4_uint64_t _mmio_addr;       ///< Controller MMIO address
+  Tuning_cache _tuning_cache;
+  Mmc::Timing _tuned_timing = Mmc::Legacy; ///< Current mode if it is tuned
+  l4_uint64_t _retune_period_us = 0; ///< Periodic re-tuning, 0 = disabled
+  l4_cpu_time_t _retune_time = 0; ///< Time of the last tuning
+  unsigned _retune_loops = 0;   ///< Tuning blocks sent by the current re-tuning
+  bool _retuning = false;       ///< Re-tuning command queued
+  std::vector<Speed_mode> _speed_modes; ///< Usable modes, fastest first
+  unsigned _speed_idx = 0;      ///< Current entry of `_speed_modes`
+  unsigned _speed_target = 0;   ///< Entry selected by the switch in flight
+  std::vector<Speed_step> _speed_steps; ///< Steps of the switch in flight
+  unsigned _speed_step = 0;     ///< Next entry of `_speed_steps`
+  bool _speed_switching = false; ///< Bus speed switch queued
+  bool _speed_down = false;     ///< Too many errors, switch to slower mode
+  bool _speed_probed = false;   ///< Current mode was reached by an upgrade
+  bool _speed_report = false;   ///< Statistics changed since last shown
+  unsigned _speed_errors = 0;   ///< Transfer errors in the current window
+  l4_cpu_time_t _speed_window = 0; ///< Start of the current error window
+  l4_cpu_time_t _speed_quiet = 0; ///< Last error or bus speed change
+  l4_uint64_t _speed_quiet_us = Speed_quiet_us; ///< Error-free time for upgrade
+  l4_uint32_t _switch_timeout_us = 0; ///< GENERIC_CMD6_TIME
+  std::deque<Speed_change> _speed_history; ///< Recent bus speed changes
 
   Driver _drv;                  ///< driver instance
   int _irq_num;                 ///< interrupt number
@@ -332,9 +837,63 @@ private:
   Mmc::Reg_ecsd::Ec196_device_type _device_type_selected;
   bool        _enh_strobe = false;
   bool        _has_cache = false;  ///< true if the device reported a non-zero cache size
+  bool        _rel_write = false; ///< reliable writes of arbitrary size
+  bool        _cache_barrier = false; ///< cache barriers enabled
+  bool        _cache_fifo = false; ///< device flushes its cache in FIFO order
+  bool        _hpi = false;     ///< HPI enabled
+  bool        _hpi_cmd12 = false; ///< HPI using CMD12 (otherwise CMD13)
+  l4_uint32_t _hpi_timeout_us = 0; ///< device leaves programming after HPI
+  bool        _hpi_write_armed = false; ///< hpi_write_check() scheduled
+  l4_cpu_time_t _cmd_submitted = 0; ///< submission of the current command
+  Cmd        *_hpi_resume = nullptr; ///< writes remainder of write after HPI
+  /// Blocks not programmed before HPI, written by `_hpi_resume`.
+  std::unique_ptr<Block_device::Inout_block> _hpi_resume_blocks;
+  bool        _bkops = false;   ///< host starts BKOPS in idle periods
+  bool        _bkops_urgent = false; ///< device signaled an exception event
+  l4_cpu_time_t _io_time = 0;   ///< arrival of the most recent request
+  l4_cpu_time_t _bkops_io_time = 0; ///< `_io_time` when BKOPS status was read
   l4_uint64_t _size_user = 0;   ///< size of the user partition in bytes
   l4_uint64_t _size_boot12 = 0; ///< size of the boot{1,2} partitions in bytes
   l4_uint64_t _size_rpmb = 0;   ///< size of the RPMB partition in bytes
+  l4_uint64_t _hw_part_sectors[8] = {}; ///< size of boot and GP partitions
+  /// PARTITION_CONFIG, `partition_access` is the selected hardware partition
+  Mmc::Reg_ecsd::Ec179_partition_config _part_config{0};
+  l4_uint32_t _part_switch_timeout_us = 0; ///< PARTITION_SWITCH_TIME
+  unsigned    _hw_part_next = 0; ///< partition selected by switch in flight
+  bool        _hw_part_switching = false; ///< partition switch in flight
+  bool        _hw_part_retry = false; ///< hw_part_next() scheduled
+  bool        _hw_part_running = false; ///< hw_part_next() executes requests
+  /// Requests held back until their hardware partition is selected.
+  std::deque<Hw_part_req> _hw_part_pending;
+  unsigned    _zeroes_active = 0; ///< write-zeroes requests in progress
+  l4_uint32_t _erase_grp_sectors = 0; ///< erase group size, 0: no discard
+  l4_uint32_t _discard_unit_sectors = 0; ///< preferred discard alignment
+  l4_uint32_t _discard_type = Mmc::Arg_cmd38_erase::Erase; ///< CMD38 for discard
+  l4_uint32_t _erase_timeout_ms = 0; ///< erase timeout per erase group
+  l4_uint32_t _trim_timeout_ms = 0; ///< trim/discard timeout per erase group
+  bool        _erase_zeroes = false; ///< write zeroes using erase
+  l4_uint32_t _zeroes_type = Mmc::Arg_cmd38_erase::Erase; ///< CMD38 for zeroes
+  cxx::Ref_ptr<Inout_buffer> _zero_buf; ///< zeroes for unaligned fragments
+  unsigned    _max_packed_wr = 0; ///< entries per packed write, 0: no packing
+  cxx::Ref_ptr<Inout_buffer> _packed_hdrs; ///< packed header per command slot
+  bool        _cqe_active = false; ///< true if the command queue engine is used
+  bool        _swcq_active = false; ///< true if software command queuing is used
+  Cqe::Tasks  _cmdq_tasks;      ///< task slots of the command queue
+  unsigned    _cqe_coalesce = 0; ///< current CQE coalescing threshold
+  l4_uint32_t _cqe_retry = 0;   ///< tasks submitted again after re-tuning
+  Cmd        *_swcq_cmd = nullptr; ///< command driving the software queue
+  unsigned    _swcq_tag = 0;    ///< task of the current CMD44/45/46/47
+  l4_uint32_t _swcq_queued = 0; ///< tasks queued on the device (CMD44/45)
+  l4_uint32_t _swcq_ready = 0;  ///< tasks ready for execution (CMD13/QSR)
+  bool        _swcq_retune = false; ///< re-tune after discarding the queue
+  l4_uint32_t _swcq_poll_us = Swcq_poll_us; ///< delay of next status poll
+  l4_cpu_time_t _prg_timeout = 0; ///< give up polling programming state
+  l4_cpu_time_t _prg_started = 0; ///< start of polling programming state
+  bool        _cache_dirty = false; ///< writes completed since last flush
+  /// Requests completed by the flush in flight.
+  std::vector<Block_device::Inout_callback> _flush_waiters;
+  /// Requests completed by the flush following the flush in flight.
+  std::vector<Block_device::Inout_callback> _flush_next;
 
   /// SD (_type = T_sd)
   Mmc::Timing _sd_timing;
@@ -347,10 +906,20 @@ private:
   Inout_buffer _io_buf;
   Mmc::Reg_ecsd const &_ecsd;
 
+  /// EXT_CSD read at runtime, keeps `_ecsd` intact if the transfer fails.
+  Inout_buffer _ecsd_buf;
+  Mmc::Reg_ecsd const &_ecsd_rt;
+
   /// Statistics
   l4_cpu_time_t _init_time = 0;
   l4_cpu_time_t _stat_time = 0;
   l4_uint64_t   _stat_ints = 0;
+  l4_uint64_t   _stat_ios = 0;
+  l4_uint64_t   _stat_polls = 0;
+  l4_uint64_t   _stat_mmio_ops = 0; ///< Driver MMIO accesses at last report
+  l4_uint64_t   _poll_budget = 0; ///< TSC ticks for cmd_poll(), 0 = disabled
+  bool          _cmd_polling = false; ///< cmd_poll() handles a completion
+  bool          _cmd_poll_next = false; ///< command submitted meanwhile
 
   Dbg warn;
   Dbg info;
@@ -360,6 +929,11 @@ private:
   /// Mask for bits in device_type which should be ignored.
   Device_type_disable _device_type_disable;
 
+  /// I/O scheduling, the policy is selected after device identification.
+  Io_sched_config _sched_cfg;
+  Io_sched _sched;
+  bool _sched_dispatching = false; ///< sched_dispatch() is running
+
   constexpr char const *yes_no(unsigned bit) { return bit ? "yes" : "no"; }
   constexpr char const *yes_na(unsigned bit) { return bit ? "yes" : "N/A"; }
 
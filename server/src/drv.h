@@ -47,6 +47,10 @@ public:
   l4_uint64_t time_sleep() const
   { return _time_sleep; }
 
+  /** Number of MMIO register accesses if counted by the driver. */
+  l4_uint64_t mmio_ops() const
+  { return _mmio_ops; }
+
   void delay(unsigned ms);
 
   /** Attach the provided bounce buffer. */
@@ -77,6 +81,7 @@ protected:
   // Statistics
   l4_uint64_t _time_busy = 0;
   l4_uint64_t _time_sleep = 0;
+  mutable l4_uint64_t _mmio_ops = 0;
 };
 
 template <class Hw_drv>
@@ -103,6 +108,19 @@ public:
   /** Create a new descriptor out of the descriptor list. */
   Cmd *cmd_create() { return _cmd_queue.create(); }
 
+  /** Return the most recently created descriptor if not yet done. */
+  Cmd *cmd_last_created() { return _cmd_queue.last_created(); }
+
+  /** Return true if no further descriptor can be created. */
+  bool cmd_queue_full() const { return _cmd_queue.is_full(); }
+
+  /** Return the number of created descriptors not yet done. */
+  unsigned cmd_num_queued() const { return _cmd_queue.num_work(); }
+
+  /** Return true if `f` holds for any created descriptor not yet done. */
+  template <typename F>
+  bool cmd_any_queued(F &&f) const { return _cmd_queue.any_work(f); }
+
   /**
    * Submit a command to the controller and return immediately.
    *
@@ -141,21 +159,96 @@ public:
 
   bool cmd_queue_kick()
   {
+    bool submitted = false;
     Cmd *cmd = _cmd_queue.working();
     if (cmd && cmd->status == Cmd::Ready_for_submit)
       {
         cmd_submit_on_avail(cmd);
-        return true;
+        submitted = true;
       }
-    return false;
+
+    // Prepare the next command while the controller executes this command.
+    if (Cmd *next = _cmd_queue.next_working())
+      static_cast<Hw_drv &>(*this).cmd_prepare(next);
+
+    return submitted;
   }
 
+  /**
+   * Prepare a queued command for submission, for example set up DMA
+   * descriptors. The default is to do everything during submission.
+   */
+  void cmd_prepare(Cmd *)
+  {}
+
+  /**
+   * Busy-poll for at most `budget` TSC ticks until the current command, which
+   * has no data phase, finished. Return false if the command is still running,
+   * its completion is then reported by the interrupt. The default is to always
+   * use the interrupt.
+   */
+  bool cmd_poll_finished(l4_uint64_t)
+  { return false; }
+
+  /**
+   * Abort the data transfer of the current command using CMD12 with the
+   * argument `arg` and reset the data path. Return false if the transfer was
+   * not aborted and continues. The default is to not support aborting
+   * transfers.
+   */
+  bool cmd_abort(Cmd *, l4_uint32_t)
+  { return false; }
+
+  /**
+   * Return the alignment of the end of all but the last segment if a single
+   * SDMA command may cover several segments of an inout request. The default
+   * is 0: Transfer each segment using separate commands.
+   */
+  l4_size_t sdma_seg_align() const
+  { return 0; }
+
   /**
    * Perform the sdio reset, if necessary. The default is to not do anything.
    */
   void sdio_reset(Cmd*)
   {}
 
+  /**
+   * Return true if the controller provides an eMMC command queue engine
+   * (CQE). The default is no CQE, the remaining `cqe_*()` functions are only
+   * called if the driver overrides this function.
+   */
+  bool cqe_available() const
+  { return false; }
+
+  /** Enable the command queue engine. */
+  void cqe_enable(unsigned, l4_uint16_t)
+  { L4Re::throw_error(-L4_ENOSYS, "Command queue engine not available"); }
+
+  /** Disable the command queue engine. */
+  void cqe_disable()
+  {}
+
+  /** Halt (true) or resume (false) the command queue engine. */
+  void cqe_halt(bool)
+  {}
+
+  /** Configure interrupt coalescing of the command queue engine. */
+  void cqe_set_coalescing(unsigned, unsigned)
+  {}
+
+  /** Pass a task to the command queue engine. */
+  void cqe_task_submit(unsigned, Cmd *)
+  { L4Re::throw_error(-L4_ENOSYS, "Command queue engine not available"); }
+
+  /**
+   * Handle command queue engine interrupts. Return false if the interrupt was
+   * not triggered by the command queue engine. The `crc_error` and `timeout`
+   * flags of the third argument report the cause of failed tasks.
+   */
+  bool cqe_handle_irq(l4_uint32_t *, l4_uint32_t *, Cmd::Flags *)
+  { return false; }
+
 protected:
   Hw_regs     _regs;                    ///< Controller MMIO registers.
   Receive_irq _receive_irq;             ///< IRQ receive function.
@@ -119,12 +119,14 @@ struct F_sdhci_iproc : Factory
          L4::Cap<L4Re::Dataspace> iocap, int irq_num, L4_irq_mode irq_mode,
          L4::Cap<L4::Icu> icu, L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma,
          L4Re::Util::Object_registry *registry, l4_uint32_t host_clock,
-         unsigned max_seg, Device_type_disable dt_disable) override
+         unsigned max_seg, Device_type_disable dt_disable,
+         Io_sched_config const &sched_cfg) override
   {
     L4::Cap<L4Re::Mmio_space> mmio_space;
     return cxx::make_ref_obj<Device<Sdhci<Sdhci_type::Bcm2711>>>(
              nr, mmio_addr, mmio_size, iocap, mmio_space, irq_num, irq_mode,
-             icu, dma, registry, host_clock, max_seg, dt_disable);
+             icu, dma, registry, host_clock, max_seg, dt_disable,
+             sched_cfg);
   }
 
   l4_uint32_t guess_clock(l4_uint64_t mmio_addr) override
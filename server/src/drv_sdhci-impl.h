@@ -29,12 +29,17 @@ Sdhci<TYPE>::Sdhci(int nr,
                    unsigned max_seg,
                    l4_uint32_t host_clock, Receive_irq receive_irq)
 : Drv<Sdhci<TYPE>>(iocap, mmio_space, mmio_base, mmio_size, receive_irq),
-  _adma2_desc_mem("sdhci_adma_buf", adma2_desc_mem_size(max_seg),
+  _v4_mode(v4_supported()),
+  _v4_10(_v4_mode && Reg_host_version(this).spec_vers() >= 4),
+  _adma3(Dma_adma3 && _v4_10 && Reg_cap2_sdhci(this).adma3_support()),
+  _adma2_desc_mem("sdhci_adma_buf", Adma2_slots * adma2_desc_mem_size(max_seg),
                   dma, L4Re::Dma_space::Direction::To_device,
                   L4Re::Rm::F::Cache_uncached),
   _adma2_desc_phys(_adma2_desc_mem.pget()),
   _adma2_desc(_adma2_desc_mem.get<Adma2_desc_64>()),
   _host_clock(host_clock),
+  _max_seg(max_seg),
+  _dma(dma),
   warn(Dbg::Warn, "sdhci", nr),
   info(Dbg::Info, "sdhci", nr),
   trace(Dbg::Trace, "sdhci", nr),
@@ -42,8 +47,8 @@ Sdhci<TYPE>::Sdhci(int nr,
 {
   trace.printf("Assuming %s eMMC controller.\n", type_name());
 
-  // Assume DMA limit of 32-bit / 4GB. SDHCI could also handle 64-bit addresses.
-  _dma_limit = 0xffffffffULL;
+  // Without host version 4 mode, assume DMA limit of 32-bit / 4GB.
+  _dma_limit = _v4_mode ? ~0ULL : 0xffffffffULL;
 
   Reg_cap1_sdhci cap1(this);
   if (TYPE == Sdhci_type::Iproc || TYPE == Sdhci_type::Bcm2711)
@@ -83,8 +88,14 @@ Sdhci<TYPE>::Sdhci(int nr,
   info.printf("Using %s of memory for ADMA2 descriptors.\n",
               Util::readable_size(_adma2_desc_mem.size()).c_str());
 
-  if (cap1.bit64_v3())
+  if (cap1.bit64_v3() || _v4_mode)
     _adma2_64 = true;
+
+  if (_v4_mode)
+    info.printf("Host version 4 mode: 64-bit ADMA2%s.\n",
+                _v4_10 ? ", 26-bit descriptor length, 32-bit block count" : "");
+  if (_adma3)
+    info.printf("Using ADMA3 for inout requests.\n");
 }
 
 template <Sdhci_type TYPE>
@@ -97,11 +108,12 @@ template <Sdhci_type TYPE>
 l4_size_t
 Sdhci<TYPE>::adma2_desc_mem_size(unsigned max_seg)
 {
-  auto desc_size = Reg_cap1_sdhci(this).bit64_v3() ? sizeof(Adma2_desc_64)
-                                                   : sizeof(Adma2_desc_32);
+  auto desc_size = Reg_cap1_sdhci(this).bit64_v3() || _v4_mode
+                     ? sizeof(Adma2_desc_64) : sizeof(Adma2_desc_32);
   static_assert(Adma2_desc_32::max_length == Adma2_desc_64::max_length);
-  unsigned descs_per_seg = max_inout_req_size() / Adma2_desc_32::max_length;
-  return L4::round_page(max_seg * descs_per_seg * desc_size);
+  unsigned descs_per_seg = max_inout_req_size() / adma2_max_length() + 1;
+  return L4::round_page(max_seg * descs_per_seg * desc_size
+                        + (_adma3 ? Adma3_descs_size : 0));
 }
 
 template <Sdhci_type TYPE>
@@ -206,8 +218,22 @@ Sdhci<TYPE>::init()
           hc.voltage_sel() = Reg_host_ctrl::Voltage_33;
           hc.bus_power() = 1;
         }
-      hc.dmamod() = dma_adma2() ? hc.Adma32 : hc.Sdma;
+      // In host version 4 mode, Adma32 selects ADMA2, Adma64 selects ADMA2 or
+      // ADMA3 and the addressing is selected by Reg_host_ctrl2::bit64.
+      if (_adma3)
+        hc.dmamod() = hc.Adma64;
+      else
+        hc.dmamod() = dma_adma2() ? hc.Adma32 : hc.Sdma;
       hc.write(this);
+
+      if (_v4_mode)
+        {
+          Reg_host_ctrl2 hc2(this);
+          hc2.hostv4() = 1;
+          hc2.bit64() = 1;
+          hc2.adma2len26() = _v4_10;
+          hc2.write(this);
+        }
     }
 }
 
@@ -231,6 +257,10 @@ Sdhci<TYPE>::handle_irq()
 
       if (cmd->status == Cmd::Success)
         cmd_fetch_response(cmd);
+
+      // Release the ADMA2 descriptors after the data transfer.
+      if (!cmd->progress() && cmd->flags.has_data())
+        cmd->flags.descs_prepared() = 0;
     }
   // else polling
 
@@ -238,6 +268,62 @@ Sdhci<TYPE>::handle_irq()
   return cmd;
 }
 
+template <Sdhci_type TYPE>
+bool
+Sdhci<TYPE>::cmd_poll_finished(l4_uint64_t budget)
+{
+  l4_uint64_t end = Util::read_tsc() + budget;
+  do
+    {
+      Reg_int_status is(this);
+      if (is.cc() || is.cmd_error() || is.ctoe())
+        return true;
+    }
+  while (Util::read_tsc() < end);
+  return false;
+}
+
+/**
+ * Stop the data phase of `cmd` by sending CMD12 as abort command while the
+ * interrupt signals are masked. Afterwards, the CMD and DAT lines are reset to
+ * discard the state of the aborted transfer. A failed CMD12 is only logged, the
+ * caller determines the device state by CMD13.
+ */
+template <Sdhci_type TYPE>
+bool
+Sdhci<TYPE>::cmd_abort(Cmd *cmd, l4_uint32_t arg)
+{
+  if (   cmd->status != Cmd::Progress_data || Reg_pres_state(this).cihb()
+      || Reg_int_status(this).tc())
+    return false;
+
+  Reg_int_signal_en().write(this); // mask IRQs
+  Reg_cmd_arg(arg).write(this);
+  Reg_cmd_xfr_typ(xfr_typ_cmd(Mmc::Cmd12_stop_transmission_wr)).write(this);
+  Util::poll(10000, [this]
+    {
+      Reg_int_status is(this);
+      return is.cc() || is.cmd_error() || is.ctoe();
+    }, "CMD12 aborting data transfer");
+  Reg_int_status is(this);
+
+  Reg_sys_ctrl sc(this);
+  sc.rstc() = 1;
+  sc.rstd() = 1;
+  sc.write(this);
+  Util::poll(10000, [this]
+    {
+      Reg_sys_ctrl sc(this);
+      return !sc.rstc() && !sc.rstd();
+    }, "Software reset for CMD and data line");
+
+  Reg_int_status(~0U).write(this); // clear all IRQs
+  cmd->flags.descs_prepared() = 0;
+  if (is.cmd_error() || is.ctoe())
+    trace.printf("Abort data transfer: CMD12 failed (is = %08x).\n", is.raw);
+  return true;
+}
+
 template <Sdhci_type TYPE>
 void
 Sdhci<TYPE>::handle_irq_cmd(Cmd *cmd, Reg_int_status is)
@@ -260,11 +346,13 @@ Sdhci<TYPE>::handle_irq_cmd(Cmd *cmd, Reg_int_status is)
             }
         }
       cmd->status = Cmd::Cmd_timeout;
+      cmd->flags.timeout() = 1;
     }
   else if (is.cmd_error())
     {
       is_ack.copy_cmd_error(is);
       cmd->status = Cmd::Cmd_error;
+      cmd->flags.crc_error() = is.cce();
     }
   else if (is.ac12e())
     {
@@ -340,7 +428,10 @@ Sdhci<TYPE>::handle_irq_data(Cmd *cmd, Reg_int_status is)
       else if (is.dce())
         {
           printf("CRC error. Tuning problem?\n");
+          cmd->flags.crc_error() = 1;
         }
+      else if (is.dtoe())
+        cmd->flags.timeout() = 1;
     }
   else if (is.tc())
     {
@@ -358,10 +449,26 @@ Sdhci<TYPE>::handle_irq_data(Cmd *cmd, Reg_int_status is)
             L4Re::throw_error(-L4_EINVAL,
                               "Implement aborted transfer in ADMA2 mode");
           is_ack.write(this);
-          l4_uint32_t blks_xferred = cmd->blockcnt - blks_to_xfer;
-          l4_uint32_t data_xferred = blks_xferred * cmd->blocksize;
-          cmd->blockcnt  -= blks_xferred;
-          cmd->data_phys += data_xferred;
+          cmd->blockcnt = blks_to_xfer;
+          // The DMA engine stopped at the next buffer boundary. If this is the
+          // end of the current segment, continue with the next segment.
+          cmd->data_phys = (cmd->data_phys & ~(_sdma_bndry - 1)) + _sdma_bndry;
+          if (auto const *b = cmd->sdma_block)
+            {
+              l4_uint64_t end = b->dma_addr
+                                + l4_uint64_t{b->num_sectors} * cmd->blocksize;
+              if (cmd->data_phys == end)
+                {
+                  do
+                    b = b->next.get();
+                  while (b && b->num_sectors == 0);
+                  if (!b)
+                    L4Re::throw_error(-L4_EINVAL, "SDMA beyond last segment");
+                  cmd->sdma_block = b;
+                  cmd->data_phys = b->dma_addr;
+                  trace2.printf("SDMA: next segment at %08x\n", cmd->data_phys);
+                }
+            }
           if (TYPE == Sdhci_type::Usdhc)
             for (;;)
               if (!Reg_pres_state(this).dla())
@@ -482,23 +589,21 @@ Sdhci<TYPE>::cmd_submit_prepare_dma(Cmd *cmd,
         }
 
       if (dma_adma2())
-        {
-          // `cmd` refers to a list of blocks (cmd->blocks != nullptr).
-          if (cmd->blocks)
-            adma2_set_descs_blocks(cmd);
-          else
-            adma2_set_descs_memory_region(cmd->data_phys, cmd->blocksize);
-          dma_addr = _adma2_desc_phys;
-        }
+        dma_addr = adma2_setup(cmd);
       else
         {
-          // `cmd` refers either to a single block (cmd->blocks != nullptr) or
-          // to a region (cmd->data_phys / cmd->blocksize set).
+          // `cmd` refers either to a list of blocks (inout command) or to a
+          // region (cmd->data_phys / cmd->blocksize set). A region command of
+          // an inout sequence retains its blocks, see Cmd::reinit_region().
+          // Several blocks are only transferred together if all are
+          // DMA-accessible.
           l4_size_t blk_size = cmd->blocksize * cmd->blockcnt;
-          if (cmd->blocks) // this implies cmd->inout() == true
+          cmd->sdma_block = nullptr;
+          if (cmd->flags.inout() && cmd->blocks)
             {
+              l4_size_t seg_size = cmd->blocksize * cmd->blocks->num_sectors;
               if (provided_bounce_buffer()
-                  && !dma_accessible(cmd->blocks->dma_addr, blk_size))
+                  && !dma_accessible(cmd->blocks->dma_addr, seg_size))
                 {
                   if (cmd->flags.inout_read())
                     {
@@ -513,7 +618,10 @@ Sdhci<TYPE>::cmd_submit_prepare_dma(Cmd *cmd,
                   dma_addr = cmd->data_phys = _bb_phys;
                 }
               else
-                dma_addr = cmd->data_phys = cmd->blocks->dma_addr;
+                {
+                  dma_addr = cmd->data_phys = cmd->blocks->dma_addr;
+                  cmd->sdma_block = cmd->blocks;
+                }
             }
           else
             dma_addr = cmd->data_phys;
@@ -697,17 +805,57 @@ Sdhci<TYPE>::cmd_submit_set_block_size_and_count(Cmd const *cmd)
   else
     {
       Reg_blk_size bs;
-      bs.blkcnt() = cmd->blockcnt;
-      if (bs.blkcnt() != cmd->blockcnt)
-        L4Re::throw_error(-L4_EINVAL, "Number of data blocks to transfer");
+      if (_v4_10)
+        // The 32-bit register is used if the 16-bit block count is 0.
+        Reg_blk_cnt32(cmd->blockcnt).write(this);
+      else
+        {
+          bs.blkcnt() = cmd->blockcnt;
+          if (bs.blkcnt() != cmd->blockcnt)
+            L4Re::throw_error(-L4_EINVAL, "Number of data blocks to transfer");
+        }
       bs.blksize() = cmd->blocksize;
       if (bs.blksize() != cmd->blocksize)
         L4Re::throw_error(-L4_EINVAL, "Size of data blocks to transfer");
-      bs.sdma_buf_bndry() = Reg_blk_size::Bndry_512k; // only for SDMA
+      if (!dma_adma2())
+        {
+          bs.sdma_buf_bndry() = sdma_boundary(cmd);
+          _sdma_bndry = Sdma_bndry_min << bs.sdma_buf_bndry();
+        }
       bs.write(this);
     }
 }
 
+/**
+ * Return the largest SDMA buffer boundary at which all but the last segment of
+ * `cmd` end. The controller stops at each boundary with a DMA interrupt and
+ * handle_irq_data() continues the transfer with the next segment. Segments not
+ * ending at the minimum boundary are never transferred together, see
+ * sdma_seg_align().
+ */
+template <Sdhci_type TYPE>
+unsigned
+Sdhci<TYPE>::sdma_boundary(Cmd const *cmd) const
+{
+  unsigned bndry = Reg_blk_size::Bndry_512k;
+  if (!cmd->sdma_block)
+    return bndry;
+
+  l4_uint32_t left = cmd->blockcnt;
+  for (auto const *b = cmd->sdma_block; b && b->num_sectors < left;
+       b = b->next.get())
+    {
+      if (!b->num_sectors)
+        continue;
+      left -= b->num_sectors;
+      l4_uint64_t end = b->dma_addr + l4_uint64_t{b->num_sectors} * cmd->blocksize;
+      while (bndry > Reg_blk_size::Bndry_4k
+             && (end & ((Sdma_bndry_min << bndry) - 1)))
+        --bndry;
+    }
+  return bndry;
+}
+
 /**
  * Send an MMC command to the controller.
  */
@@ -718,26 +866,11 @@ Sdhci<TYPE>::cmd_submit(Cmd *cmd)
   if (cmd->status != Cmd::Ready_for_submit)
     L4Re::throw_error(-L4_EINVAL, "Invalid command submit status");
 
-  Reg_cmd_xfr_typ xt;  // SDHCI + uSDHC
+  Reg_cmd_xfr_typ xt(xfr_typ_cmd(cmd->cmd)); // SDHCI + uSDHC
   Reg_mix_ctrl mc;     // uSDHC
 
   if (TYPE == Sdhci_type::Usdhc)
-    mc.read(this);
-
-  xt.cmdinx() = cmd->cmd_idx();
-  xt.cccen() = !!(cmd->cmd & Mmc::Rsp_check_crc);
-  xt.cicen() = !!(cmd->cmd & Mmc::Rsp_has_opcode);
-  if (cmd->cmd & Mmc::Rsp_136_bits)
-    xt.rsptyp() = Reg_cmd_xfr_typ::Resp::Length_136;
-  else if (cmd->cmd & Mmc::Rsp_check_busy)
-    xt.rsptyp() = Reg_cmd_xfr_typ::Resp::Length_48_check_busy;
-  else if (cmd->cmd & Mmc::Rsp_present)
-    xt.rsptyp() = Reg_cmd_xfr_typ::Resp::Length_48;
-  else
-    xt.rsptyp() = Reg_cmd_xfr_typ::Resp::No;
-  if (   cmd->cmd == Mmc::Cmd12_stop_transmission_rd
-      || cmd->cmd == Mmc::Cmd12_stop_transmission_wr)
-    xt.cmdtyp() = Reg_cmd_xfr_typ::Cmd52_abort;
+    mc.read(this); // usually from the shadow copy
 
   Dma_addr dma_addr = cmd_submit_prepare_dma(cmd, xt, mc);
 
@@ -745,13 +878,20 @@ Sdhci<TYPE>::cmd_submit(Cmd *cmd)
       || cmd->cmd == Mmc::Cmd21_send_tuning_block)
     cmd_submit_handle_tuning(cmd, xt, mc);
 
-  if (dma_addr != ~0ULL)
+  // With ADMA3, the controller fetches the registers from the descriptors.
+  bool adma3 = _adma3 && dma_addr != ~0ULL && cmd->flags.auto_cmd23();
+  if (adma3)
+    xt.ac23en() = 1;
+  else
     {
-      cmd_submit_set_dma_addr(cmd, dma_addr + _dma_offset, xt, mc);
-      cmd_submit_set_block_size_and_count(cmd);
-    }
+      if (dma_addr != ~0ULL)
+        {
+          cmd_submit_set_dma_addr(cmd, dma_addr + _dma_offset, xt, mc);
+          cmd_submit_set_block_size_and_count(cmd);
+        }
 
-  Reg_cmd_arg(cmd->arg).write(this);
+      Reg_cmd_arg(cmd->arg).write(this);
+    }
 
   Reg_int_status(~0U).write(this); // clear all IRQs
   Reg_int_status_en se;
@@ -783,11 +923,46 @@ Sdhci<TYPE>::cmd_submit(Cmd *cmd)
   if (TYPE == Sdhci_type::Usdhc)
     mc.write(this);
 
-  xt.write(this);
+  if (adma3)
+    adma3_submit(cmd, xt);
+  else
+    xt.write(this);
 
   cmd->status = Cmd::Progress_cmd;
 }
 
+/**
+ * Set up the ADMA2 descriptors of a queued inout command while the controller
+ * is still busy with the current command. Submitting the command later only
+ * requires to program the ADMA2 address.
+ *
+ * Commands using the bounce buffer are set up during submission because the
+ * current command might still use the bounce buffer.
+ */
+template <Sdhci_type TYPE>
+void
+Sdhci<TYPE>::cmd_prepare(Cmd *cmd)
+{
+  if (!dma_adma2() || provided_bounce_buffer()
+      || cmd->status != Cmd::Ready_for_submit
+      || !cmd->flags.inout() || !cmd->blocks || cmd->flags.descs_prepared())
+    return;
+
+  int slot = adma2_slot_alloc(cmd);
+  if (slot < 0)
+    return;
+
+  try
+    {
+      adma2_set_descs_blocks(slot, cmd);
+      cmd->flags.descs_prepared() = 1;
+    }
+  catch (L4::Runtime_error const &)
+    {
+      // Retry during submission to report the error for this command.
+    }
+}
+
 /**
  * Wait for completion of command send phase.
  */
@@ -828,6 +1003,7 @@ Sdhci<TYPE>::cmd_wait_data_finished(Cmd *cmd)
       _receive_irq(true);
       handle_irq_data(cmd, Reg_int_status(this));
     }
+  cmd->flags.descs_prepared() = 0;
   time = Util::read_tsc() - time;
   _time_sleep += time;
   l4_uint64_t us = Util::tsc_to_us(time);
@@ -864,10 +1040,11 @@ Sdhci<TYPE>::cmd_fetch_response(Cmd *cmd)
 
   if (cmd->flags.read_from_bounce_buffer()
       && (   cmd->cmd == Mmc::Cmd17_read_single_block
-          || cmd->cmd == Mmc::Cmd18_read_multiple_block))
+          || cmd->cmd == Mmc::Cmd18_read_multiple_block
+          || cmd->cmd == Mmc::Cmd46_execute_read_task))
     {
       l4_uint32_t offset = 0;
-      for (auto const *b = cmd->blocks; b; b = b->next.get())
+      cmd->for_each_block([&](Cmd::Block const *b)
         {
           l4_uint32_t b_size = b->num_sectors << 9;
           if (!dma_accessible(b->dma_addr, b_size))
@@ -876,7 +1053,7 @@ Sdhci<TYPE>::cmd_fetch_response(Cmd *cmd)
               memcpy(b->virt_addr, (void *)(_bb_virt + offset), b_size);
               offset += b_size;
             }
-        }
+        });
     }
 }
 
@@ -1292,6 +1469,8 @@ Sdhci<TYPE>::tuning_finished(bool *success)
 {
   if (TYPE == Sdhci_type::Usdhc)
     {
+      // Tuning may update the tuning bits of Reg_mix_ctrl.
+      shadow_invalidate();
       Reg_autocmd12_err_status es(this);
       if (es.execute_tuning())
         return false;
@@ -1310,6 +1489,53 @@ Sdhci<TYPE>::tuning_finished(bool *success)
     }
 }
 
+/**
+ * With standard tuning, the uSDHC reports the number of delay cells selected
+ * by tuning in CLK_TUNE_CTRL_STATUS. Other controllers don't expose the
+ * sampling point.
+ */
+template <Sdhci_type TYPE>
+bool
+Sdhci<TYPE>::tuning_point(l4_uint32_t *point) const
+{
+  if (TYPE != Sdhci_type::Usdhc || !Usdhc_std_tuning)
+    return false;
+
+  if (!Reg_autocmd12_err_status(this).smp_clk_sel())
+    return false;
+
+  *point = Reg_clk_tune_ctrl_status(this).tap_sel_pre();
+  return true;
+}
+
+/**
+ * Select the delay cells manually and sample with the tuned clock. Auto
+ * tuning is enabled afterwards by enable_auto_tuning() as after tuning.
+ */
+template <Sdhci_type TYPE>
+bool
+Sdhci<TYPE>::set_tuning_point(l4_uint32_t point)
+{
+  if (TYPE != Sdhci_type::Usdhc || !Usdhc_std_tuning)
+    return false;
+
+  reset_tuning();
+
+  Reg_mix_ctrl mc(this);
+  mc.fbclk_sel() = 1;
+  mc.write(this);
+
+  Reg_clk_tune_ctrl_status ts(this);
+  ts.dly_cell_set_pre() = point;
+  ts.write(this);
+
+  Reg_autocmd12_err_status es(this);
+  es.execute_tuning() = 0;
+  es.smp_clk_sel() = 1;
+  es.write(this);
+  return true;
+}
+
 template <Sdhci_type TYPE>
 Mmc::Reg_ocr
 Sdhci<TYPE>::supported_voltage() const
@@ -1388,6 +1614,7 @@ Sdhci<TYPE>::dump() const
  * client memory or bounce buffer).
  *
  * \param desc       First descriptor to be written.
+ * \param descs_end  End of the descriptor list.
  * \param phys       Physical address of memory region for DMA.
  * \param size       Size of the memory region for DMA.
  * \param terminate  True for writing the final descriptor.
@@ -1398,13 +1625,14 @@ Sdhci<TYPE>::dump() const
 template <Sdhci_type TYPE>
 template <typename T>
 T*
-Sdhci<TYPE>::adma2_set_descs_mem_region(T *desc, l4_uint64_t phys,
-                                        l4_uint32_t size, bool terminate)
+Sdhci<TYPE>::adma2_set_descs_mem_region(T *desc, T const *descs_end,
+                                        l4_uint64_t phys, l4_uint32_t size,
+                                        bool terminate)
 {
   for (; size; ++desc)
     {
       trace2.printf("  addr=%08llx size=%08x\n", phys, size);
-      if (desc >= (T*)_adma2_desc + _adma2_desc_mem.size() / sizeof(T))
+      if (desc >= descs_end)
         L4Re::throw_error(-L4_EINVAL, "Too many ADMA2 descriptors");
       if (phys >= T::get_max_addr())
         L4Re::throw_error_fmt(
@@ -1414,9 +1642,8 @@ Sdhci<TYPE>::adma2_set_descs_mem_region(T *desc, l4_uint64_t phys,
       desc->reset();
       desc->valid() = 1;
       desc->act() = T::Act_tran;
-      // XXX SD spec also defines 26-bit data length mode
-      l4_uint32_t desc_length = cxx::min<l4_uint32_t>(size, T::max_length);
-      desc->length() = desc_length;
+      l4_uint32_t desc_length = cxx::min<l4_uint32_t>(size, adma2_max_length());
+      desc->set_length(desc_length);
       desc->set_addr(phys + _dma_offset);
       phys += desc_length;
       size -= desc_length;
@@ -1436,14 +1663,14 @@ Sdhci<TYPE>::adma2_set_descs_mem_region(T *desc, l4_uint64_t phys,
 template <Sdhci_type TYPE>
 template <typename T>
 void
-Sdhci<TYPE>::adma2_set_descs(T *descs, Cmd *cmd)
+Sdhci<TYPE>::adma2_set_descs(T *descs, T const *descs_end, Cmd *cmd)
 {
   trace2.printf("adma2_set_descs @ %08lx:\n", (l4_addr_t)descs);
 
   l4_uint32_t bb_offs = 0;
   auto *d = descs;
 
-  for (auto const *b = cmd->blocks; b; b = b->next.get())
+  cmd->for_each_block([&](Cmd::Block const *b)
     {
       l4_uint64_t b_addr = b->dma_addr;
       l4_uint32_t b_size = b->num_sectors << 9;
@@ -1461,8 +1688,12 @@ Sdhci<TYPE>::adma2_set_descs(T *descs, Cmd *cmd)
           bb_offs += b_size;
         }
 
-      d = adma2_set_descs_mem_region(d, b_addr, b_size, !b->next.get());
-    }
+      d = adma2_set_descs_mem_region(d, descs_end, b_addr, b_size, false);
+    });
+
+  // The last block of the last (merged) request terminates the list.
+  if (d != descs)
+    (d - 1)->end() = 1;
 
   if (bb_offs > 0)                      // bounce buffer used
     if (cmd->flags.inout_read())        // read command
@@ -1477,12 +1708,14 @@ Sdhci<TYPE>::adma2_set_descs(T *descs, Cmd *cmd)
  */
 template <Sdhci_type TYPE>
 void
-Sdhci<TYPE>::adma2_set_descs_blocks(Cmd *cmd)
+Sdhci<TYPE>::adma2_set_descs_blocks(unsigned slot, Cmd *cmd)
 {
   if (_adma2_64)
-    adma2_set_descs<Adma2_desc_64>(_adma2_desc, cmd);
+    adma2_set_descs<Adma2_desc_64>(adma2_slot_descs<Adma2_desc_64>(slot),
+                                   adma2_descs_end<Adma2_desc_64>(slot), cmd);
   else
-    adma2_set_descs<Adma2_desc_32>(_adma2_desc, cmd);
+    adma2_set_descs<Adma2_desc_32>(adma2_slot_descs<Adma2_desc_32>(slot),
+                                   adma2_descs_end<Adma2_desc_32>(slot), cmd);
 }
 
 /**
@@ -1490,12 +1723,116 @@ Sdhci<TYPE>::adma2_set_descs_blocks(Cmd *cmd)
  */
 template <Sdhci_type TYPE>
 void
-Sdhci<TYPE>::adma2_set_descs_memory_region(l4_addr_t phys, l4_uint32_t size)
+Sdhci<TYPE>::adma2_set_descs_memory_region(unsigned slot, l4_addr_t phys,
+                                           l4_uint32_t size)
 {
   if (_adma2_64)
-    adma2_set_descs_mem_region<Adma2_desc_64>(_adma2_desc, phys, size);
+    adma2_set_descs_mem_region<Adma2_desc_64>(
+      adma2_slot_descs<Adma2_desc_64>(slot),
+      adma2_descs_end<Adma2_desc_64>(slot), phys, size);
   else
-    adma2_set_descs_mem_region<Adma2_desc_32>(_adma2_desc, phys, size);
+    adma2_set_descs_mem_region<Adma2_desc_32>(
+      adma2_slot_descs<Adma2_desc_32>(slot),
+      adma2_descs_end<Adma2_desc_32>(slot), phys, size);
+}
+
+template <Sdhci_type TYPE>
+int
+Sdhci<TYPE>::adma2_slot_find(Cmd const *cmd) const
+{
+  for (unsigned slot = 0; slot < Adma2_slots; ++slot)
+    if (_adma2_slot_owner[slot] == cmd && adma2_slot_busy(slot))
+      return slot;
+  return -1;
+}
+
+template <Sdhci_type TYPE>
+int
+Sdhci<TYPE>::adma2_slot_alloc(Cmd *cmd)
+{
+  for (unsigned slot = 0; slot < Adma2_slots; ++slot)
+    if (!adma2_slot_busy(slot))
+      {
+        _adma2_slot_owner[slot] = cmd;
+        return slot;
+      }
+  return -1;
+}
+
+/**
+ * Return the address of the ADMA2 descriptor list for `cmd`. Set up the
+ * descriptors unless this was already done by cmd_prepare().
+ */
+template <Sdhci_type TYPE>
+Dma_addr
+Sdhci<TYPE>::adma2_setup(Cmd *cmd)
+{
+  int slot = adma2_slot_find(cmd);
+  if (slot < 0)
+    {
+      slot = adma2_slot_alloc(cmd);
+      if (slot < 0)
+        L4Re::throw_error(-L4_EBUSY, "No free ADMA2 descriptor list");
+      // An inout command refers to a list of blocks (cmd->blocks != nullptr).
+      if (cmd->flags.inout())
+        adma2_set_descs_blocks(slot, cmd);
+      else
+        adma2_set_descs_memory_region(slot, cmd->data_phys, cmd->blocksize);
+      cmd->flags.descs_prepared() = 1;
+    }
+  else
+    trace2.printf("Using prepared ADMA2 descriptors (slot %d).\n", slot);
+
+  _adma2_slot = slot;
+  return _adma2_desc_phys + adma2_slot_offset(slot);
+}
+
+/**
+ * Start the current inout command using ADMA3. The four command descriptors
+ * set the 32-bit block count, the block size, the argument and finally the
+ * transfer mode / command which triggers the command (preceded by Auto CMD23).
+ * Afterwards, the controller continues with the ADMA2 descriptors prepared by
+ * adma2_setup(). Only the address of the integrated descriptor is written.
+ */
+template <Sdhci_type TYPE>
+void
+Sdhci<TYPE>::adma3_submit(Cmd const *cmd, Reg_cmd_xfr_typ const &xt)
+{
+  Reg_blk_size bs;
+  bs.blksize() = cmd->blocksize;
+  if (bs.blksize() != cmd->blocksize)
+    L4Re::throw_error(-L4_EINVAL, "Size of data blocks to transfer");
+
+  enum { Num_cmd_descs = 4 };
+  static_assert(Adma3_cmd_descs_offset + Num_cmd_descs * sizeof(Adma2_desc_32)
+                == Adma3_descs_size,
+                "ADMA2 descriptors must follow the command descriptors");
+  l4_uint32_t const regs[Num_cmd_descs] =
+    { cmd->blockcnt, bs.raw, cmd->arg, xt.raw };
+  l4_size_t offs = _adma2_slot * adma2_slot_size();
+  auto *cd = _adma2_desc_mem.get<Adma2_desc_32>(offs + Adma3_cmd_descs_offset);
+  for (unsigned i = 0; i < Num_cmd_descs; ++i)
+    {
+      cd[i].reset();
+      cd[i].valid() = 1;
+      cd[i].end() = i == Num_cmd_descs - 1;
+      cd[i].act() = Adma2_desc_32::Act_cmd;
+      cxx::write_now(&cd[i].word1, regs[i]);
+    }
+
+  // ADMA3 implies host version 4 mode with 64-bit addressing.
+  auto *id = _adma2_desc_mem.get<Adma2_desc_64>(offs);
+  id->reset();
+  id->valid() = 1;
+  id->end() = 1;
+  id->act() = Adma2_desc_64::Act_integrated;
+  id->set_addr(_adma2_desc_phys + offs + Adma3_cmd_descs_offset + _dma_offset);
+
+  Dma_addr id_phys = _adma2_desc_phys + offs + _dma_offset;
+  trace2.printf("ADMA3: integrated descriptor at %08llx, blocks=%u\n",
+                id_phys, cmd->blockcnt);
+  Reg_adma3_id_addr_lo(id_phys & 0xffffffff).write(this);
+  Reg_adma3_id_addr_hi(id_phys >> 32).write(this);
 }
 
 template <Sdhci_type TYPE>
@@ -1510,7 +1847,7 @@ Sdhci<TYPE>::adma2_dump_descs(T const *desc) const
                               - reinterpret_cast<l4_addr_t>(_adma2_desc)
                               + _dma_offset,
              desc->word1, desc->word0, desc->get_addr(),
-             l4_uint32_t{desc->length()}, desc->valid().get(),
+             desc->get_length(), desc->valid().get(),
              desc->end().get());
       if (desc->end())
         break;
@@ -1521,13 +1858,303 @@ template <Sdhci_type TYPE>
 void
 Sdhci<TYPE>::adma2_dump_descs() const
 {
+  l4_size_t offs = adma2_slot_offset(_adma2_slot);
   printf("ADMA descriptors (%d-bit) at phys=%08llx / virt=%08lx\n",
-         _adma2_64 ? 64 : 32, _adma2_desc_phys + _dma_offset,
-         reinterpret_cast<l4_addr_t>(_adma2_desc));
+         _adma2_64 ? 64 : 32, _adma2_desc_phys + offs + _dma_offset,
+         reinterpret_cast<l4_addr_t>(_adma2_desc) + offs);
+  if (_adma2_64)
+    adma2_dump_descs<Adma2_desc_64>(adma2_slot_descs<Adma2_desc_64>(_adma2_slot));
+  else
+    adma2_dump_descs<Adma2_desc_32>(adma2_slot_descs<Adma2_desc_32>(_adma2_slot));
+}
+
+template <Sdhci_type TYPE>
+bool
+Sdhci<TYPE>::cqe_available() const
+{
+  // So far, only the uSDHC variant is known to provide a CQE at offset `Cqe`.
+  // The CQE transfers data using ADMA2.
+  if (TYPE != Sdhci_type::Usdhc || !dma_adma2())
+    return false;
+
+  auto ver = cqe_read<Cqe::Reg_cqver>();
+  return ver.raw != 0 && ver.raw != ~0U;
+}
+
+template <Sdhci_type TYPE>
+void
+Sdhci<TYPE>::cqe_enable_ints()
+{
+  Reg_int_status(~0U).write(this); // clear all IRQs
+  Reg_int_status_en se;
+  se.enable_cqe_ints();
+  se.write(this);
+  Reg_int_signal_en ie;
+  ie.enable_cqe_ints();
+  ie.write(this);
+}
+
+/**
+ * Enable the command queue engine.
+ *
+ * The task descriptor list contains one slot per task. Each slot consists of
+ * the task descriptor followed by a link descriptor pointing to the ADMA2
+ * descriptor list of that task. Therefore all tasks can be prepared
+ * independently.
+ */
+template <Sdhci_type TYPE>
+void
+Sdhci<TYPE>::cqe_enable(unsigned depth, l4_uint16_t rca)
+{
+  if (!_cqe_desc_mem)
+    {
+      l4_size_t size = Cqe_descs_offset
+                       + L4::round_page(Cqe::Max_tasks * cqe_descs_size());
+      _cqe_desc_mem = std::make_unique<Inout_buffer>(
+                        "sdhci_cqe_buf", size, _dma,
+                        L4Re::Dma_space::Direction::To_device,
+                        L4Re::Rm::F::Cache_uncached);
+      if (!dma_accessible(_cqe_desc_mem->pget(), _cqe_desc_mem->size()))
+        L4Re::throw_error_fmt(-L4_EINVAL,
+                              "CQE descriptors at %08llx-%08llx not accessible by DMA",
+                              _cqe_desc_mem->pget(),
+                              _cqe_desc_mem->pget() + _cqe_desc_mem->size());
+      info.printf("Using %s of memory for CQE descriptors.\n",
+                  Util::readable_size(_cqe_desc_mem->size()).c_str());
+    }
+
+  // Transfers are always multi-block transfers using DMA. The CQE issues
+  // CMD44/CMD45 itself so disable Auto CMD12/CMD23.
+  Reg_mix_ctrl mc(this);
+  mc.dmaen() = 1;
+  mc.bcen() = 1;
+  mc.msbsel() = 1;
+  mc.ac12en() = 0;
+  mc.ac23en() = 0;
+  mc.write(this);
+
+  Reg_blk_att ba;
+  ba.blksize() = 512;
+  ba.write(this);
+
+  // Configure while the CQE is disabled.
+  Cqe::Reg_cqcfg cfg;
+  cfg.task_desc_size() = _adma2_64;
+  cqe_write(cfg);
+
+  Dma_addr phys = _cqe_desc_mem->pget() + _dma_offset;
+  cqe_write(Cqe::Reg_cqtdlba(phys & 0xffffffff));
+  cqe_write(Cqe::Reg_cqtdlbau(phys >> 32));
+
+  Cqe::Reg_cqssc2 ssc2;
+  ssc2.rca() = rca;
+  cqe_write(ssc2);
+
+  // Interrupt coalescing is configured by cqe_set_coalescing().
+  cqe_write(Cqe::Reg_cqic());
+  _cqe_timer_khz = cqe_read<Cqe::Reg_cqcap>().timer_khz();
+
+  Cqe::Reg_cqiste iste;
+  iste.enable_all();
+  cqe_write(iste);
+  Cqe::Reg_cqisge isge;
+  isge.enable_all();
+  cqe_write(isge);
+
+  cfg.cqe_en() = 1;
+  cqe_write(cfg);
+
+  cqe_enable_ints();
+
+  auto ver = cqe_read<Cqe::Reg_cqver>();
+  info.printf("Command queue engine %u.%u%u enabled, %u tasks.\n",
+              ver.ver_major().get(), ver.ver_minor().get(),
+              ver.ver_suffix().get(), depth);
+}
+
+template <Sdhci_type TYPE>
+void
+Sdhci<TYPE>::cqe_disable()
+{
+  Cqe::Reg_cqcfg cfg = cqe_read<Cqe::Reg_cqcfg>();
+  cfg.cqe_en() = 0;
+  cqe_write(cfg);
+}
+
+/**
+ * Halt the command queue engine or resume it.
+ *
+ * While the CQE is halted, legacy commands (for example CMD6) can be sent to
+ * the device using the normal command interface. The interrupt enable masks
+ * are modified by legacy commands so restore them when resuming.
+ */
+template <Sdhci_type TYPE>
+void
+Sdhci<TYPE>::cqe_halt(bool halt)
+{
+  Cqe::Reg_cqctl ctl;
+  ctl.halt() = halt;
+  cqe_write(ctl);
+  if (halt)
+    {
+      Util::poll(10000, [this] { return !!cqe_read<Cqe::Reg_cqctl>().halt(); },
+                 "CQE halt");
+      Cqe::Reg_cqis is;
+      is.hac() = 1;
+      cqe_write(is);
+    }
+  else
+    cqe_enable_ints();
+}
+
+template <Sdhci_type TYPE>
+void
+Sdhci<TYPE>::cqe_set_coalescing(unsigned count, unsigned timeout_us)
+{
+  Cqe::Reg_cqic ic;
+  ic.icen() = 1;
+  ic.icctthwen() = 1;
+  ic.icctth() = cxx::min(count, 31U);
+  ic.ictovalwen() = 1;
+  // Timeout in units of 1024 timer clock periods. Without a timer, coalescing
+  // could delay a completion infinitely.
+  l4_uint64_t toval = l4_uint64_t{_cqe_timer_khz} * timeout_us / 1024000;
+  ic.ictoval() = cxx::min<l4_uint64_t>(cxx::max<l4_uint64_t>(toval, 1), 127);
+  if (!_cqe_timer_khz)
+    ic.icctth() = 1;
+  cqe_write(ic);
+  trace.printf("CQE coalescing: %u tasks, %u timer units.\n",
+               ic.icctth().get(), ic.ictoval().get());
+}
+
+template <Sdhci_type TYPE>
+void
+Sdhci<TYPE>::cqe_task_submit(unsigned tag, Cmd *cmd)
+{
+  if (tag >= Cqe::Max_tasks || !_cqe_desc_mem)
+    L4Re::throw_error(-L4_EINVAL, "Invalid CQE task");
+
+  // ADMA2 descriptors of this task.
+  l4_size_t descs_offs = Cqe_descs_offset + tag * cqe_descs_size();
   if (_adma2_64)
-    adma2_dump_descs<Adma2_desc_64>(_adma2_desc);
+    {
+      auto *descs = _cqe_desc_mem->get<Adma2_desc_64>(descs_offs);
+      adma2_set_descs<Adma2_desc_64>(descs, descs + cqe_descs_per_task(), cmd);
+    }
   else
-    adma2_dump_descs<Adma2_desc_32>(_adma2_desc);
+    {
+      auto *descs = _cqe_desc_mem->get<Adma2_desc_32>(descs_offs);
+      adma2_set_descs<Adma2_desc_32>(descs, descs + cqe_descs_per_task(), cmd);
+    }
+
+  Cqe::Task_desc td;
+  td.valid() = 1;
+  td.end() = 1;
+  td.intr() = 0; // subject to interrupt coalescing
+  td.act() = Cqe::Task_desc::Act_task;
+  td.data_dir() = cmd->flags.inout_read();
+  td.rel_write() = cmd->flags.reliable_write();
+  td.blk_count() = cmd->blockcnt;
+  if (td.blk_count() != cmd->blockcnt)
+    L4Re::throw_error(-L4_EINVAL, "Number of data blocks to transfer");
+  td.blk_addr() = cmd->arg;
+
+  auto *slot = _cqe_desc_mem->get<l4_uint32_t>(tag * cqe_slot_size());
+  td.write(slot, _adma2_64);
+
+  // The transfer descriptor of the slot links to the ADMA2 descriptors.
+  Dma_addr descs_phys = _cqe_desc_mem->pget(descs_offs) + _dma_offset;
+  if (_adma2_64)
+    {
+      auto *link = reinterpret_cast<Adma2_desc_64 *>(slot + 4);
+      link->reset();
+      link->valid() = 1;
+      link->act() = Adma2_desc_64::Act_link;
+      link->set_addr(descs_phys);
+    }
+  else
+    {
+      auto *link = reinterpret_cast<Adma2_desc_32 *>(slot + 2);
+      link->reset();
+      link->valid() = 1;
+      link->act() = Adma2_desc_32::Act_link;
+      link->set_addr(descs_phys);
+    }
+
+  trace2.printf("CQE task %u: %s arg=%08x blocks=%u\n",
+                tag, cmd->flags.inout_read() ? "read" : "write",
+                cmd->arg, cmd->blockcnt);
+
+  cmd->status = Cmd::Progress_data;
+  cqe_write(Cqe::Reg_cqtdbr(1U << tag));
+}
+
+/**
+ * Handle interrupts while the command queue engine is active.
+ *
+ * On errors, halt the CQE, discard all outstanding tasks and report them as
+ * failed. The device returns to the idle queue state after clearing the tasks.
+ */
+template <Sdhci_type TYPE>
+bool
+Sdhci<TYPE>::cqe_handle_irq(l4_uint32_t *done, l4_uint32_t *failed,
+                            Cmd::Flags *errors)
+{
+  Reg_int_status is(this);
+  bool error = is.cmd_error() || is.ctoe() || is.data_error();
+  if (!is.cqi() && !error)
+    return false;
+
+  auto cqis = cqe_read<Cqe::Reg_cqis>();
+  cqe_write(cqis); // acknowledge
+  is.write(this);  // acknowledge
+
+  if (cqis.tcc())
+    {
+      auto tcn = cqe_read<Cqe::Reg_cqtcn>();
+      cqe_write(tcn); // acknowledge
+      *done |= tcn.raw;
+    }
+
+  if (cqis.red() || error)
+    {
+      auto terri = cqe_read<Cqe::Reg_cqterri>();
+      l4_uint32_t pending = cqe_read<Cqe::Reg_cqtdbr>().raw;
+      warn.printf("CQE error: is=%08x, cqis=%08x, cqterri=%08x, pending=%08x\n",
+                  is.raw, cqis.raw, terri.raw, pending);
+      if (is.admae())
+        printf("ADMA error: status=%08x, ADMA addr=%x'%08x\n",
+               Reg_adma_err_status(this).raw, Reg_adma_sys_addr_hi(this).raw,
+               Reg_adma_sys_addr_lo(this).raw);
+
+      cqe_halt(true);
+      Cqe::Reg_cqctl ctl;
+      ctl.halt() = 1;
+      ctl.clear_all_tasks() = 1;
+      cqe_write(ctl);
+      Util::poll(10000, [this] { return !cqe_read<Cqe::Reg_cqtdbr>().raw; },
+                 "CQE clear all tasks");
+
+      Reg_sys_ctrl sc(this);
+      sc.rstc() = 1;
+      sc.rstd() = 1;
+      sc.write(this);
+      Util::poll(10000, [this]
+                   {
+                     Reg_sys_ctrl sc(this);
+                     return !sc.rstc() && !sc.rstd();
+                   },
+                 "Software reset for CMD/data line");
+
+      cqe_write(Cqe::Reg_cqis(~0U)); // acknowledge
+      cqe_halt(false);
+
+      *failed |= pending & ~*done;
+      errors->crc_error() = is.cce() || is.dce();
+      errors->timeout() = is.ctoe() || is.dtoe();
+    }
+
+  return true;
 }
 
 template <Sdhci_type TYPE>
@@ -1536,6 +2163,7 @@ Sdhci<TYPE>::Reg_write_delay::write_delayed(Sdhci *sdhci, Regs offs, l4_uint32_t
 {
   sdhci->write_delay();
   sdhci->_regs[offs] = val;
+  ++sdhci->_mmio_ops;
   sdhci->update_last_write();
 }
 
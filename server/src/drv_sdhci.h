@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
 
 #include <l4/cxx/bitfield>
@@ -26,6 +27,7 @@
 #include "debug.h"
 #include "drv.h"
 #include "inout_buffer.h"
+#include "queue.h"
 
 class Bcm2835_mbox;
 
@@ -53,6 +55,7 @@ public:
   using Drv<Sdhci<TYPE>>::_dma_limit;
   using Drv<Sdhci<TYPE>>::_cmd_queue;
   using Drv<Sdhci<TYPE>>::_time_sleep;
+  using Drv<Sdhci<TYPE>>::_mmio_ops;
   using Drv<Sdhci<TYPE>>::_bb_virt;
   using Drv<Sdhci<TYPE>>::_bb_phys;
   using Drv<Sdhci<TYPE>>::_bb_size;
@@ -72,7 +75,8 @@ public:
     return Auto_cmd23
            && (   TYPE == Sdhci_type::Usdhc
                || TYPE == Sdhci_type::Iproc
-               || TYPE == Sdhci_type::Bcm2711);
+               || TYPE == Sdhci_type::Bcm2711
+               || _adma3);
   }
 
   bool dma_adma2() const
@@ -81,6 +85,16 @@ public:
   static bool bounce_buffer_if_required()
   { return true; }
 
+  /**
+   * With SDMA, the controller stops at each buffer boundary and the transfer
+   * continues with the next segment, see handle_irq_data(). The boundary of
+   * uSDHC is not configurable.
+   */
+  l4_size_t sdma_seg_align() const
+  {
+    return dma_adma2() || TYPE == Sdhci_type::Usdhc ? 0 : Sdma_bndry_min;
+  }
+
 private:
   enum
   {
@@ -117,10 +131,20 @@ private:
      * This saves the preceding CMD23 for a multi-read/write command and
      * the corresponding interrupt.
      *
-     * Only for uSDHCI and iproc/arasan.
+     * Only for uSDHCI and iproc/arasan. For other SDHCI controllers only
+     * with ADMA3, see Dma_adma3.
      */
     Auto_cmd23 = true,
 
+    /**
+     * On true, use ADMA3 if the controller supports it (SDHCI 4.10).
+     *
+     * The controller fetches block count, block size, argument and command of
+     * an inout request from command descriptors preceding the ADMA2
+     * descriptors and issues CMD23 automatically.
+     */
+    Dma_adma3 = true,
+
     /**
      * On true, do not use DMA during setup for reading certain device
      * registers.
@@ -131,6 +155,7 @@ private:
     No_dma_during_setup = false,
   };
   static_assert(!Auto_cmd23 || Dma_adma2, "Auto_cmd23 depends on Dma_adma2");
+  static_assert(!Dma_adma3 || Auto_cmd23, "Dma_adma3 depends on Auto_cmd23");
 
 private:
   enum
@@ -176,6 +201,8 @@ private:
     Clk_tune_ctrl_status  = 0x68, ///< CLK Tuning Control and Status
     Strobe_dll_ctrl       = 0x70, ///< Strobe DLL control
     Strobe_dll_status     = 0x74, ///< Strobe DLL status
+    Adma3_id_addr_lo      = 0x78, ///< ADMA3 Integrated Descriptor Address (lo)
+    Adma3_id_addr_hi      = 0x7c, ///< ADMA3 Integrated Descriptor Address (hi)
     Vend_spec             = 0xc0, ///< Vendor Specific Register
     Mmc_boot              = 0xc4, ///< MMC Boot
     Vend_spec2            = 0xc8, ///< Vendor Specific 2 Register
@@ -206,31 +233,93 @@ private:
   {
     explicit Reg() : raw(0) {}
     explicit Reg(Sdhci<TYPE> const *sdhci)
-    : raw(sdhci->_regs[offs])
-    {
-      if (Trace_reg_access)
-        fiasco_tbuf_log_3val("read ", offs, raw, 0);
-    }
+    : raw(sdhci->reg_read(offs))
+    {}
     explicit Reg(l4_uint32_t v) : raw(v) {}
     l4_uint32_t read(Sdhci<TYPE> const *sdhci)
     {
-      raw = sdhci->_regs[offs];
-      if (Trace_reg_access)
-        fiasco_tbuf_log_3val("read ", offs, raw, 0);
+      raw = sdhci->reg_read(offs);
       return raw;
     }
     void write(Sdhci<TYPE> *sdhci)
+    { sdhci->reg_write(offs, raw); }
+    l4_uint32_t raw;
+  };
+
+  /**
+   * Copies of registers which are only modified by the driver. Reading such a
+   * register returns the copy, writing an unchanged value is skipped. The
+   * copies are invalidated by software resets.
+   */
+  struct Shadow_regs
+  {
+    /** Return the index of a shadowed register or -1. */
+    static constexpr int idx(Regs offs)
     {
-      if (Trace_reg_access)
-        fiasco_tbuf_log_3val("WRITE", offs, raw, 0);
-      Reg_write_delay::write_delayed(sdhci, offs, raw);
+      switch (offs)
+        {
+        case Int_status_en: return 0;
+        case Int_signal_en: return 1;
+        case Mix_ctrl:      return TYPE == Sdhci_type::Usdhc ? 2 : -1;
+        default:            return -1;
+        }
     }
-    l4_uint32_t raw;
+
+    l4_uint32_t val[3];
+    unsigned valid = 0;                 ///< Bitmap of valid copies.
   };
 
+  /** Read a register, use the shadow copy if available. */
+  l4_uint32_t reg_read(Regs offs) const
+  {
+    int i = Shadow_regs::idx(offs);
+    if (i >= 0 && (_shadow.valid & (1U << i)))
+      return _shadow.val[i];
+
+    l4_uint32_t val = _regs[offs];
+    ++_mmio_ops;
+    if (Trace_reg_access)
+      fiasco_tbuf_log_3val("read ", offs, val, 0);
+    if (i >= 0)
+      {
+        _shadow.val[i] = val;
+        _shadow.valid |= 1U << i;
+      }
+    return val;
+  }
+
+  /** Write a register unless the shadow copy shows that it is unchanged. */
+  void reg_write(Regs offs, l4_uint32_t val)
+  {
+    int i = Shadow_regs::idx(offs);
+    if (i >= 0)
+      {
+        if ((_shadow.valid & (1U << i)) && _shadow.val[i] == val)
+          return;
+        _shadow.val[i] = val;
+        _shadow.valid |= 1U << i;
+      }
+    else if (offs == Sys_ctrl)
+      {
+        Reg_sys_ctrl sc(val);
+        if (sc.rsta() || sc.rstc() || sc.rstd())
+          shadow_invalidate();
+      }
+
+    if (Trace_reg_access)
+      fiasco_tbuf_log_3val("WRITE", offs, val, 0);
+    Reg_write_delay::write_delayed(this, offs, val);
+  }
+
+  /** Re-read all shadowed registers on next access. */
+  void shadow_invalidate()
+  { _shadow.valid = 0; }
+
   /// 0x00: DMA System Address
   struct Reg_ds_addr : public Reg<Ds_addr> { using Reg<Ds_addr>::Reg; };
   struct Reg_cmd_arg2 : public Reg<Ds_addr> { using Reg<Ds_addr>::Reg; };
+  /// 0x00: SDHCI 4.10 in host version 4 mode: 32-bit Block Count
+  struct Reg_blk_cnt32 : public Reg<Ds_addr> { using Reg<Ds_addr>::Reg; };
 
   /// 0x04: uSDHC: Block Attributes
   struct Reg_blk_att : public Reg<Blk_att>
@@ -321,6 +410,53 @@ private:
     // <<< SDHCI
   };
 
+  /**
+   * Response related bits of Reg_cmd_xfr_typ (cccen, cicen, rsptyp) for the
+   * `Mmc::Rsp_*` bits of a command.
+   */
+  static constexpr l4_uint32_t xfr_typ_rsp(l4_uint32_t rsp)
+  {
+    l4_uint32_t rsptyp = (rsp & Mmc::Rsp_136_bits)
+                         ? Reg_cmd_xfr_typ::Resp::Length_136
+                         : (rsp & Mmc::Rsp_check_busy)
+                         ? Reg_cmd_xfr_typ::Resp::Length_48_check_busy
+                         : (rsp & Mmc::Rsp_present)
+                         ? Reg_cmd_xfr_typ::Resp::Length_48
+                         : Reg_cmd_xfr_typ::Resp::No;
+    return rsptyp << 16
+           | ((rsp & Mmc::Rsp_check_crc) ? 1U << 19 : 0)
+           | ((rsp & Mmc::Rsp_has_opcode) ? 1U << 20 : 0);
+  }
+
+  /// Reg_cmd_xfr_typ encodings indexed by the `Mmc::Rsp_*` bits of a command.
+  struct Xfr_typ_table
+  {
+    enum { Shift = 8, Entries = (Mmc::Rsp_mask >> Shift) + 1 };
+
+    constexpr Xfr_typ_table() : rsp()
+    {
+      for (unsigned i = 0; i < Entries; ++i)
+        rsp[i] = xfr_typ_rsp(i << Shift);
+    }
+
+    l4_uint32_t rsp[Entries];
+  };
+
+  /**
+   * Command dependent part of Reg_cmd_xfr_typ for `cmd` (Mmc::Cmd*): command
+   * index, command type and response bits.
+   */
+  static l4_uint32_t xfr_typ_cmd(l4_uint32_t cmd)
+  {
+    static constexpr Xfr_typ_table table;
+    l4_uint32_t v = (cmd & Mmc::Idx_mask) << 24
+                    | table.rsp[(cmd & Mmc::Rsp_mask) >> Xfr_typ_table::Shift];
+    if (   cmd == Mmc::Cmd12_stop_transmission_rd
+        || cmd == Mmc::Cmd12_stop_transmission_wr)
+      v |= Reg_cmd_xfr_typ::Cmd52_abort << 22;
+    return v;
+  }
+
   /// 0x10 .. 0x1c: Command response words
   struct Reg_cmd_rsp0 : public Reg<Cmd_rsp0> { using Reg<Cmd_rsp0>::Reg; };
   struct Reg_cmd_rsp1 : public Reg<Cmd_rsp1> { using Reg<Cmd_rsp1>::Reg; };
@@ -353,6 +489,7 @@ private:
     // >>> SDHCI
     CXX_BITFIELD_MEMBER(28, 28, scs, raw);   ///< Sub command status
     CXX_BITFIELD_MEMBER(25, 25, hrvs, raw);  ///< Host regulator voltage stable
+    CXX_BITFIELD_MEMBER(3, 3, rtr_sdhci, raw); ///< Re-tuning request
     // <<< SDHCI
     CXX_BITFIELD_MEMBER(24, 24, clsl, raw);  ///< CMD line signal level
     CXX_BITFIELD_MEMBER(20, 23, datlsl, raw);  ///< DAT line signal level
@@ -690,6 +827,21 @@ private:
       brrsen()   =    cmd->cmd == Mmc::Cmd19_send_tuning_block
                    || cmd->cmd == Mmc::Cmd21_send_tuning_block;
     }
+
+    /** Interrupts required while the command queue engine is active. */
+    void enable_cqe_ints()
+    {
+      cqisen()   = 1;
+      ctoesen()  = 1;
+      ccesen()   = 1;
+      cebesen()  = 1;
+      ciesen()   = 1;
+      dtoesen()  = 1;
+      dcesen()   = 1;
+      debesen()  = 1;
+      admaesen() = 1;
+      dmaesen()  = 1;
+    }
   };
 
   /// 0x38: Interrupt Signal Enable (IE)
@@ -748,6 +900,21 @@ private:
       brrien()   =    cmd->cmd == Mmc::Cmd19_send_tuning_block
                    || cmd->cmd == Mmc::Cmd21_send_tuning_block;
     }
+
+    /** Interrupts required while the command queue engine is active. */
+    void enable_cqe_ints()
+    {
+      cqiien()   = 1;
+      ctoeien()  = 1;
+      cceien()   = 1;
+      cebeien()  = 1;
+      cieien()   = 1;
+      dtoeien()  = 1;
+      dceien()   = 1;
+      debeien()  = 1;
+      admaeien() = 1;
+      dmaeien()  = 1;
+    }
   };
 
   /// 0x3c: Auto CMD12 Error Status (uSDHC)
@@ -894,7 +1061,7 @@ private:
     using Reg<Cap2_sdhci>::raw;
 
     CXX_BITFIELD_MEMBER(28, 28, vdd2_18_support, raw);
-    CXX_BITFIELD_MEMBER(27, 27, adma2_support, raw);
+    CXX_BITFIELD_MEMBER(27, 27, adma3_support, raw); ///< SDHCI 4.10
     CXX_BITFIELD_MEMBER(16, 23, clock_mult, raw);
     CXX_BITFIELD_MEMBER(14, 15, retune_modes, raw);
     enum
@@ -987,6 +1154,13 @@ private:
   struct Reg_adma_sys_addr_hi : public Reg<Adma_sys_addr_hi>
   { using Reg<Adma_sys_addr_hi>::Reg; };
 
+  /// 0x78: ADMA3 Integrated Descriptor Address (64-bit). Writing the upper
+  /// half starts ADMA3.
+  struct Reg_adma3_id_addr_lo : public Reg<Adma3_id_addr_lo>
+  { using Reg<Adma3_id_addr_lo>::Reg; };
+  struct Reg_adma3_id_addr_hi : public Reg<Adma3_id_addr_hi>
+  { using Reg<Adma3_id_addr_hi>::Reg; };
+
   /// 0x60: DLL (Delay Line) Control
   struct Reg_dll_ctrl : public Reg<Dll_ctrl> { using Reg<Dll_ctrl>::Reg; };
 
@@ -1142,13 +1316,16 @@ private:
   {
     l4_uint32_t word0, word1;
     CXX_BITFIELD_MEMBER(16, 31, length, word0);
+    CXX_BITFIELD_MEMBER(6, 15, length_hi, word0); ///< 26-bit data length mode
     CXX_BITFIELD_MEMBER(3, 5, act, word0);
     enum
     {
       Act_nop = 0,      ///< No operation.
+      Act_cmd = 1,      ///< ADMA3: Command descriptor (SD mode).
       Act_rsv = 2,      ///< Reserved.
       Act_tran = 4,     ///< Transfer data.
       Act_link = 6,     ///< Link descriptor.
+      Act_integrated = 7, ///< ADMA3: Integrated descriptor.
     };
     CXX_BITFIELD_MEMBER(2, 2, intr, word0);
     CXX_BITFIELD_MEMBER(1, 1, end, word0);
@@ -1158,9 +1335,21 @@ private:
     // do this here as well.
     static constexpr l4_size_t max_length = 32768;
 
+    // 26-bit data length mode (SDHCI 4.10): Cover a whole request.
+    static constexpr l4_size_t max_length26 = 1 << 25;
+
     void reset()
     { cxx::write_now(&word1, 0); cxx::write_now(&word0, 0); }
 
+    l4_uint32_t get_length() const
+    { return l4_uint32_t{length_hi()} << 16 | length(); }
+
+    void set_length(l4_uint32_t len)
+    {
+      length() = len & 0xffff;
+      length_hi() = len >> 16;
+    }
+
     Dma_addr get_addr() const
     { return cxx::access_once(&word1); }
 
@@ -1239,6 +1428,12 @@ public:
   /** IRQ handler. */
   Cmd *handle_irq();
 
+  /** Busy-poll for the end of the command phase, see Drv::cmd_poll_finished(). */
+  bool cmd_poll_finished(l4_uint64_t budget);
+
+  /** Abort the data transfer of the current command, see Drv::cmd_abort(). */
+  bool cmd_abort(Cmd *cmd, l4_uint32_t arg);
+
   /** Disable all controller interrupts. */
   void mask_interrupts();
 
@@ -1295,6 +1490,30 @@ public:
       }
   }
 
+  /**
+   * Return the re-tuning period in seconds announced by the controller or 0
+   * if the controller doesn't request periodic re-tuning.
+   */
+  unsigned retuning_period_s() const
+  {
+    unsigned count;
+    if (TYPE == Sdhci_type::Usdhc)
+      count = Reg_host_ctrl_cap(this).time_count_retuning();
+    else
+      count = Reg_cap2_sdhci(this).timer_count_retune();
+    // 0: disabled, 1..11: 2^(count-1) seconds, 15: other source.
+    return count >= 1 && count <= 11 ? 1U << (count - 1) : 0;
+  }
+
+  /** Return true if the controller requests re-tuning (re-tuning mode 2). */
+  bool retuning_requested() const
+  {
+    if (TYPE == Sdhci_type::Usdhc)
+      return Reg_pres_state(this).rtr();
+    else
+      return Reg_pres_state(this).rtr_sdhci();
+  }
+
   /** Return true if the power limit is supported by the controller. */
   constexpr bool supp_power_limit(Mmc::Power_limit power) const
   {
@@ -1317,6 +1536,18 @@ public:
   void reset_tuning();
   void enable_auto_tuning();
 
+  /**
+   * Return the sampling point found by the last successful tuning. Return
+   * false if the controller doesn't expose the sampling point.
+   */
+  bool tuning_point(l4_uint32_t *point) const;
+
+  /**
+   * Select a sampling point found by a previous tuning without tuning. Return
+   * false if not supported by the controller.
+   */
+  bool set_tuning_point(l4_uint32_t point);
+
   /** Return true if the card is busy. */
   constexpr bool card_busy() const
   {
@@ -1341,6 +1572,41 @@ public:
   /** Dump all controller registers if 'warn' debug level is enabled. */
   void dump() const;
 
+  /** Return true if the controller provides a command queue engine. */
+  bool cqe_available() const;
+
+  /** Enable the command queue engine for `depth` tasks. */
+  void cqe_enable(unsigned depth, l4_uint16_t rca);
+
+  /** Disable the command queue engine. */
+  void cqe_disable();
+
+  /** Halt the command queue engine to allow legacy commands or resume it. */
+  void cqe_halt(bool halt);
+
+  /**
+   * Configure interrupt coalescing of the command queue engine.
+   *
+   * \param count       Raise an interrupt after `count` completed tasks.
+   * \param timeout_us  Raise an interrupt at the latest `timeout_us` after the
+   *                    first completed task.
+   */
+  void cqe_set_coalescing(unsigned count, unsigned timeout_us);
+
+  /** Set up the descriptors for task `tag` and ring the doorbell. */
+  void cqe_task_submit(unsigned tag, Cmd *cmd);
+
+  /**
+   * Handle command queue engine interrupts.
+   *
+   * \param[out] done    Bitmap of successfully completed tasks.
+   * \param[out] failed  Bitmap of failed tasks.
+   * \param[out] errors  CRC error and timeout of failed tasks.
+   * \retval false  The interrupt was not triggered by the CQE.
+   */
+  bool cqe_handle_irq(l4_uint32_t *done, l4_uint32_t *failed,
+                      Cmd::Flags *errors);
+
 private:
   /**
    * Return the amount of memory used for ADMA2 descriptors which is required to
@@ -1385,9 +1651,15 @@ private:
   /** Helper for cmd_submit(): Set block size and block count. */
   void cmd_submit_set_block_size_and_count(Cmd const *cmd);
 
+  /** Return the largest SDMA buffer boundary suitable for `cmd`. */
+  unsigned sdma_boundary(Cmd const *cmd) const;
+
   /** Submit command to controller. */
   void cmd_submit(Cmd *cmd);
 
+  /** Set up the ADMA2 descriptors of a queued command in advance. */
+  void cmd_prepare(Cmd *cmd);
+
   /** Handle interrupts related to the command phase. */
   void handle_irq_cmd(Cmd *cmd, Reg_int_status is);
 
@@ -1408,35 +1680,166 @@ private:
 
   /** Set ADMA2 descriptors for a single memory region. */
   template<typename T>
-  T* adma2_set_descs_mem_region(T *desc, l4_uint64_t b_addr,
-                                l4_uint32_t b_size, bool terminate = true);
+  T* adma2_set_descs_mem_region(T *desc, T const *descs_end,
+                                l4_uint64_t b_addr, l4_uint32_t b_size,
+                                bool terminate = true);
 
   /** Set ADMA2 descriptors using inout() block request. */
   template<typename T>
-  void adma2_set_descs(T *descs, Cmd *cmd);
-  void adma2_set_descs_blocks(Cmd *cmd);
+  void adma2_set_descs(T *descs, T const *descs_end, Cmd *cmd);
+  void adma2_set_descs_blocks(unsigned slot, Cmd *cmd);
+
+  /**
+   * Size of a single ADMA2 descriptor list used for non-CQE commands. With
+   * ADMA3, this includes the ADMA3 descriptors preceding the ADMA2 list.
+   */
+  l4_size_t adma2_slot_size() const
+  { return _adma2_desc_mem.size() / Adma2_slots; }
+
+  /** Size of the ADMA3 descriptors at the start of each slot. */
+  l4_size_t adma3_descs_size() const
+  { return _adma3 ? Adma3_descs_size : 0; }
+
+  /** Offset of the ADMA2 descriptor list `slot` in `_adma2_desc_mem`. */
+  l4_size_t adma2_slot_offset(unsigned slot) const
+  { return slot * adma2_slot_size() + adma3_descs_size(); }
+
+  /** Start of the ADMA2 descriptor list `slot`. */
+  template<typename T>
+  T *adma2_slot_descs(unsigned slot) const
+  { return _adma2_desc_mem.get<T>(adma2_slot_offset(slot)); }
+
+  /** End of the ADMA2 descriptor list `slot`. */
+  template<typename T>
+  T const *adma2_descs_end(unsigned slot) const
+  {
+    return adma2_slot_descs<T>(slot)
+           + (adma2_slot_size() - adma3_descs_size()) / sizeof(T);
+  }
+
+  /** Return true if the ADMA2 descriptor list `slot` is in use. */
+  bool adma2_slot_busy(unsigned slot) const
+  {
+    Cmd const *owner = _adma2_slot_owner[slot];
+    return owner && owner->flags.enqueued() && owner->flags.descs_prepared();
+  }
+
+  /** Return the ADMA2 descriptor list prepared for `cmd` or -1. */
+  int adma2_slot_find(Cmd const *cmd) const;
+
+  /** Assign an unused ADMA2 descriptor list to `cmd`, return -1 if none. */
+  int adma2_slot_alloc(Cmd *cmd);
+
+  /** Set up the ADMA2 descriptors for `cmd` if not yet done. */
+  Dma_addr adma2_setup(Cmd *cmd);
+
+  /** Set up the ADMA3 descriptors of the current slot and start ADMA3. */
+  void adma3_submit(Cmd const *cmd, Reg_cmd_xfr_typ const &xt);
 
   /** Set ADMA2 descriptor using physical address + length (CMD8). */
-  void adma2_set_descs_memory_region(l4_addr_t phys, l4_uint32_t size);
+  void adma2_set_descs_memory_region(unsigned slot, l4_addr_t phys,
+                                     l4_uint32_t size);
 
   /** Dump ADMA2 descriptors. */
   template<typename T>
   void adma2_dump_descs(T const *desc) const;
   void adma2_dump_descs() const;
 
+  /** Read a register of the command queue engine. */
+  template<typename R>
+  R cqe_read() const
+  {
+    ++_mmio_ops;
+    return R(l4_uint32_t{_regs[Cqe + static_cast<unsigned>(R::offset())]});
+  }
+
+  /** Write a register of the command queue engine. */
+  template<typename R>
+  void cqe_write(R const &r)
+  {
+    Reg_write_delay::write_delayed(
+      this, Regs(Cqe + static_cast<unsigned>(R::offset())), r.raw);
+  }
+
+  /** Enable the controller interrupts used in CQE mode. */
+  void cqe_enable_ints();
+
+  /**
+   * Return true if the controller supports host version 4 mode with 64-bit
+   * ADMA2 addressing. Not used with SDMA because the SDMA address register
+   * moves in this mode.
+   */
+  bool v4_supported() const
+  {
+    return TYPE != Sdhci_type::Usdhc && dma_adma2()
+           && Reg_host_version(this).spec_vers() >= 3 // 4.00
+           && Reg_cap1_sdhci(this).bit64_v4();
+  }
+
+  /** Maximum data length of an ADMA2 descriptor. */
+  l4_size_t adma2_max_length() const
+  { return _v4_10 ? Adma2_desc_32::max_length26 : Adma2_desc_32::max_length; }
+
+  /** Size of a task slot: task descriptor + transfer (link) descriptor. */
+  unsigned cqe_slot_size() const
+  { return _adma2_64 ? 2 * sizeof(Adma2_desc_64) : 2 * sizeof(Adma2_desc_32); }
+
+  /** Maximum number of ADMA2 descriptors of a single task. */
+  unsigned cqe_descs_per_task() const
+  { return max_inout_req_size() / adma2_max_length() + _max_seg; }
+
+  /** Size of the ADMA2 descriptor list of a single task. */
+  l4_size_t cqe_descs_size() const
+  {
+    return cqe_descs_per_task() * (_adma2_64 ? sizeof(Adma2_desc_64)
+                                             : sizeof(Adma2_desc_32));
+  }
+
+  enum
+  {
+    /// Offset of the ADMA2 descriptor lists in `_cqe_desc_mem`. The task
+    /// descriptor list at offset 0 must be 1K-aligned.
+    Cqe_descs_offset = L4_PAGESIZE,
+
+    /// Number of ADMA2 descriptor lists for non-CQE commands: One for the
+    /// current command and one for the next command, see cmd_prepare().
+    Adma2_slots = 2,
+
+    /// ADMA3 descriptors at the start of each slot: The integrated descriptor
+    /// at offset 0 and the four command descriptors which must be directly
+    /// followed by the ADMA2 descriptors.
+    Adma3_cmd_descs_offset = 32,
+    Adma3_descs_size = 64,
+
+    /// SDMA buffer boundary Reg_blk_size::Bndry_4k.
+    Sdma_bndry_min = 4096,
+  };
+
   // ::::: Platform-specific :::::
   void init_platform(L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma);
   void done_platform();
   // :::::::::::::::::::::::::::::
 
+  bool _v4_mode;                        ///< Host version 4, 64-bit ADMA2.
+  bool _v4_10;                          ///< 4.10: 26-bit length, 32-bit count.
+  bool _adma3;                          ///< Inout commands use ADMA3.
   Inout_buffer _adma2_desc_mem;         ///< Dataspace for descriptor memory.
   Dma_addr _adma2_desc_phys;            ///< Physical address of ADMA2 descs.
   Adma2_desc_64 *_adma2_desc;           ///< ADMA2 descriptor list (32/64-bit).
+  Cmd *_adma2_slot_owner[Adma2_slots] = {}; ///< Commands using the lists.
+  unsigned _adma2_slot = 0;             ///< List of the current command.
+  l4_uint32_t _sdma_bndry = Sdma_bndry_min << Reg_blk_size::Bndry_512k;
+  mutable Shadow_regs _shadow;          ///< See reg_read() / reg_write().
   l4_addr_t _dma_offset = 0;            ///< DMA offset (bcm2835)
   Bcm2835_mbox *bcm2835_mbox = nullptr; ///< For iproc: SoC control over mailbox
   bool _ddr_active = false;             ///< True if double-data timing.
   bool _adma2_64 = false;               ///< True if 64-bit ADMA2.
   l4_uint32_t _host_clock;              ///< Reference clock frequency.
+  unsigned _max_seg;                    ///< Maximum segments per request.
+  L4Re::Util::Shared_cap<L4Re::Dma_space> _dma;
+  /// Task descriptor list + per-task ADMA2 descriptors (CQE only).
+  std::unique_ptr<Inout_buffer> _cqe_desc_mem;
+  l4_uint32_t _cqe_timer_khz = 0;       ///< Coalescing timer frequency (CQE).
 
   Dbg warn;
   Dbg info;
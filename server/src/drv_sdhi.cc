@@ -155,7 +155,10 @@ Sdhi::handle_irq_cmd(Cmd *cmd, Reg_sd_info sd_info)
       sd_info_ack.err6() = 0;
       sd_info_ack.write(_regs);
       if (sd_info.err6())
-        cmd->status = Cmd::Cmd_timeout;
+        {
+          cmd->status = Cmd::Cmd_timeout;
+          cmd->flags.timeout() = 1;
+        }
       else if (sd_info.error())
         cmd->status = Cmd::Cmd_error;
       else if (cmd->flags.has_data())
@@ -504,13 +507,15 @@ struct F_sdhi_rcar3 : Factory
          L4::Cap<L4Re::Dataspace> iocap, int irq_num, L4_irq_mode irq_mode,
          L4::Cap<L4::Icu> icu, L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma,
          L4Re::Util::Object_registry *registry, l4_uint32_t host_clock,
-         unsigned max_seg, Device_type_disable dt_disable)
+         unsigned max_seg, Device_type_disable dt_disable,
+         Io_sched_config const &sched_cfg)
   {
     L4::Cap<L4Re::Mmio_space> mmio_space;
     init_cpg();
     return cxx::make_ref_obj<Device<Sdhi>>(
              nr, mmio_addr, mmio_size, iocap, mmio_space, irq_num, irq_mode,
-             icu, dma, registry, host_clock, max_seg, dt_disable);
+             icu, dma, registry, host_clock, max_seg, dt_disable,
+             sched_cfg);
   }
 };
 
@@ -527,13 +532,15 @@ struct F_sdhi_emu : Factory
          L4::Cap<L4Re::Dataspace> iocap, int irq_num, L4_irq_mode irq_mode,
          L4::Cap<L4::Icu> icu, L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma,
          L4Re::Util::Object_registry *registry, l4_uint32_t host_clock,
-         unsigned max_seg, Device_type_disable dt_disable) override
+         unsigned max_seg, Device_type_disable dt_disable,
+         Io_sched_config const &sched_cfg) override
   {
     auto mmio_space = L4::cap_dynamic_cast<L4Re::Mmio_space>(iocap);
     init_cpg();
     return cxx::make_ref_obj<Device<Sdhi>>(
              nr, mmio_addr, mmio_size, iocap, mmio_space, irq_num, irq_mode,
-             icu, dma, registry, host_clock, max_seg, dt_disable);
+             icu, dma, registry, host_clock, max_seg, dt_disable,
+             sched_cfg);
   }
 };
 
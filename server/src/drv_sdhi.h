@@ -71,6 +71,14 @@ public:
   bool needs_tuning_sdr50() const
   { return false; }
 
+  /** Return the re-tuning period in seconds announced by the controller. */
+  unsigned retuning_period_s() const
+  { return 0; }
+
+  /** Return true if the controller requests re-tuning. */
+  bool retuning_requested() const
+  { return false; }
+
   /** Return true if the power limit is supported by the controller. */
   bool supp_power_limit(Mmc::Power_limit power) const
   { (void)power; return false; }
@@ -82,6 +90,14 @@ public:
   void reset_tuning() {}
   void enable_auto_tuning() {}
 
+  /** Return the sampling point found by tuning. */
+  bool tuning_point(l4_uint32_t *point) const
+  { (void)point; return false; }
+
+  /** Select a sampling point without tuning. */
+  bool set_tuning_point(l4_uint32_t point)
+  { (void)point; return false; }
+
   /** Return true if the card is busy. */
   bool card_busy() const
   { return !Reg_sd_info(_regs).dat0(); }
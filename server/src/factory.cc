@@ -131,7 +131,8 @@ cxx::Ref_ptr<Emmc::Base_device>
 Factory::create_dev(L4vbus::Pci_dev const &dev, l4vbus_device_t const &dev_info,
                     L4::Cap<L4vbus::Vbus> bus, L4::Cap<L4::Icu> icu,
                     L4Re::Util::Object_registry *registry, unsigned max_seg,
-                    Device_type_disable dt_disable)
+                    Device_type_disable dt_disable,
+                    Io_sched_config const &sched_cfg)
 {
   static unsigned device_nr = 0; // only for logging
 
@@ -203,7 +204,7 @@ Factory::create_dev(L4vbus::Pci_dev const &dev, l4vbus_device_t const &dev_info,
 
       return factory->create(device_nr++, mmio_addr, mmio_size, iocap, irq_num,
                              irq_mode, icu, dma, registry, host_clock, max_seg,
-                             dt_disable);
+                             dt_disable, sched_cfg);
     }
   catch (L4::Runtime_error const &e)
     {
@@ -104,7 +104,8 @@ public:
            L4::Cap<L4::Icu> icu,
            L4Re::Util::Shared_cap<L4Re::Dma_space> const &dma,
            L4Re::Util::Object_registry *registry, l4_uint32_t host_clock,
-           unsigned max_seg, Device_type_disable dt_disable) = 0;
+           unsigned max_seg, Device_type_disable dt_disable,
+           Io_sched_config const &sched_cfg) = 0;
 
   virtual l4_uint32_t guess_clock(l4_uint64_t mmio_addr);
 
@@ -114,7 +115,8 @@ public:
     create_dev(L4vbus::Pci_dev const &dev, l4vbus_device_t const &dev_info,
                L4::Cap<L4vbus::Vbus> bus, L4::Cap<L4::Icu> icu,
                L4Re::Util::Object_registry *registry,
-               unsigned max_seg, Device_type_disable device_type_disable);
+               unsigned max_seg, Device_type_disable device_type_disable,
+               Io_sched_config const &sched_cfg);
 
 private:
   static bool nopci_dev(L4vbus::Device const &dev,
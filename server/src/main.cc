@@ -29,6 +29,7 @@ static Dbg trace(Dbg::Trace, "main");
 
 static Emmc::Device_type_disable device_type_disable;
 static unsigned max_seg = 64;
+static Emmc::Io_sched_config io_sched;
 
 // Don't specify the partition number when creating a client. The partition is
 // already specified by setting `device` to the GUID of the corresponding GPT
@@ -54,7 +55,12 @@ static char const *usage_str =
 " --client CAP         Add a static client via the CAP capability\n"
 " --ds-max NUM         Specify maximum number of dataspaces the client can register\n"
 " --max-seg NUM        Specify maximum number of segments one vio request can have\n"
+" --io-sched [PSN=]POLICY\n"
+"                      Select the I/O scheduler for a device or for all devices\n"
+"                      (POLICY: fifo|deadline|read-prio)\n"
 " --readonly           Only allow read-only access to the device\n"
+" --fua                Complete writes only after they are stored persistently\n"
+" --flush-ordering     Flush requests only order writes (no persistence)\n"
 " --dma-map-all        Map the entire client dataspace permanently (default)\n"
 " --dma-map-per-req    Map/unmap client dataspace per request\n";
 
@@ -93,6 +99,8 @@ public:
     int num_ds = 2;
     bool readonly = false;
     bool dma_map_all = true;
+    bool fua = false;
+    bool flush_ordering = false;
 
     for (L4::Ipc::Varg p: valist)
       {
@@ -122,6 +130,10 @@ public:
           readonly = true;
         else if (strncmp(p.value<char const *>(), "dma-map-per-req", p.length()) == 0)
           dma_map_all = false;
+        else if (strncmp(p.value<char const *>(), "fua", p.length()) == 0)
+          fua = true;
+        else if (strncmp(p.value<char const *>(), "flush-ordering", p.length()) == 0)
+          flush_ordering = true;
       }
 
     if (device.empty())
@@ -132,7 +144,8 @@ public:
 
     L4::Cap<void> cap;
     int ret = create_dynamic_client(device, No_partno, num_ds, &cap, readonly,
-                                    [dma_map_all, device](Emmc::Base_device *b)
+                                    [dma_map_all, fua, flush_ordering,
+                                     device](Emmc::Base_device *b)
       {
         Dbg(Dbg::Warn).printf("%s for device '%s'.\033[m\n",
                               dma_map_all ? "\033[31;1mDMA-map-all enabled (default)"
@@ -142,6 +155,8 @@ public:
           pd->set_dma_map_all(dma_map_all);
         else
           b->set_dma_map_all(dma_map_all);
+        b->set_fua(fua);
+        b->set_flush_ordering(flush_ordering);
       });
     if (ret >= 0)
       {
@@ -234,8 +249,11 @@ struct Client_opts
         // Copy parameters for lambda capture. The object itself is ephemeral!
         std::string dev = device;
         bool map_all = dma_map_all;
+        bool fua_writes = fua;
+        bool ordering = flush_ordering;
         blk_mgr->add_static_client(cap, dev.c_str(), No_partno, ds_max, readonly,
-                                   [dev, map_all](Emmc::Base_device *b)
+                                   [dev, map_all, fua_writes,
+                                    ordering](Emmc::Base_device *b)
          {
            Dbg(Dbg::Warn).printf("%s for device '%s'\033[m\n",
                                  map_all ? "\033[31;1mDMA-map-all enabled (default)"
@@ -245,6 +263,8 @@ struct Client_opts
              pd->set_dma_map_all(map_all);
            else
              b->set_dma_map_all(map_all);
+           b->set_fua(fua_writes);
+           b->set_flush_ordering(ordering);
          });
       }
 
@@ -256,6 +276,8 @@ struct Client_opts
   int ds_max = 2;
   bool readonly = false;
   bool dma_map_all = true;
+  bool fua = false;
+  bool flush_ordering = false;
 };
 
 static Block_device::Errand::Errand_server server;
@@ -271,6 +293,7 @@ parse_args(int argc, char *const *argv)
   enum
   {
     OPT_MAX_SEG,
+    OPT_IO_SCHED,
 
     OPT_CLIENT,
     OPT_DEVICE,
@@ -278,6 +301,8 @@ parse_args(int argc, char *const *argv)
     OPT_READONLY,
     OPT_DMA_MAP_ALL,
     OPT_DMA_MAP_PER_REQ,
+    OPT_FUA,
+    OPT_FLUSH_ORDERING,
     OPT_DISABLE_MODE,
   };
 
@@ -288,6 +313,7 @@ parse_args(int argc, char *const *argv)
     { "quiet",          no_argument,            NULL,   'q' },
     { "disable-mode",   required_argument,      NULL,   OPT_DISABLE_MODE },
     { "max-seg",        required_argument,      NULL,   OPT_MAX_SEG },
+    { "io-sched",       required_argument,      NULL,   OPT_IO_SCHED },
 
     // per-client options
     { "client",          required_argument,      NULL,   OPT_CLIENT },
@@ -296,6 +322,8 @@ parse_args(int argc, char *const *argv)
     { "readonly",        no_argument,            NULL,   OPT_READONLY },
     { "dma-map-all",     no_argument,            NULL,   OPT_DMA_MAP_ALL },
     { "dma-map-per-req", no_argument,            NULL,   OPT_DMA_MAP_PER_REQ },
+    { "fua",             no_argument,            NULL,   OPT_FUA },
+    { "flush-ordering",  no_argument,            NULL,   OPT_FLUSH_ORDERING },
     { 0,                 0,                      NULL,   0, },
   };
 
@@ -376,6 +404,13 @@ parse_args(int argc, char *const *argv)
             max_seg = i;
             break;
           }
+        case OPT_IO_SCHED:
+          if (!io_sched.parse(optarg))
+            {
+              warn.printf("Invalid --io-sched=%s parameter\n", optarg);
+              return -1;
+            }
+          break;
 
         case OPT_CLIENT:
           if (!opts.add_client(&drv))
@@ -402,6 +437,12 @@ parse_args(int argc, char *const *argv)
         case OPT_DMA_MAP_PER_REQ:
           opts.dma_map_all = false;
           break;
+        case OPT_FUA:
+          opts.fua = true;
+          break;
+        case OPT_FLUSH_ORDERING:
+          opts.flush_ordering = true;
+          break;
         default:
           warn.printf(usage_str, argv[0]);
           return -1;
@@ -445,12 +486,22 @@ device_discovery(L4::Cap<L4vbus::Vbus> bus, L4::Cap<L4::Icu> icu)
       trace.printf("Scanning child 0x%lx (%s).\n", child.dev_handle(), di.name);
       auto dev = Emmc::Factory::create_dev(child, di, bus, icu,
                                            server.registry(), max_seg,
-                                           device_type_disable);
+                                           device_type_disable, io_sched);
       if (dev)
         {
           ++devices_found;
           ++devices_in_scan;
-          drv.add_disk(std::move(dev), device_scan_finished);
+          auto *parent = static_cast<Emmc::Base_parent_device *>(dev.get());
+          drv.add_disk(std::move(dev), [parent]()
+            {
+              // The hardware partitions are known after the device scan.
+              for (auto &hw_part : parent->hw_part_devices())
+                {
+                  ++devices_in_scan;
+                  drv.add_disk(std::move(hw_part), device_scan_finished);
+                }
+              device_scan_finished();
+            });
         }
     }
 
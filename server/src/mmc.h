@@ -109,6 +109,11 @@ public:
     Cmd39_fast_io               = 39 | Ac   | Resp_r4,
     Cmd40_go_irq_state          = 40 | Bcr  | Resp_r5,
     Cmd42_lock_unlock           = 42 | Adtc | Resp_r1b,
+    Cmd44_queued_task_params    = 44 | Ac   | Resp_r1,
+    Cmd45_queued_task_address   = 45 | Ac   | Resp_r1,
+    Cmd46_execute_read_task     = 46 | Adtc | Resp_r1  | Dir_read,
+    Cmd47_execute_write_task    = 47 | Adtc | Resp_r1,
+    Cmd48_cmdq_task_mgmt        = 48 | Ac   | Resp_r1b,
     Cmd52_io_rw_direct          = 52 | Ac   | Resp_r5,             // SD
     Cmd53_io_rw_extended        = 53 | Ac   | Resp_r5,
     Cmd55_app_cmd               = 55 | Ac   | Resp_r1,
@@ -263,6 +268,11 @@ public:
           || device_is_locked() || wp_violation() || erase_param()
           || block_len_error() || address_misalign() || address_out_of_range();
     }
+    bool erase_error_condition() const
+    {
+      return erase_seq_error() || erase_param() || wp_violation()
+          || illegal_command() || address_out_of_range();
+    }
   };
 
   /**
@@ -832,7 +842,12 @@ public:
     };
 
     l4_uint8_t ec0_reserved[15];
-    l4_uint8_t ec15_cmdq_mode_en;
+    struct Ec15_cmdq_mode_en : public Reg8<Reg15_cmdq_mode_en>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(0, 0, enable, raw);
+    };
+    Ec15_cmdq_mode_en ec15_cmdq_mode_en;
     l4_uint8_t ec16_secure_removal_type;
     l4_uint8_t ec17_product_state_awareness_enablement;
     l4_uint8_t ec18_max_pre_loading_data_size[4];
@@ -841,7 +856,12 @@ public:
     l4_uint8_t ec27_reserved[2];
     l4_uint8_t ec29_mode_operation_codes;
     l4_uint8_t ec30_mode_config;
-    l4_uint8_t ec31_barrier_ctrl;
+    struct Ec31_barrier_ctrl : public Reg8<Reg31_barrier_ctrl>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(0, 0, barrier_en, raw);
+    };
+    Ec31_barrier_ctrl ec31_barrier_ctrl;
     struct Ec32_flush_cache : public Reg8<Reg32_flush_cache>
     {
       using Reg8::Reg8;
@@ -870,10 +890,35 @@ public:
     };
     Ec34_power_off_notification ec34_power_off_notification;
     l4_uint8_t ec35_packed_failure_index;
-    l4_uint8_t ec36_packed_command_status;
+    struct Ec36_packed_command_status : public Reg8<Reg36_packed_command_status>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(1, 1, indexed_error, raw); ///< see ec35
+      CXX_BITFIELD_MEMBER(0, 0, error, raw);
+    };
+    Ec36_packed_command_status ec36_packed_command_status;
     l4_uint8_t ec37_context_conf[15];
     l4_uint8_t ec52_ext_partitions_attribute[2];
+    struct Ec54_exception_events_status
+    : public Reg8<Reg54_exception_events_status>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(4, 4, extended_security_failure, raw);
+      CXX_BITFIELD_MEMBER(3, 3, packed_failure, raw);
+      CXX_BITFIELD_MEMBER(2, 2, syspool_exhausted, raw);
+      CXX_BITFIELD_MEMBER(1, 1, dyncap_needed, raw);
+      CXX_BITFIELD_MEMBER(0, 0, urgent_bkops, raw);
+    };
     l4_uint8_t ec54_exception_events_status[2];
+    struct Ec56_exception_events_ctrl : public Reg8<Reg56_exception_events_ctrl>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(4, 4, extended_security_en, raw);
+      CXX_BITFIELD_MEMBER(3, 3, packed_event_en, raw);
+      CXX_BITFIELD_MEMBER(2, 2, syspool_event_en, raw);
+      CXX_BITFIELD_MEMBER(1, 1, dyncap_event_en, raw);
+      // URGENT_BKOPS is always enabled.
+    };
     l4_uint8_t ec56_exception_events_ctrl[2];
     l4_uint8_t ec58_dyncap_needed;
     l4_uint8_t ec59_class_6_ctrl;
@@ -909,10 +954,22 @@ public:
       CXX_BITFIELD_MEMBER(1, 1, auto_en, raw);
       CXX_BITFIELD_MEMBER(0, 0, manual_en, raw);
     };
-    l4_uint8_t ec163_bkops_en;
-    l4_uint8_t ec164_bkops_start;
+    Ec163_bkops_en ec163_bkops_en;
+    struct Ec164_bkops_start : public Reg8<Reg164_bkops_start>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(0, 7, start, raw); ///< any value starts BKOPS
+    };
+    Ec164_bkops_start ec164_bkops_start;
     l4_uint8_t ec165_sanitize_start;
-    l4_uint8_t ec166_wr_rel_param;
+    struct Ec166_wr_rel_param : public Reg8<Reg166_wr_rel_param>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(4, 4, en_rpmb_rel_wr, raw);
+      CXX_BITFIELD_MEMBER(2, 2, en_rel_wr, raw); ///< enhanced reliable write
+      CXX_BITFIELD_MEMBER(0, 0, hs_ctrl_rel, raw);
+    };
+    Ec166_wr_rel_param ec166_wr_rel_param;
     l4_uint8_t ec167_wr_rel_set;
     l4_uint8_t ec168_rpmb_size_mult;
     l4_uint8_t ec169_fw_config;
@@ -1150,7 +1207,15 @@ public:
     l4_uint8_t ec228_boot_info;
     l4_uint8_t ec229_sec_trim_mult;
     l4_uint8_t ec230_sec_erase_mult;
-    l4_uint8_t ec231_sec_feature_support;
+    struct Ec231_sec_feature_support : public Reg8<Reg231_sec_feature_support>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(6, 6, sec_sanitize, raw);
+      CXX_BITFIELD_MEMBER(4, 4, sec_gb_cl_en, raw); ///< TRIM supported
+      CXX_BITFIELD_MEMBER(2, 2, sec_bd_blk_en, raw);
+      CXX_BITFIELD_MEMBER(0, 0, secure_er_en, raw);
+    };
+    Ec231_sec_feature_support ec231_sec_feature_support;
     l4_uint8_t ec232_trim_mult;
     l4_uint8_t ec233_reserved;
     l4_uint8_t ec234_min_perf_ddr_r_8_52;
@@ -1159,10 +1224,27 @@ public:
     l4_uint8_t ec237_pwr_cl_200_195;
     l4_uint8_t ec238_pwr_cl_ddr_52_195;
     l4_uint8_t ec239_pwr_cl_ddr_52_360;
-    l4_uint8_t ec240_cache_flush_policy;
+    struct Ec240_cache_flush_policy : public Reg8<Reg240_cache_flush_policy>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(0, 0, fifo, raw); ///< cache flushed in FIFO order
+    };
+    Ec240_cache_flush_policy ec240_cache_flush_policy;
     l4_uint8_t ec241_ini_timeout_ap;
     l4_uint8_t ec242_correctly_prg_sectors_num[4];
-    l4_uint8_t ec246_bkops_status;
+    struct Ec246_bkops_status : public Reg8<Reg246_bkops_status>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(0, 1, level, raw);
+      enum
+      {
+        Not_required = 0,
+        Non_critical = 1,
+        Perf_impacted = 2,
+        Critical = 3,
+      };
+    };
+    Ec246_bkops_status ec246_bkops_status;
     l4_uint8_t ec247_power_off_long_time;
     l4_uint8_t ec248_generic_cmd6_time;
     l4_uint8_t ec249_cache_size[4];
@@ -1196,7 +1278,12 @@ public:
     };
     Ec308_cmdq_support ec308_cmdq_support;
     l4_uint8_t ec309_reserved[177];
-    l4_uint8_t ec486_barrier_support;
+    struct Ec486_barrier_support : public Reg8<Reg486_barrier_support>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(0, 0, barrier, raw);
+    };
+    Ec486_barrier_support ec486_barrier_support;
     l4_uint8_t ec487_fpu_arg[4];
     l4_uint8_t ec491_operation_code_timeout;
     l4_uint8_t ec492_ffu_features;
@@ -1209,8 +1296,19 @@ public:
     l4_uint8_t ec499_data_tag_support;
     l4_uint8_t ec500_max_packed_writes;
     l4_uint8_t ec501_max_packet_reads;
-    l4_uint8_t ec502_bkops_support;
-    l4_uint8_t ec503_hpi_features;
+    struct Ec502_bkops_support : public Reg8<Reg502_bkops_support>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(0, 0, supported, raw);
+    };
+    Ec502_bkops_support ec502_bkops_support;
+    struct Ec503_hpi_features : public Reg8<Reg503_hpi_features>
+    {
+      using Reg8::Reg8;
+      CXX_BITFIELD_MEMBER(1, 1, hpi_implementation, raw); ///< 1: CMD12
+      CXX_BITFIELD_MEMBER(0, 0, hpi_supported, raw);
+    };
+    Ec503_hpi_features ec503_hpi_features;
     l4_uint8_t ec504_s_cmd_set;
     l4_uint8_t ec505_ext_security_err;
     l4_uint8_t ec506_reserved[6];
@@ -1571,6 +1669,22 @@ public:
     };
   };
 
+  struct Arg_cmd12_stop_transmission : public Arg
+  {
+    using Arg::Arg;
+    CXX_BITFIELD_MEMBER(16, 31, rca, raw);
+    CXX_BITFIELD_MEMBER(0, 0, hpi, raw);
+  };
+
+  // eMMC spec: 6.10.4, Table 49
+  struct Arg_cmd13_send_status : public Arg
+  {
+    using Arg::Arg;
+    CXX_BITFIELD_MEMBER(16, 31, rca, raw);
+    CXX_BITFIELD_MEMBER(15, 15, sqs, raw);      ///< 1: send queue status
+    CXX_BITFIELD_MEMBER(0, 0, hpi, raw);
+  };
+
   struct Arg_cmd8_send_if_cond : public Arg
   {
     using Arg::Arg;
@@ -1611,6 +1725,54 @@ public:
     CXX_BITFIELD_MEMBER(31, 31, reliable_write, raw);
   };
 
+  /// Argument of CMD38 (ERASE).
+  struct Arg_cmd38_erase : public Arg
+  {
+    using Arg::Arg;
+    CXX_BITFIELD_MEMBER(31, 31, secure, raw);
+    CXX_BITFIELD_MEMBER(15, 15, force_gc, raw);
+    CXX_BITFIELD_MEMBER(0, 1, type, raw);
+    enum Type
+    {
+      Erase = 0,                ///< Erase groups.
+      Trim = 1,                 ///< Write blocks, content is erased.
+      Discard = 3,              ///< Write blocks, content is undefined.
+    };
+  };
+
+  // eMMC spec: 6.6.39.1
+  struct Arg_cmd44_queued_task_params : public Arg
+  {
+    using Arg::Arg;
+    CXX_BITFIELD_MEMBER(0, 15, blocks, raw);
+    CXX_BITFIELD_MEMBER(16, 20, task_id, raw);
+    CXX_BITFIELD_MEMBER(23, 23, priority, raw);
+    CXX_BITFIELD_MEMBER(24, 24, forced_prg, raw);
+    CXX_BITFIELD_MEMBER(25, 28, context_id, raw);
+    CXX_BITFIELD_MEMBER(29, 29, tag_request, raw);
+    CXX_BITFIELD_MEMBER(30, 30, data_dir, raw);         ///< 1: read, 0: write
+    CXX_BITFIELD_MEMBER(31, 31, reliable_write, raw);
+  };
+
+  /// Argument of CMD46 (EXECUTE_READ_TASK) and CMD47 (EXECUTE_WRITE_TASK).
+  struct Arg_cmd46_execute_task : public Arg
+  {
+    using Arg::Arg;
+    CXX_BITFIELD_MEMBER(16, 20, task_id, raw);
+  };
+
+  struct Arg_cmd48_cmdq_task_mgmt : public Arg
+  {
+    using Arg::Arg;
+    CXX_BITFIELD_MEMBER(16, 20, task_id, raw);
+    CXX_BITFIELD_MEMBER(0, 3, tm_op_code, raw);
+    enum Tm_op_code
+    {
+      Discard_queue = 1,
+      Discard_task = 2,
+    };
+  };
+
   /**
    * SD Specification Part 1 (Physical Layer Simplified Specification).
    * Table 4-31: Argument of ACMD6.
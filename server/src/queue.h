@@ -8,6 +8,11 @@
 
 #pragma once
 
+#include <l4/cxx/bitfield>
+#include <l4/cxx/minmax>
+
+#include "cmd.h"
+
 namespace Emmc {
 
 // Command Queue Engine according to eMMC
@@ -39,6 +44,251 @@ enum Regs
   Cqcra         = 0x5c, ///< CQ Command Response Argument
 };
 
+enum
+{
+  Max_tasks = 32,       ///< Number of task slots provided by a CQE.
+};
+
+/**
+ * Value of a CQE register. The register offset relative to the CQE base is
+ * stored in the `offs` template parameter. Reading from and writing to the
+ * controller is done by the host controller driver.
+ */
+template <Regs offs>
+struct Reg
+{
+  explicit Reg() : raw(0) {}
+  explicit Reg(l4_uint32_t v) : raw(v) {}
+  static constexpr Regs offset() { return offs; }
+  l4_uint32_t raw;
+};
+
+/// 0x00: CQ Version
+struct Reg_cqver : public Reg<Cqver>
+{
+  using Reg<Cqver>::Reg;
+  CXX_BITFIELD_MEMBER(8, 11, ver_major, raw);
+  CXX_BITFIELD_MEMBER(4, 7, ver_minor, raw);
+  CXX_BITFIELD_MEMBER(0, 3, ver_suffix, raw);
+};
+
+/// 0x04: CQ Capabilities
+struct Reg_cqcap : public Reg<Cqcap>
+{
+  using Reg<Cqcap>::Reg;
+  CXX_BITFIELD_MEMBER(12, 15, itcfmul, raw);    ///< Timer clock multiplier
+  CXX_BITFIELD_MEMBER(0, 9, itcfval, raw);      ///< Timer clock value
+
+  /** Frequency of the interrupt coalescing timer clock in kHz. */
+  l4_uint32_t timer_khz() const
+  {
+    // itcfmul: 0 = 0.001 MHz, 1 = 0.01 MHz, ..., 4 = 10 MHz
+    if (itcfmul() > 4)
+      return 0;
+    l4_uint32_t khz = itcfval();
+    for (unsigned i = 0; i < itcfmul(); ++i)
+      khz *= 10;
+    return khz;
+  }
+};
+
+/// 0x08: CQ Configuration
+struct Reg_cqcfg : public Reg<Cqcfg>
+{
+  using Reg<Cqcfg>::Reg;
+  CXX_BITFIELD_MEMBER(12, 12, dcmd_en, raw);        ///< Direct command enable
+  CXX_BITFIELD_MEMBER(8, 8, task_desc_size, raw);   ///< 0: 64-bit, 1: 128-bit
+  CXX_BITFIELD_MEMBER(0, 0, cqe_en, raw);           ///< CQE enable
+};
+
+/// 0x0c: CQ Control
+struct Reg_cqctl : public Reg<Cqctl>
+{
+  using Reg<Cqctl>::Reg;
+  CXX_BITFIELD_MEMBER(8, 8, clear_all_tasks, raw);
+  CXX_BITFIELD_MEMBER(0, 0, halt, raw);
+};
+
+/// 0x10 .. 0x18: CQ Interrupt Status / Status Enable / Signal Enable
+template <Regs offs>
+struct Reg_cqint : public Reg<offs>
+{
+  using Reg<offs>::Reg;
+  using Reg<offs>::raw;
+  CXX_BITFIELD_MEMBER(3, 3, tcl, raw);  ///< Task cleared
+  CXX_BITFIELD_MEMBER(2, 2, red, raw);  ///< Response error detected
+  CXX_BITFIELD_MEMBER(1, 1, tcc, raw);  ///< Task complete
+  CXX_BITFIELD_MEMBER(0, 0, hac, raw);  ///< Halt complete
+
+  void enable_all()
+  {
+    tcl() = 1;
+    red() = 1;
+    tcc() = 1;
+    hac() = 1;
+  }
+};
+using Reg_cqis = Reg_cqint<Cqis>;
+using Reg_cqiste = Reg_cqint<Cqiste>;
+using Reg_cqisge = Reg_cqint<Cqisge>;
+
+/// 0x1c: CQ Interrupt Coalescing
+struct Reg_cqic : public Reg<Cqic>
+{
+  using Reg<Cqic>::Reg;
+  CXX_BITFIELD_MEMBER(31, 31, icen, raw);       ///< Coalescing enable
+  CXX_BITFIELD_MEMBER(20, 20, icsb, raw);       ///< Coalescing status
+  CXX_BITFIELD_MEMBER(16, 16, icctr, raw);      ///< Counter and timer reset
+  CXX_BITFIELD_MEMBER(15, 15, icctthwen, raw);  ///< Counter threshold write en
+  CXX_BITFIELD_MEMBER(8, 12, icctth, raw);      ///< Counter threshold
+  CXX_BITFIELD_MEMBER(7, 7, ictovalwen, raw);   ///< Timeout value write enable
+  CXX_BITFIELD_MEMBER(0, 6, ictoval, raw);      ///< Timeout value
+};
+
+/// 0x20 / 0x24: CQ Task Descriptor List Base Address
+struct Reg_cqtdlba : public Reg<Cqtdlba> { using Reg<Cqtdlba>::Reg; };
+struct Reg_cqtdlbau : public Reg<Cqtdlbau> { using Reg<Cqtdlbau>::Reg; };
+
+/// 0x28 .. 0x38: Bitmaps with one bit per task slot
+struct Reg_cqtdbr : public Reg<Cqtdbr> { using Reg<Cqtdbr>::Reg; };
+struct Reg_cqtcn : public Reg<Cqtcn> { using Reg<Cqtcn>::Reg; };
+struct Reg_cqdqs : public Reg<Cqdqs> { using Reg<Cqdqs>::Reg; };
+struct Reg_cqdpt : public Reg<Cqdpt> { using Reg<Cqdpt>::Reg; };
+struct Reg_cqtclr : public Reg<Cqtclr> { using Reg<Cqtclr>::Reg; };
+
+/// 0x40: CQ Send Status Configuration 1
+struct Reg_cqssc1 : public Reg<Cqssc1>
+{
+  using Reg<Cqssc1>::Reg;
+  CXX_BITFIELD_MEMBER(16, 19, cbc, raw);        ///< CMD13 block counter
+  CXX_BITFIELD_MEMBER(0, 15, cit, raw);         ///< CMD13 idle timer
+};
+
+/// 0x44: CQ Send Status Configuration 2
+struct Reg_cqssc2 : public Reg<Cqssc2>
+{
+  using Reg<Cqssc2>::Reg;
+  CXX_BITFIELD_MEMBER(0, 15, rca, raw);         ///< Relative card address
+};
+
+/// 0x54: CQ Task Error Information
+struct Reg_cqterri : public Reg<Cqterri>
+{
+  using Reg<Cqterri>::Reg;
+  CXX_BITFIELD_MEMBER(31, 31, dtefv, raw);      ///< Data error fields valid
+  CXX_BITFIELD_MEMBER(24, 28, dteti, raw);      ///< Data error task ID
+  CXX_BITFIELD_MEMBER(16, 21, dtecmdi, raw);    ///< Data error command index
+  CXX_BITFIELD_MEMBER(15, 15, rmefv, raw);      ///< Response error fields valid
+  CXX_BITFIELD_MEMBER(8, 12, rmeti, raw);       ///< Response error task ID
+  CXX_BITFIELD_MEMBER(0, 5, rmecmdi, raw);      ///< Response error command idx
+};
+
+/**
+ * Task descriptor (eMMC 5.1 specification, B.3.1).
+ *
+ * In the task descriptor list, each task descriptor is followed by a transfer
+ * descriptor. We always use an ADMA2 link descriptor there which points to
+ * the list of ADMA2 transfer descriptors for the data of this task.
+ */
+struct Task_desc
+{
+  explicit Task_desc() : raw(0) {}
+
+  l4_uint64_t raw;
+  CXX_BITFIELD_MEMBER(32, 63, blk_addr, raw);   ///< Block address
+  CXX_BITFIELD_MEMBER(16, 31, blk_count, raw);  ///< Number of blocks
+  CXX_BITFIELD_MEMBER(15, 15, rel_write, raw);  ///< Reliable write
+  CXX_BITFIELD_MEMBER(14, 14, qbar, raw);       ///< Queue barrier
+  CXX_BITFIELD_MEMBER(13, 13, priority, raw);   ///< 1: high priority
+  CXX_BITFIELD_MEMBER(12, 12, data_dir, raw);   ///< 1: read, 0: write
+  CXX_BITFIELD_MEMBER(11, 11, tag_request, raw);
+  CXX_BITFIELD_MEMBER(7, 10, context_id, raw);
+  CXX_BITFIELD_MEMBER(6, 6, forced_prg, raw);   ///< Forced programming
+  CXX_BITFIELD_MEMBER(3, 5, act, raw);
+  enum { Act_task = 5 };
+  CXX_BITFIELD_MEMBER(2, 2, intr, raw);
+  CXX_BITFIELD_MEMBER(1, 1, end, raw);
+  CXX_BITFIELD_MEMBER(0, 0, valid, raw);
+
+  /**
+   * Write the descriptor to (uncached) descriptor memory. The upper 64 bits
+   * of a 128-bit task descriptor are reserved.
+   */
+  void write(l4_uint32_t *dst, bool desc_128) const
+  {
+    cxx::write_now(&dst[0], l4_uint32_t(raw));
+    cxx::write_now(&dst[1], l4_uint32_t(raw >> 32));
+    if (desc_128)
+      {
+        cxx::write_now(&dst[2], 0U);
+        cxx::write_now(&dst[3], 0U);
+      }
+  }
+};
+
+/**
+ * Task slots of the command queue.
+ *
+ * In contrast to `Cmd_queue`, tasks are completed in the order chosen by the
+ * device, so each slot is allocated and released individually. The slot
+ * number is the task ID used for the CQE doorbell and completion registers.
+ */
+class Tasks
+{
+public:
+  explicit Tasks() {}
+
+  /** Limit the number of usable slots to the queue depth of the device. */
+  void set_depth(unsigned depth)
+  { _depth = cxx::min<unsigned>(depth, Max_tasks); }
+
+  unsigned depth() const
+  { return _depth; }
+
+  /** Number of tasks currently owned by the CQE. */
+  unsigned num_busy() const
+  { return __builtin_popcount(_busy); }
+
+  /** Bitmap of the tasks currently owned by the CQE. */
+  l4_uint32_t busy() const
+  { return _busy; }
+
+  /** Allocate a free slot, return nullptr if all slots are in use. */
+  Cmd *alloc()
+  {
+    for (unsigned tag = 0; tag < _depth; ++tag)
+      if (!(_busy & (1U << tag)))
+        {
+          _busy |= 1U << tag;
+          Cmd *cmd = &_tasks[tag];
+          cmd->status = Cmd::Uninitialized;
+          return cmd;
+        }
+    return nullptr;
+  }
+
+  /** Release the slot of a completed task. */
+  void free(Cmd *cmd)
+  {
+    _busy &= ~(1U << tag(cmd));
+    cmd->status = Cmd::Error;
+    cmd->flags.reset();
+    // invalidating this callback is actually important
+    cmd->cb_io = nullptr;
+  }
+
+  unsigned tag(Cmd const *cmd) const
+  { return cmd - _tasks; }
+
+  Cmd *task(unsigned tag)
+  { return &_tasks[tag]; }
+
+private:
+  Cmd _tasks[Max_tasks];
+  l4_uint32_t _busy = 0;
+  unsigned _depth = 0;
+};
+
 } // namespace Cqe
 
 } // namespace Emmc
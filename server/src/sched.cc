@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): agent <agent@local>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <cstring>
+
+#include "sched.h"
+
+namespace Emmc {
+
+bool
+Io_sched::enqueue(Request const &r, l4_cpu_time_t now)
+{
+  if (full())
+    return false;
+
+  Request &e = _queue[r.inout_read].emplace_back(r);
+  e.expires = now + (r.inout_read ? Read_expire_us : Write_expire_us);
+  return true;
+}
+
+/**
+ * Select the next request of a queue: An expired request first, then the
+ * request continuing the previously dispatched request (so it can be merged
+ * into the previous command), then the oldest request.
+ */
+std::deque<Io_sched::Request>::iterator
+Io_sched::pick(std::deque<Request> &q, l4_cpu_time_t now)
+{
+  if (_policy == Deadline && q.front().expires <= now)
+    return q.begin();
+
+  for (auto it = q.begin(); it != q.end(); ++it)
+    if (it->sector == _next_sector)
+      return it;
+
+  return q.begin();
+}
+
+Io_sched::Request
+Io_sched::dequeue(l4_cpu_time_t now)
+{
+  auto &writes = _queue[0];
+  auto &reads = _queue[1];
+
+  bool read;
+  if (reads.empty() || writes.empty())
+    read = !reads.empty();
+  else if (_policy == Read_prio)
+    read = true;
+  else
+    {
+      // Serve the request which expired first. Otherwise prefer reads but
+      // dispatch a write after `Writes_starved` reads.
+      l4_cpu_time_t r_expires = reads.front().expires;
+      l4_cpu_time_t w_expires = writes.front().expires;
+      if (w_expires <= now && w_expires < r_expires)
+        read = false;
+      else if (r_expires <= now)
+        read = true;
+      else
+        read = _reads_dispatched < Writes_starved;
+    }
+
+  if (!read)
+    _reads_dispatched = 0;
+  else if (!writes.empty())
+    ++_reads_dispatched;
+
+  auto &q = _queue[read];
+  auto it = pick(q, now);
+  Request r = *it;
+  q.erase(it);
+
+  _next_sector = r.sector;
+  for (auto const *b = r.blocks; b; b = b->next.get())
+    _next_sector += b->num_sectors;
+
+  return r;
+}
+
+char const *
+Io_sched::policy_str(Policy policy)
+{
+  switch (policy)
+    {
+    case Fifo:      return "fifo";
+    case Deadline:  return "deadline";
+    case Read_prio: return "read-prio";
+    }
+  return "unknown";
+}
+
+bool
+Io_sched::parse_policy(char const *s, Policy *policy)
+{
+  for (Policy p : { Fifo, Deadline, Read_prio })
+    if (!strcmp(s, policy_str(p)))
+      {
+        *policy = p;
+        return true;
+      }
+  return false;
+}
+
+bool
+Io_sched_config::parse(char const *arg)
+{
+  char const *eq = strchr(arg, '=');
+  Io_sched::Policy p;
+  if (!Io_sched::parse_policy(eq ? eq + 1 : arg, &p))
+    return false;
+
+  if (eq)
+    devices[std::string(arg, eq - arg)] = p;
+  else
+    dflt = p;
+  return true;
+}
+
+} // namespace Emmc
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): agent <agent@local>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+/**
+ * \file
+ * I/O scheduler.
+ *
+ * Inout requests are held back by the scheduler and passed to the command
+ * queue in the order determined by the scheduling policy.
+ */
+
+#pragma once
+
+#include <deque>
+#include <map>
+#include <string>
+
+#include <l4/libblock-device/types.h>
+
+namespace Emmc {
+
+class Io_sched
+{
+public:
+  enum Policy
+  {
+    Fifo,                       ///< No scheduling, queue requests immediately.
+    Deadline,                   ///< Sequential first, read/write expiry.
+    Read_prio,                  ///< Dispatch reads before writes.
+  };
+
+  enum
+  {
+    Max_pending = 64,           ///< Maximum number of held back requests.
+    Read_expire_us = 50000,     ///< Deadline: Expiry of read requests [us].
+    Write_expire_us = 500000,   ///< Deadline: Expiry of write requests [us].
+    Writes_starved = 2,         ///< Deadline: Reads preferred over writes.
+  };
+
+  struct Request
+  {
+    l4_uint64_t sector;
+    Block_device::Inout_block const *blocks;
+    Block_device::Inout_callback cb;
+    bool inout_read;
+    bool reliable;              ///< Write with forced unit access.
+    l4_cpu_time_t expires;      ///< Dispatch not later than this time [us].
+  };
+
+  explicit Io_sched(Policy policy = Fifo) : _policy(policy) {}
+
+  Policy policy() const
+  { return _policy; }
+
+  /** Return true if requests are held back by the scheduler. */
+  bool active() const
+  { return _policy != Fifo; }
+
+  bool empty() const
+  { return _queue[0].empty() && _queue[1].empty(); }
+
+  /** Return true if read requests are held back. */
+  bool reads_pending() const
+  { return !_queue[1].empty(); }
+
+  bool full() const
+  { return _queue[0].size() + _queue[1].size() >= Max_pending; }
+
+  /**
+   * Hold back a request.
+   *
+   * \retval false  Too many pending requests, try again later.
+   */
+  bool enqueue(Request const &r, l4_cpu_time_t now);
+
+  /** Remove the request to be dispatched next. The scheduler must not be empty. */
+  Request dequeue(l4_cpu_time_t now);
+
+  /** Hold back a dequeued request again which could not be dispatched. */
+  void requeue(Request const &r)
+  {
+    _queue[r.inout_read].push_front(r);
+    _next_sector = r.sector;
+  }
+
+  static char const *policy_str(Policy policy);
+
+  /** Parse a policy name. Return false if the name is unknown. */
+  static bool parse_policy(char const *s, Policy *policy);
+
+private:
+  std::deque<Request>::iterator pick(std::deque<Request> &q, l4_cpu_time_t now);
+
+  std::deque<Request> _queue[2];  ///< Pending requests: [0] write, [1] read.
+  l4_uint64_t _next_sector = 0;   ///< Sector following the last dispatch.
+  unsigned _reads_dispatched = 0; ///< Deadline: reads while writes waited.
+  Policy _policy;
+};
+
+/**
+ * Scheduling policy per device as specified on the command line.
+ */
+struct Io_sched_config
+{
+  /**
+   * Parse `[PSN=]POLICY`. The PSN is the HID of the device as for `--device`.
+   * Without PSN, set the policy for all devices not mentioned explicitly.
+   */
+  bool parse(char const *arg);
+
+  Io_sched::Policy policy(char const *hid) const
+  {
+    auto it = devices.find(hid);
+    return it != devices.end() ? it->second : dflt;
+  }
+
+  Io_sched::Policy dflt = Io_sched::Fifo;
+  std::map<std::string, Io_sched::Policy> devices;
+};
+
+} // namespace Emmc
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): agent <agent@local>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+#include <cstring>
+
+#include <l4/re/env>
+#include <l4/re/error_helper>
+
+#include "tuning_cache.h"
+
+namespace Emmc {
+
+void
+Tuning_cache::attach(char const *cap_name, Dbg const &dbg)
+{
+  auto cap = L4Re::Env::env()->get_cap<L4Re::Dataspace>(cap_name);
+  if (!cap.is_valid())
+    return;
+
+  if (cap->size() < sizeof(Table))
+    L4Re::throw_error(-L4_EINVAL, "Tuning cache dataspace too small");
+
+  auto rm = L4Re::Env::env()->rm();
+  L4Re::chksys(rm->attach(&_region, sizeof(Table),
+                          L4Re::Rm::F::Search_addr | L4Re::Rm::F::RW,
+                          L4::Ipc::make_cap_rw(cap)),
+               "Attach tuning cache");
+  _table = _region.get();
+
+  if (   _table->magic != Magic || _table->version != Version
+      || _table->num > Max_entries || _table->csum != checksum())
+    {
+      dbg.printf("Initializing tuning cache.\n");
+      memset(_table, 0, sizeof(Table));
+      _table->magic = Magic;
+      _table->version = Version;
+      commit();
+    }
+  else
+    dbg.printf("Tuning cache with %u entries.\n", _table->num);
+}
+
+Tuning_cache::Entry *
+Tuning_cache::find(Key const &key)
+{
+  if (!_table)
+    return nullptr;
+
+  for (unsigned i = 0; i < _table->num; ++i)
+    {
+      Entry *e = &_table->entries[i];
+      if (   !memcmp(e->key.cid, key.cid, sizeof(key.cid))
+          && e->key.controller == key.controller
+          && e->key.timing == key.timing)
+        return e;
+    }
+  return nullptr;
+}
+
+void
+Tuning_cache::store(Key const &key, bool tuned, bool has_point,
+                    l4_uint32_t point)
+{
+  if (!_table)
+    return;
+
+  Entry *e = find(key);
+  if (!e)
+    {
+      // Table full: Replace the oldest entry.
+      if (_table->num == Max_entries)
+        remove(&_table->entries[0]);
+      e = &_table->entries[_table->num++];
+    }
+
+  memset(e, 0, sizeof(*e));
+  e->key = key;
+  e->tuned = tuned;
+  e->has_point = has_point;
+  e->point = point;
+  commit();
+}
+
+bool
+Tuning_cache::skip_failed(Entry *e)
+{
+  if (++e->skips >= Failed_skips)
+    {
+      remove(e);
+      return false;
+    }
+
+  commit();
+  return true;
+}
+
+void
+Tuning_cache::remove(Entry *e)
+{
+  Entry *end = &_table->entries[_table->num];
+  memmove(e, e + 1, (end - e - 1) * sizeof(Entry));
+  --_table->num;
+  commit();
+}
+
+l4_uint32_t
+Tuning_cache::checksum() const
+{
+  // FNV-1a
+  l4_uint32_t h = 2166136261U;
+  auto const *p = reinterpret_cast<l4_uint8_t const *>(&_table->num);
+  for (unsigned i = 0; i < sizeof(_table->num); ++i)
+    h = (h ^ p[i]) * 16777619U;
+  p = reinterpret_cast<l4_uint8_t const *>(_table->entries);
+  for (unsigned i = 0; i < _table->num * sizeof(Entry); ++i)
+    h = (h ^ p[i]) * 16777619U;
+  return h;
+}
+
+void
+Tuning_cache::commit()
+{
+  _table->csum = checksum();
+}
+
+} // namespace Emmc
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2026 Kernkonzept GmbH.
+ * Author(s): agent <agent@local>
+ *
+ * License: see LICENSE.spdx (in this directory or the directories above)
+ */
+
+/**
+ * \file
+ * Persistent cache of tuning results.
+ *
+ * Tuning for HS200 / SDR104 sends up to 40 tuning blocks and a failed tuning
+ * restarts mode selection with the next slower mode. The outcome of tuning is
+ * stored per device (CID), controller (MMIO address) and timing in a dataspace
+ * provided by the environment so that the next start can skip tuning.
+ */
+
+#pragma once
+
+#include <l4/re/dataspace>
+#include <l4/re/rm>
+
+#include "debug.h"
+
+namespace Emmc {
+
+class Tuning_cache
+{
+public:
+  enum
+  {
+    Magic = 0x54434d45,         ///< 'EMCT'
+    Version = 1,
+    Max_entries = 16,
+    Failed_skips = 16,          ///< Starts skipping a failed mode before retry.
+  };
+
+  struct Key
+  {
+    l4_uint32_t cid[4];         ///< Card identification.
+    l4_uint64_t controller;     ///< Controller MMIO address.
+    l4_uint32_t timing;         ///< Mmc::Timing.
+  };
+
+  struct Entry
+  {
+    Key key;
+    l4_uint32_t point;          ///< Sampling point, valid if `has_point`.
+    l4_uint8_t tuned;           ///< Tuning succeeded.
+    l4_uint8_t has_point;       ///< Controller reported the sampling point.
+    l4_uint16_t skips;          ///< Starts which skipped this failed mode.
+  };
+
+  /**
+   * Attach the dataspace `cap_name`. Without this capability, the cache is
+   * disabled. Invalid content is discarded.
+   */
+  void attach(char const *cap_name, Dbg const &dbg);
+
+  bool active() const
+  { return _table; }
+
+  /** Return the cached result for `key` or nullptr. */
+  Entry *find(Key const &key);
+
+  /** Store the result of a full tuning. */
+  void store(Key const &key, bool tuned, bool has_point, l4_uint32_t point);
+
+  /**
+   * Account a start which skipped the mode of a failed entry.
+   *
+   * \retval true   Skip the mode.
+   * \retval false  The entry was dropped, retry tuning for the mode.
+   */
+  bool skip_failed(Entry *e);
+
+  /** Drop a cached result, for example if verifying the sampling point failed. */
+  void remove(Entry *e);
+
+private:
+  struct Table
+  {
+    l4_uint32_t magic;
+    l4_uint32_t version;
+    l4_uint32_t num;
+    l4_uint32_t csum;           ///< Checksum over `num` and `entries`.
+    Entry entries[Max_entries];
+  };
+
+  l4_uint32_t checksum() const;
+  void commit();
+
+  L4Re::Rm::Unique_region<Table *> _region;
+  Table *_table = nullptr;
+};
+
+} // namespace Emmc